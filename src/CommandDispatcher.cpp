@@ -0,0 +1,140 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include "CommandDispatcher.h"
+#include "CommandHandler.h"
+
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+CommandDispatchTable::CommandDispatchTable(const ChatCommand *table, const std::string &prefix) :
+		m_table(table)
+{
+	while (m_table[m_count].name != nullptr) {
+		m_count++;
+	}
+
+	// Two slots per command keeps the seed search short
+	uint32_t slot_count = 1;
+	while (slot_count < m_count * 2) {
+		slot_count <<= 1;
+	}
+	m_mask = slot_count - 1;
+
+	m_seed = 0;
+	while (!build_slots(m_seed)) {
+		m_seed++;
+	}
+
+	m_command_list = "Command list : ";
+	for (size_t i = 0; i < m_count; ++i) {
+		m_command_list += std::string(m_table[i].name) + ", ";
+
+		const ChatCommand *child = m_table[i].childCommand;
+		const std::string full_name = prefix + m_table[i].name;
+		m_children.push_back(child ? new CommandDispatchTable(child, full_name + " ") : nullptr);
+
+		const std::string labels = "command=\"" + full_name + "\"";
+		m_duration_metrics.push_back(Metrics::register_histogram("bot_command_duration_seconds", labels,
+				"Time spent running chat commands"));
+		m_failure_metrics.push_back(Metrics::register_counter("bot_command_failures_total", labels,
+				"Chat commands which replied with an error"));
+
+		std::string help = "";
+		if (child) {
+			help = m_table[i].help + "\n";
+			for (size_t j = 0; child[j].name != nullptr; ++j) {
+				help += std::string(child[j].name) + "\n";
+				help += "		" + child[j].help + "\n";
+			}
+		}
+		m_subcommand_help.push_back(help);
+	}
+}
+
+CommandDispatchTable::~CommandDispatchTable()
+{
+	for (auto &child: m_children) {
+		delete child;
+	}
+}
+
+bool CommandDispatchTable::build_slots(const uint32_t seed)
+{
+	m_slots.assign(m_mask + 1, -1);
+	for (size_t i = 0; i < m_count; ++i) {
+		const char *name = m_table[i].name;
+		int16_t &slot = m_slots[hash(name, strlen(name), seed) & m_mask];
+		if (slot != -1) {
+			return false;
+		}
+		slot = (int16_t) i;
+	}
+	return true;
+}
+
+uint32_t CommandDispatchTable::hash(const char *data, const size_t length, const uint32_t seed)
+{
+	uint32_t h = FNV_OFFSET_BASIS ^ seed;
+	for (size_t i = 0; i < length; ++i) {
+		h ^= (uint8_t) data[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+int32_t CommandDispatchTable::find(const CommandToken &token) const
+{
+	int16_t index = m_slots[hash(token.data, token.length, m_seed) & m_mask];
+	if (index < 0) {
+		return -1;
+	}
+
+	const char *name = m_table[index].name;
+	if (strncmp(name, token.data, token.length) != 0 || name[token.length] != '\0') {
+		return -1;
+	}
+
+	return index;
+}
+
+CommandToken CommandDispatchTable::next_token(const char *&text)
+{
+	CommandToken token;
+	token.data = text;
+
+	while (*text != ' ' && *text != '\0') {
+		++text;
+	}
+	token.length = (size_t) (text - token.data);
+
+	// Skip whitespaces
+	while (*text == ' ') {
+		++text;
+	}
+
+	return token;
+}
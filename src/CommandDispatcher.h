@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Metrics.h"
+
+struct ChatCommand;
+
+/**
+ * Non owning view on a word of a command line
+ */
+struct CommandToken
+{
+	const char *data = nullptr;
+	size_t length = 0;
+};
+
+/**
+ * Perfect hash index over a ChatCommand table, built once at startup.
+ *
+ * Lookups hash the token in place and do a single comparison, without any
+ * allocation. Help and list replies are rendered once here too, as well as
+ * the metrics of each command.
+ */
+class CommandDispatchTable
+{
+public:
+	CommandDispatchTable(const ChatCommand *table, const std::string &prefix = "");
+	~CommandDispatchTable();
+
+	int32_t find(const CommandToken &token) const;
+
+	const ChatCommand *get_table() const { return m_table; }
+	size_t size() const { return m_count; }
+	const CommandDispatchTable *get_child(const size_t index) const { return m_children[index]; }
+	const std::string &get_subcommand_help(const size_t index) const { return m_subcommand_help[index]; }
+	const std::string &get_command_list() const { return m_command_list; }
+	MetricId get_duration_metric(const size_t index) const { return m_duration_metrics[index]; }
+	MetricId get_failure_metric(const size_t index) const { return m_failure_metrics[index]; }
+
+	static CommandToken next_token(const char *&text);
+
+private:
+	static uint32_t hash(const char *data, const size_t length, const uint32_t seed);
+	bool build_slots(const uint32_t seed);
+
+	const ChatCommand *m_table = nullptr;
+	size_t m_count = 0;
+	uint32_t m_seed = 0;
+	uint32_t m_mask = 0;
+	std::vector<int16_t> m_slots = {};
+	std::vector<CommandDispatchTable *> m_children = {};
+	std::vector<std::string> m_subcommand_help = {};
+	std::string m_command_list = "";
+	std::vector<MetricId> m_duration_metrics = {};
+	std::vector<MetricId> m_failure_metrics = {};
+};
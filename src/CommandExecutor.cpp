@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "CommandExecutor.h"
+#include "Config.h"
+#include "Log.h"
+
+CommandExecutor::CommandExecutor(const Config *cfg, ConfigStore *config_store,
+		HttpClient *http_client, ContentPrefetcher *prefetcher) :
+		m_cfg(cfg), m_config_store(config_store), m_http_client(http_client), m_prefetcher(prefetcher)
+{
+}
+
+CommandExecutor::~CommandExecutor()
+{
+	stop();
+}
+
+void CommandExecutor::start(IRCThread *irc_thread)
+{
+	std::unique_lock<std::mutex> lock(m_queue_mutex);
+	if (m_running) {
+		return;
+	}
+
+	m_running = true;
+
+	CommandHandler::configure_caches(m_cfg);
+
+	uint16_t pool_size = m_cfg->get_command_workers();
+	if (pool_size == 0) {
+		pool_size = 1;
+	}
+
+	for (uint16_t i = 0; i < pool_size; ++i) {
+		CommandHandler *handler = new CommandHandler(irc_thread, this, m_config_store, m_http_client,
+				m_prefetcher);
+		m_handlers.push_back(handler);
+		m_workers.emplace_back([this, handler] { worker_loop(handler); });
+	}
+
+	LOG_INFO("command", "Command executor started with " << pool_size << " workers");
+}
+
+void CommandExecutor::stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_queue_mutex);
+		if (!m_running) {
+			return;
+		}
+		m_running = false;
+	}
+
+	m_queue_cv.notify_all();
+
+	for (auto &worker: m_workers) {
+		if (worker.joinable()) {
+			worker.join();
+		}
+	}
+	m_workers.clear();
+
+	for (auto &handler: m_handlers) {
+		delete handler;
+	}
+	m_handlers.clear();
+	m_queue.clear();
+}
+
+bool CommandExecutor::submit(CommandJob &&job)
+{
+	{
+		std::unique_lock<std::mutex> lock(m_queue_mutex);
+		if (!m_running || m_queue.size() >= m_cfg->get_command_max_queue_size()) {
+			return false;
+		}
+
+		m_queue.push_back(std::move(job));
+	}
+
+	m_queue_cv.notify_one();
+	return true;
+}
+
+size_t CommandExecutor::get_queue_depth() const
+{
+	std::unique_lock<std::mutex> lock(m_queue_mutex);
+	return m_queue.size();
+}
+
+void CommandExecutor::worker_loop(CommandHandler *handler)
+{
+	while (true) {
+		CommandJob job;
+		{
+			std::unique_lock<std::mutex> lock(m_queue_mutex);
+			m_queue_cv.wait(lock, [this] { return !m_running || !m_queue.empty(); });
+			if (!m_running) {
+				return;
+			}
+
+			job = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		std::string msg;
+		handler->handle_command(job, msg);
+	}
+}
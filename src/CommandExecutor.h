@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "CommandHandler.h"
+
+class IRCThread;
+class Config;
+class ConfigStore;
+class HttpClient;
+class ContentPrefetcher;
+struct IRCChannelConfig;
+struct IRCConnection;
+
+struct CommandJob
+{
+	std::string text = "";
+	Permission permission = Permission::USER;
+	// Where the reply goes: the channel, or the nick for private messages
+	std::string reply_to = "";
+	std::string nick = "";
+	// Network the command came from, nullptr replies on the default one
+	IRCConnection *connection = nullptr;
+};
+
+/**
+ * Fixed-size pool of workers running CommandHandler::handle_command.
+ *
+ * Each worker owns one CommandHandler which is reused for every job it
+ * picks in the queue, so a burst of commands neither spawns threads nor
+ * allocates handlers.
+ */
+class CommandExecutor
+{
+public:
+	CommandExecutor(const Config *cfg, ConfigStore *config_store, HttpClient *http_client,
+			ContentPrefetcher *prefetcher);
+	~CommandExecutor();
+
+	void start(IRCThread *irc_thread);
+	void stop();
+
+	bool submit(CommandJob &&job);
+
+	size_t get_queue_depth() const;
+	size_t get_pool_size() const { return m_workers.size(); }
+
+private:
+	void worker_loop(CommandHandler *handler);
+
+	const Config *m_cfg = nullptr;
+	ConfigStore *m_config_store = nullptr;
+	HttpClient *m_http_client = nullptr;
+	ContentPrefetcher *m_prefetcher = nullptr;
+	std::vector<std::thread> m_workers = {};
+	std::vector<CommandHandler *> m_handlers = {};
+
+	std::deque<CommandJob> m_queue = {};
+	mutable std::mutex m_queue_mutex;
+	std::condition_variable m_queue_cv;
+	bool m_running = false;
+};
@@ -26,12 +26,18 @@
 #include <cstring>
 #include <thread>
 #include <cmath>
+#include <cctype>
 #include "CommandHandler.h"
+#include "CommandExecutor.h"
+#include "CommandDispatcher.h"
 #include "IRCThread.h"
 #include "HttpClient.h"
 #include "Console.h"
 #include "Config.h"
+#include "ConfigStore.h"
 #include "Mail.h"
+#include "ContentPrefetcher.h"
+#include "Log.h"
 #include <extras/gitlabapiclient.h>
 #include <sstream>
 
@@ -39,33 +45,92 @@ using namespace winterwind::extras;
 
 static const ChatCommand COMMANDHANDLERFINISHER = {nullptr, nullptr, nullptr, ""};
 
-CommandHandler::CommandHandler(IRCThread *irc_thread, const Config *cfg, const std::string &text, const Permission &permission) : Thread(),
-		m_irc_thread(irc_thread), m_cfg(cfg), m_text(text), m_permission(permission)
+enum WeatherField : uint8_t
+{
+	WEATHER_FIELD_TEMP,
+	WEATHER_FIELD_TEMP_MAX,
+	WEATHER_FIELD_TEMP_MIN,
+	WEATHER_FIELD_NAME,
+	WEATHER_FIELD_COD,
+};
+
+const JsonFieldSet CommandHandler::s_weather_fields = {"main.temp", "main.temp_max", "main.temp_min", "name",
+		"cod"};
+TTLCache<std::string> CommandHandler::s_weather_cache;
+SingleFlight<SharedReply> CommandHandler::s_weather_flights;
+std::unordered_map<std::string, uint32_t> CommandHandler::s_gitlab_project_ids = {};
+std::mutex CommandHandler::s_gitlab_project_ids_mutex;
+SingleFlight<uint32_t> CommandHandler::s_gitlab_project_flights;
+TTLCache<std::string> CommandHandler::s_gitlab_issue_cache;
+SingleFlight<SharedReply> CommandHandler::s_gitlab_issue_flights;
+const MetricId CommandHandler::s_unknown_command_metric = Metrics::register_counter(
+		"bot_unknown_commands_total", "", "Unknown commands and subcommands received");
+const MetricId CommandHandler::s_timed_out_metric = Metrics::register_counter(
+		"bot_commands_timed_out_total", "", "Commands whose upstream calls reached the command deadline");
+
+CommandHandler::CommandHandler(IRCThread *irc_thread, CommandExecutor *executor, ConfigStore *config_store,
+		HttpClient *http_client, ContentPrefetcher *prefetcher) :
+		m_irc_thread(irc_thread), m_executor(executor), m_config_store(config_store),
+		m_http_client(http_client),
+		m_prefetcher(prefetcher)
 {
 
 }
 
-void* CommandHandler::run()
+void CommandHandler::configure_caches(const Config *cfg)
 {
-	Thread::set_thread_name("CommandHandler");
+	s_weather_cache.set_max_size(cfg->get_weather_cache_size());
+	s_gitlab_issue_cache.set_max_size(cfg->get_gitlab_issue_cache_size());
+}
 
-	ThreadStarted();
+void CommandHandler::register_metrics()
+{
+	const std::pair<const char *, TTLCache<std::string> *> caches[] = {
+			{"weather", &s_weather_cache},
+			{"gitlab_issue", &s_gitlab_issue_cache},
+	};
 
-	std::string msg;
-	handle_command(msg);
+	for (const auto &cache: caches) {
+		const std::string labels = std::string("cache=\"") + cache.first + "\"";
+		TTLCache<std::string> *c = cache.second;
+		Metrics::register_callback("bot_cache_hits_total", labels, "Cache lookups answered from the cache",
+				"counter", [c] { return (double) c->get_hits(); });
+		Metrics::register_callback("bot_cache_misses_total", labels, "Cache lookups which missed",
+				"counter", [c] { return (double) c->get_misses(); });
+		Metrics::register_callback("bot_cache_hit_ratio", labels, "Hit ratio since startup",
+				"gauge", [c] {
+					const uint64_t hits = c->get_hits();
+					const uint64_t total = hits + c->get_misses();
+					return total ? (double) hits / total : 0.0;
+				});
+		Metrics::register_callback("bot_cache_entries", labels, "Entries stored in the cache",
+				"gauge", [c] { return (double) c->size(); });
+	}
 
-	return nullptr;
+	Metrics::register_callback("bot_async_commands_in_flight", "",
+			"Asynchronous commands waiting on I/O, they hold no worker", "gauge",
+			[] { return (double) CommandReply::get_in_flight(); });
+	Metrics::register_callback("bot_coalesced_requests_total", "upstream=\"weather\"",
+			"Upstream calls answered by an identical call already in flight", "counter",
+			[] { return (double) s_weather_flights.get_shared(); });
+	Metrics::register_callback("bot_coalesced_requests_total", "upstream=\"gitlab_issue\"",
+			"Upstream calls answered by an identical call already in flight", "counter",
+			[] { return (double) s_gitlab_issue_flights.get_shared(); });
+	Metrics::register_callback("bot_coalesced_requests_total", "upstream=\"gitlab_project\"",
+			"Upstream calls answered by an identical call already in flight", "counter",
+			[] { return (double) s_gitlab_project_flights.get_shared(); });
 }
 
 ChatCommand *CommandHandler::getCommandTable()
 {
 	static ChatCommand gitlabCommandTable[] {
 			{"issue", &CommandHandler::handle_command_gitlab_issue, nullptr, "Usage: .gitlab issue <issue_id>"},
+			{"flush", &CommandHandler::handle_command_gitlab_flush, nullptr, "Usage: .gitlab flush (clear GitLab cache)"},
 			COMMANDHANDLERFINISHER,
 	};
 	static ChatCommand globalCommandTable[] = {
-			{"weather", &CommandHandler::handle_command_weather, nullptr, "Usage: .weather <ville>"},
-			{"gitlab", nullptr, gitlabCommandTable, "Usage: .gitlab <issue>" },
+			{"weather", nullptr, nullptr, "Usage: .weather <ville>", &CommandHandler::handle_command_weather},
+			{"gitlab", nullptr, gitlabCommandTable, "Usage: .gitlab <issue|flush>" },
 			{"chuck_norris", &CommandHandler::handle_command_chuck_norris, nullptr, "Usage: .chuck_norris"},
 			{"joke", &CommandHandler::handle_command_joke, nullptr, "Usage: .joke"},
 			{"vdm", &CommandHandler::handle_command_vdm, nullptr, "Usage: .vdm"},
@@ -74,13 +139,20 @@ ChatCommand *CommandHandler::getCommandTable()
 			{"help", &CommandHandler::handle_command_help, nullptr, ""},
 			{"list", &CommandHandler::handle_command_list, nullptr, ""},
 			{"mail", &CommandHandler::handle_command_mail, nullptr, "Usage: .mail <pseudo> <message>"},
-			{"stop", &CommandHandler::handle_command_stop, nullptr, "Stop bot"},
+			{"status", &CommandHandler::handle_command_status, nullptr, "Show command queue status"},
+			{"stop", nullptr, nullptr, "Stop bot", &CommandHandler::handle_command_stop},
 			COMMANDHANDLERFINISHER,
 	};
 
 	return globalCommandTable;
 }
 
+const CommandDispatchTable &CommandHandler::get_dispatch_table()
+{
+	static const CommandDispatchTable dispatch_table(getCommandTable());
+	return dispatch_table;
+}
+
 bool CommandHandler::is_permission(const Permission &permission_required, const Permission &permission, std::string &msg) const
 {
 	if (permission_required > permission) {
@@ -90,201 +162,293 @@ bool CommandHandler::is_permission(const Permission &permission_required, const
 	return true;
 }
 
-bool CommandHandler::handle_command(std::string &msg)
+bool CommandHandler::handle_command(const CommandJob &job, std::string &msg)
 {
-	ChatCommand *command = nullptr;
-	ChatCommand *parentCommand = nullptr;
+	ChatCommandMatch match;
+
+	if (job.text.empty()) {
+		return false;
+	}
 
-	const char *ctext = &(m_text.c_str())[1];
+	const char *ctext = &(job.text.c_str())[1];
+	m_job = &job;
+
+	// The whole command sees the same configuration, even if it is reloaded meanwhile
+	const ConfigSnapshot cfg = m_config_store->acquire();
+	m_cfg = cfg.get();
+	if (job.connection) {
+		const IRCServerConfig *server_config = m_cfg->get_irc_server_config(job.connection->cfg->network);
+		m_channel_config = server_config ?
+				server_config->find_channel_config(job.reply_to.c_str()) : nullptr;
+	} else {
+		m_channel_config = m_cfg->get_irc_channel_config(job.reply_to);
+	}
+
+	// Deadlines are set per top level command
+	const char *command = ctext;
+	m_deadline = std::chrono::steady_clock::now() + m_cfg->get_command_deadline(
+			get_dispatch_table().find(CommandDispatchTable::next_token(command)));
 
-	ChatCommandSearchResult res = find_command(getCommandTable(), ctext, command, &parentCommand);
+	bool result = false;
+	ChatCommandSearchResult res = find_command(get_dispatch_table(), ctext, match);
 	switch (res) {
-		case CHAT_COMMAND_OK:
-			(this->*(command->Handler))(ctext, msg, m_permission);
+		case CHAT_COMMAND_OK: {
+			if (match.command->AsyncHandler) {
+				// Duration and failure are recorded when the reply completes
+				const CommandReply reply(m_irc_thread, job.connection, job.reply_to,
+						match.table->get_duration_metric((size_t) match.index),
+						match.table->get_failure_metric((size_t) match.index));
+				(this->*(match.command->AsyncHandler))(ctext, job.permission, reply);
+				result = true;
+				break;
+			}
+
+			const auto start = std::chrono::steady_clock::now();
+			result = (this->*(match.command->Handler))(ctext, msg, job.permission);
+			Metrics::observe(match.table->get_duration_metric((size_t) match.index),
+					std::chrono::duration_cast<std::chrono::microseconds>(
+							std::chrono::steady_clock::now() - start));
+			if (!result) {
+				Metrics::increment(match.table->get_failure_metric((size_t) match.index));
+			}
 			break;
+		}
 		case CHAT_COMMAND_UNKNOWN_SUBCOMMAND:
-			msg = command->help;
+			msg = match.command->help;
+			Metrics::increment(s_unknown_command_metric);
 			break;
 		case CHAT_COMMAND_UNKNOWN:
 			msg = "Unknown command.";
+			Metrics::increment(s_unknown_command_metric);
 			break;
 	}
 
-	m_irc_thread->add_text(msg);
-	stop();
+	send_reply(msg);
+	m_job = nullptr;
+	m_cfg = nullptr;
+	m_channel_config = nullptr;
+	return result;
 }
 
-ChatCommandSearchResult CommandHandler::find_command(ChatCommand *table, const char *&text, ChatCommand *&command,
-													 ChatCommand **parentCommand)
+void CommandHandler::send_reply(const std::string &msg)
 {
-	std::string cmd = "";
-
-	// Skip whitespaces
-	while (*text != ' ' && *text != '\0') {
-		cmd += *text;
-		++text;
+	if (msg.empty()) {
+		return;
 	}
 
-	while (*text == ' ') {
-		++text;
+	// Console only mode, there is no IRC session to talk to
+	if (!m_irc_thread || m_job->reply_to.empty()) {
+		std::cout << msg << std::endl;
+		return;
 	}
 
-	for (int32_t i = 0; table[i].name != nullptr; ++i) {
-		size_t len = strlen(table[i].name);
-		if (strncmp(table[i].name, cmd.c_str(), len + 1) != 0) {
-			continue;
-		}
-
-		if (table[i].childCommand != nullptr) {
-			const char *stext = text;
-			ChatCommand *parentSubCommand = nullptr;
-			ChatCommandSearchResult res = find_command(
-					table[i].childCommand, text, command, &parentSubCommand
-			);
-
-			switch (res) {
-				case CHAT_COMMAND_OK:
-					if (parentCommand) {https://github.com/yamashi/deep-learning-tuto
-						*parentCommand = parentSubCommand ? parentSubCommand : &table[i];
-					}
-
-					if (strlen(command->name) == 0 && !parentSubCommand) {
-						text = stext;
-					}
-					return CHAT_COMMAND_OK;
-
-				case CHAT_COMMAND_UNKNOWN:
-					command = &table[i];
-					if (parentCommand)
-						*parentCommand = nullptr;
-
-					text = stext;
-					return CHAT_COMMAND_UNKNOWN_SUBCOMMAND;
-
-				case CHAT_COMMAND_UNKNOWN_SUBCOMMAND:
-				default:
-					if (parentCommand)
-						*parentCommand = parentSubCommand ? parentSubCommand : &table[i];
-
-					return res;
-			}
-		}
-
-		if (!table[i].Handler) {
-			continue;
-		}
+	m_irc_thread->add_text(m_job->connection, m_job->reply_to, msg);
+}
 
-		command = &table[i];
+ChatCommandSearchResult CommandHandler::find_command(const CommandDispatchTable &table,
+		const char *&text, ChatCommandMatch &match)
+{
+	const CommandToken token = CommandDispatchTable::next_token(text);
+	const int32_t index = table.find(token);
+	if (index < 0) {
+		match = ChatCommandMatch();
+		return CHAT_COMMAND_UNKNOWN;
+	}
 
-		if (parentCommand) {
-			*parentCommand = nullptr;
+	const ChatCommand *command = &table.get_table()[index];
+	const CommandDispatchTable *child = table.get_child((size_t) index);
+	if (child) {
+		const char *stext = text;
+		ChatCommandSearchResult res = find_command(*child, text, match);
+
+		switch (res) {
+			case CHAT_COMMAND_OK:
+				if (!match.parentCommand) {
+					match.parentCommand = command;
+				}
+				return CHAT_COMMAND_OK;
+
+			case CHAT_COMMAND_UNKNOWN:
+				match.command = command;
+				match.parentCommand = nullptr;
+				match.table = &table;
+				match.index = index;
+
+				text = stext;
+				return CHAT_COMMAND_UNKNOWN_SUBCOMMAND;
+
+			case CHAT_COMMAND_UNKNOWN_SUBCOMMAND:
+			default:
+				if (!match.parentCommand) {
+					match.parentCommand = command;
+				}
+				return res;
 		}
-
-		return CHAT_COMMAND_OK;
 	}
 
-	command = nullptr;
-
-	if (parentCommand)
-		*parentCommand = nullptr;
+	if (!command->Handler && !command->AsyncHandler) {
+		match = ChatCommandMatch();
+		return CHAT_COMMAND_UNKNOWN;
+	}
 
-	return CHAT_COMMAND_UNKNOWN;
+	match.command = command;
+	match.parentCommand = nullptr;
+	match.table = &table;
+	match.index = index;
+	return CHAT_COMMAND_OK;
 }
 
 bool CommandHandler::handle_command_list(const std::string &args, std::string &msg, const Permission &permission)
 {
-	ChatCommand *cmds = getCommandTable();
-	msg += "Command list : ";
-
-	for (int32_t i = 0; cmds[i].name != nullptr; i++) {
-		msg += std::string(cmds[i].name) + ", ";
-	}
+	msg += get_dispatch_table().get_command_list();
 	return true;
 }
 
 bool CommandHandler::handle_command_help(const std::string &args, std::string &msg, const Permission &permission)
 {
 	if (args.empty()) {
-		msg = "/help <command> to get the help of the command \n";
-		return handle_command_list(args, msg, permission);
+		static const std::string usage = "/help <command> to get the help of the command \n" +
+				get_dispatch_table().get_command_list();
+		msg = usage;
+		return true;
 	}
 
-	ChatCommand *command = nullptr;
-	ChatCommand *parentCommand = nullptr;
+	ChatCommandMatch match;
 	const char *ctext = args.c_str();
-	msg = args;
 
-	ChatCommandSearchResult res = find_command(
-			getCommandTable(), ctext, command, &parentCommand
-	);
+	ChatCommandSearchResult res = find_command(get_dispatch_table(), ctext, match);
 
 	switch(res) {
 		case CHAT_COMMAND_OK:
-			msg = command->help;
+			msg = match.command->help;
 			return true;
 
-		case CHAT_COMMAND_UNKNOWN_SUBCOMMAND: {
-			msg = command->help + "\n";
-			ChatCommand *child = command->childCommand;
-			for (uint16_t i = 0; child[i].name != nullptr; ++i) {
-				msg += (std::string) child[i].name + "\n";
-				msg += "		" + child[i].help + "\n";
-			}
+		case CHAT_COMMAND_UNKNOWN_SUBCOMMAND:
+			msg = match.table->get_subcommand_help((size_t) match.index);
 			return true;
-		}
 
 		case CHAT_COMMAND_UNKNOWN:
+		default:
 			msg = "Command not found";
 			return false;
 	}
 }
 
-bool CommandHandler::handle_command_weather(const std::string &args, std::string &msg, const Permission &permission)
+void CommandHandler::handle_command_weather(const std::string &args, const Permission &permission,
+		const CommandReply &reply)
 {
 	if (m_cfg->get_openweathermap_api_key() == "") {
-		std::cerr << "Key openweather doesn't exist !" << std::endl;
-		msg = "Key openweather doesn't exist !";
-		return false;
+		LOG_ERROR("command", "Key openweather doesn't exist !");
+		reply.finish(false, "Key openweather doesn't exist !");
+		return;
+	}
+
+	const std::string city = normalize_city(args);
+	std::string msg;
+	if (s_weather_cache.get(city, msg)) {
+		reply.finish(true, msg);
+		return;
 	}
-	HttpClient *http_server = new HttpClient();
+
+	// A burst of .weather for the same city waits on a single request
+	if (!s_weather_flights.join(city, [reply] (const SharedReply &r) { reply.finish(r.success, r.msg); })) {
+		return;
+	}
+
 	const std::string url = "http://api.openweathermap.org/data/2.5/weather?q="+args+"s&APPID="+m_cfg->get_openweathermap_api_key();
-	Json::Value json_value;
-	std::thread http([http_server, url, &json_value] { http_server->get_json(json_value, url); });
-	while (http_server->is_running()) {
-		std::this_thread::sleep_for(std::chrono::milliseconds(50));
-	}
-	http.detach();
-	int temp = json_value["main"]["temp"].asDouble() - 273.15;
-	int max = json_value["main"]["temp_max"].asDouble() - 273.15;
-	int min = json_value["main"]["temp_min"].asDouble() - 273.15;
+	const std::chrono::seconds cache_ttl(m_cfg->get_weather_cache_ttl());
+	const std::chrono::seconds negative_cache_ttl(m_cfg->get_weather_negative_cache_ttl());
+	const auto deadline = m_deadline;
+	m_http_client->get_fields_async(url, s_weather_fields,
+			[city, cache_ttl, negative_cache_ttl, deadline] (bool success, long status,
+					const JsonFields &weather) {
+				// Only an unknown city is cached as such: a bad key, the quota or an
+				// outage must not outlive their fix
+				SharedReply r;
+				if (status == 404 || (success && weather.as_string(WEATHER_FIELD_COD) == "404")) {
+					r.success = true;
+					r.msg = "This city is invalid !";
+					s_weather_cache.put(city, r.msg, negative_cache_ttl);
+				} else if (!success || !format_weather(weather, r.msg)) {
+					r.msg = get_upstream_error(deadline, "weather service");
+				} else {
+					r.success = true;
+					s_weather_cache.put(city, r.msg, cache_ttl);
+				}
+				s_weather_flights.complete(city, r);
+			}, m_deadline);
+}
+
+std::string CommandHandler::get_upstream_error(const std::chrono::steady_clock::time_point &deadline,
+		const std::string &service)
+{
+	if (std::chrono::steady_clock::now() >= deadline) {
+		Metrics::increment(s_timed_out_metric);
+		return "Timed out waiting for the " + service + ".";
+	}
+	return "Unable to reach the " + service + ".";
+}
+
+bool CommandHandler::format_weather(const JsonFields &weather, std::string &msg)
+{
+	// Missing temperatures read as 0 K, the answer holds no weather then
+	int temp = weather.as_double(WEATHER_FIELD_TEMP) - 273.15;
+	int max = weather.as_double(WEATHER_FIELD_TEMP_MAX) - 273.15;
+	int min = weather.as_double(WEATHER_FIELD_TEMP_MIN) - 273.15;
 	if (temp < -200) {
 		msg = "This city is invalid !";
-		return true;
+		return false;
 	}
-	msg = "La température  à " + json_value["name"].asString() + " est de " + std::to_string(temp) + " degrès. (min : " +
+	msg = "La température  à " + weather.as_string(WEATHER_FIELD_NAME) + " est de " + std::to_string(temp) + " degrès. (min : " +
 			std::to_string(min) + " max : " +
 			std::to_string(max) + ")";
 	return true;
 }
 
+std::string CommandHandler::normalize_city(const std::string &city)
+{
+	// Lowercase and collapse whitespaces so "  Paris" and "paris" share an entry
+	std::string res = "";
+	bool pending_space = false;
+	for (const char &c: city) {
+		if (isspace((unsigned char) c)) {
+			pending_space = !res.empty();
+			continue;
+		}
+
+		if (pending_space) {
+			res += ' ';
+			pending_space = false;
+		}
+		res += (char) tolower((unsigned char) c);
+	}
+	return res;
+}
+
 bool CommandHandler::handle_command_say(const std::string &args, std::string &msg, const Permission &permission)
 {
 	if (is_permission(Permission::ADMIN, permission, msg)) {
-		m_irc_thread->add_text(args);
+		send_reply(args);
 	}
 
 	return true;
 }
 
-bool CommandHandler::handle_command_stop(const std::string &args, std::string &msg, const Permission &permission)
+void CommandHandler::handle_command_stop(const std::string &args, const Permission &permission,
+		const CommandReply &reply)
 {
-	if (is_permission(Permission::ADMIN, permission, msg)) {
-		msg = "Server stop...";
-		m_irc_thread->add_text("Noooo, I died !! Good bye my friends !");
-		std::this_thread::sleep_for(std::chrono::milliseconds(500));
-		Console::stop();
+	std::string msg;
+	if (!is_permission(Permission::ADMIN, permission, msg)) {
+		reply.finish(true, msg);
+		return;
 	}
-	return true;
+
+	reply.send("Noooo, I died !! Good bye my friends !");
+	// Give the goodbye time to go out, without holding the worker
+	m_http_client->call_later(std::chrono::milliseconds(500), [reply] {
+		Console::stop();
+		reply.finish(true, "Server stop...");
+	});
 }
 
 bool CommandHandler::handle_command_vdm(const std::string &args, std::string &msg, const Permission &permission)
@@ -296,77 +460,94 @@ bool CommandHandler::handle_command_vdm(const std::string &args, std::string &ms
 bool CommandHandler::handle_command_chuck_norris(const std::string &args, std::string &msg,
 												 const Permission &permission)
 {
-	HttpClient *http_server = new HttpClient();
-	const std::string url = "http://api.icndb.com/jokes/random";
-	Json::Value json_value;
-	std::thread http([http_server, url, &json_value] { http_server->get_json(json_value, url); });
-	while (http_server->is_running()) {
-		std::this_thread::sleep_for(std::chrono::milliseconds(50));
-	}
-	http.detach();
-	msg = json_value["value"]["joke"].asString();
-	return true;
+	return get_random_content(PREFETCH_CHUCK_NORRIS, msg);
 }
 
 bool CommandHandler::handle_command_joke(const std::string &args, std::string &msg,
 												 const Permission &permission)
 {
-	HttpClient *http_server = new HttpClient();
-	const std::string url = "http://webknox.com/api/jokes/random?apiKey=bejebgdahjzmcxjyxbkpmbmbvtttidu";
-	Json::Value json_value;
-	std::thread http([http_server, url, &json_value] { http_server->get_json(json_value, url); });
-	while (http_server->is_running()) {
-		std::this_thread::sleep_for(std::chrono::milliseconds(50));
-	}
-	http.detach();
-	msg = json_value["joke"].asString();
-	return true;
+	return get_random_content(PREFETCH_JOKE, msg);
 }
+
 bool CommandHandler::handle_command_quote(const std::string &args, std::string &msg,
 												 const Permission &permission)
 {
-	HttpClient *http_server = new HttpClient();
-	// Key default  A CHANGER
-	const std::string url = "http://q.uote.me/api.php?p=json&l=1&s=random";
-	Json::Value json_value;
-	std::thread http([http_server, url, &json_value] { http_server->get_json(json_value, url); });
-	while (http_server->is_running()) {
-		std::this_thread::sleep_for(std::chrono::milliseconds(50));
-	}
-	http.detach();
-	msg = json_value["data"][0]["text"].asString();
+	return get_random_content(PREFETCH_QUOTE, msg);
+}
+
+bool CommandHandler::get_random_content(const uint8_t source, std::string &msg)
+{
+	const PrefetchSource prefetch_source = (PrefetchSource) source;
+	if (m_prefetcher->pop(prefetch_source, msg)) {
+		return true;
+	}
+
+	// Buffer is empty, fallback to a live fetch
+	JsonFields fields;
+	if (!m_http_client->get_fields(fields, ContentPrefetcher::get_url(prefetch_source),
+			ContentPrefetcher::get_fields(prefetch_source), m_deadline)) {
+		msg = get_upstream_error(m_deadline, "remote service");
+		return false;
+	}
+
+	if (!ContentPrefetcher::extract_item(prefetch_source, fields, msg)) {
+		msg = "Unable to reach the remote service.";
+		return false;
+	}
+
 	return true;
 }
 
 bool CommandHandler::handle_command_gitlab_issue(const std::string &args, std::string &msg,
 		const Permission &permission)
 {
-	std::cout << "Gitlab handler" << std::endl;
 	uint32_t issue_id;
 	try {
 		issue_id = std::stoi(args);
 	} catch (std::invalid_argument &) {
 		msg = "Invalid argument.";
-		std::cerr << "Invalid argument." << std::endl;
+		LOG_DEBUG("command", "Invalid GitLab issue id: " << args);
 		return false;
 	}
 
-	std::cout << "Load issue" << std::endl;
+	const IRCChannelConfig *channel_config = m_channel_config;
+	if (!channel_config) {
+		msg = "Invalid gitlab project";
+		return false;
+	}
 
-	std::string gitlab_project = m_cfg->get_channel_gitlab_project_name(m_cfg->get_irc_channel_configs().begin()->first);
-	std::string gitlab_ns = m_cfg->get_channel_gitlab_project_namespace(m_cfg->get_irc_channel_configs().begin()->first);
+	const std::string &gitlab_project = channel_config->gitlab_project_name;
+	const std::string &gitlab_ns = channel_config->gitlab_project_namespace;
 
 	if (gitlab_project == "" || gitlab_ns == "") {
 		msg = "Invalid gitlab project";
 		return false;
 	}
 
-	// Add CACHE (WIP)
+	const std::string issue_key = gitlab_ns + "/" + gitlab_project + "#" + std::to_string(issue_id);
+	if (s_gitlab_issue_cache.get(issue_key, msg)) {
+		return true;
+	}
+
+	SharedReply reply;
+	s_gitlab_issue_flights.run(issue_key, reply, [this, issue_id, channel_config, &issue_key] {
+		SharedReply r;
+		r.success = fetch_gitlab_issue(issue_id, channel_config, issue_key, r.msg);
+		return r;
+	});
+
+	msg = reply.msg;
+	return reply.success;
+}
 
-	// End cache
+bool CommandHandler::fetch_gitlab_issue(const uint32_t issue_id, const IRCChannelConfig *channel_config,
+		const std::string &issue_key, std::string &msg)
+{
+	const std::string &gitlab_project = channel_config->gitlab_project_name;
+	const std::string &gitlab_ns = channel_config->gitlab_project_namespace;
 
-	std::cout << "project : " << gitlab_project << " ns : " << gitlab_ns
-			<< "uri : " << m_cfg->get_gitlab_uri() << " key : " << m_cfg->get_gitlab_api_key() << std::endl;
+	LOG_DEBUG("command", "Loading issue " << issue_id << " of " << gitlab_ns << "/" << gitlab_project
+			<< " from " << m_cfg->get_gitlab_uri());
 
 	GitlabAPIClient gitlab_client(m_cfg->get_gitlab_uri(),
 			m_cfg->get_gitlab_api_key());
@@ -378,19 +559,40 @@ bool CommandHandler::handle_command_gitlab_issue(const std::string &args, std::s
 		return true;
 	}
 
+	msg = format_gitlab_issue(issue_id, result);
+	s_gitlab_issue_cache.put(issue_key, msg, std::chrono::seconds(m_cfg->get_gitlab_issue_cache_ttl()));
+	return true;
+}
+
+std::string CommandHandler::format_gitlab_issue(const uint32_t issue_id, const Json::Value &issue)
+{
 	std::stringstream message;
 	message << std::string("Issue #") << issue_id
-		   << " (par " << result["author"]["name"].asString()
-		   << ", " << result["state"].asString() << "): " << result["title"].asString()
-		   << " => " << result["web_url"].asString() << std::endl;
-	msg = message.str();
+		   << " (par " << issue["author"]["name"].asString()
+		   << ", " << issue["state"].asString() << "): " << issue["title"].asString()
+		   << " => " << issue["web_url"].asString() << std::endl;
+	return message.str();
+}
+
+bool CommandHandler::handle_command_gitlab_flush(const std::string &args, std::string &msg,
+		const Permission &permission)
+{
+	if (!is_permission(Permission::ADMIN, permission, msg)) {
+		return false;
+	}
+
+	s_gitlab_issue_cache.clear();
+	{
+		std::unique_lock<std::mutex> lock(s_gitlab_project_ids_mutex);
+		s_gitlab_project_ids.clear();
+	}
+
+	msg = "GitLab cache flushed.";
 	return true;
 }
 
 bool CommandHandler::handle_command_mail(const std::string &args, std::string &msg, const Permission &permission)
 {
-	std::cout << "Command handle mail" << std::endl;
-	std::cout << "args : " << args << std::endl;
 
 	std::string pseudo = "";
 	std::string message = "";
@@ -412,8 +614,54 @@ bool CommandHandler::handle_command_mail(const std::string &args, std::string &m
 		return false;
 	}
 
-	msg = "Send message to " + pseudo;
-	Mail::add_mail(pseudo, "Dumbeldor", message);
+	const std::string from = m_job->nick.empty() ? "Console" : m_job->nick;
+	switch (Mail::add_mail(pseudo, from, message)) {
+		case MAIL_OK:
+			msg = "Send message to " + pseudo;
+			return true;
+		case MAIL_RECIPIENT_FULL:
+			msg = "Mailbox of " + pseudo + " is full.";
+			return false;
+		case MAIL_LOG_ERROR:
+			msg = "Unable to save the mail, try again later.";
+			return false;
+		case MAIL_STORE_FULL:
+		default:
+			msg = "Too many pending mails, try again later.";
+			return false;
+	}
+}
+
+bool CommandHandler::handle_command_status(const std::string &args, std::string &msg, const Permission &permission)
+{
+	if (!is_permission(Permission::ADMIN, permission, msg)) {
+		return false;
+	}
+
+	msg = "Workers: " + std::to_string(m_executor->get_pool_size()) +
+			", pending commands: " + std::to_string(m_executor->get_queue_depth());
+	if (m_irc_thread) {
+		msg += ", pending IRC messages: " + std::to_string(m_irc_thread->get_outbound_queue_depth());
+	}
+
+	HttpClientStats http_stats = m_http_client->get_stats();
+	msg += " | HTTP requests: " + std::to_string(http_stats.requests) +
+			", failures: " + std::to_string(http_stats.failures) +
+			", reused connections: " + std::to_string(http_stats.reused_connections) +
+			", new connections: " + std::to_string(http_stats.new_connections);
+	if (http_stats.requests > http_stats.failures) {
+		msg += ", avg latency: " + std::to_string(http_stats.total_time_us /
+				(http_stats.requests - http_stats.failures) / 1000) + " ms";
+	}
+
+	msg += " | Weather cache hits: " + std::to_string(s_weather_cache.get_hits()) +
+			", misses: " + std::to_string(s_weather_cache.get_misses());
+	msg += " | GitLab issue cache hits: " + std::to_string(s_gitlab_issue_cache.get_hits()) +
+			", misses: " + std::to_string(s_gitlab_issue_cache.get_misses());
+	msg += " | Async commands in flight: " + std::to_string(CommandReply::get_in_flight());
+	msg += " | Coalesced requests: " + std::to_string(s_weather_flights.get_shared() +
+			s_gitlab_issue_flights.get_shared() + s_gitlab_project_flights.get_shared());
+	msg += " | Pending mail: " + std::to_string(Mail::get_total_size()) + " bytes";
 	return true;
 }
 
@@ -421,15 +669,30 @@ uint32_t CommandHandler::get_gitlab_project_id(const std::string &project, const
 											   GitlabAPIClient &gitlab_client)
 {
 	uint32_t project_id = 0;
-
-	std::string proj_res = "";
-	Json::Value p_result;
-	GitlabRetCod rc = gitlab_client.get_project_ns(project, ns, p_result);
-	if (rc != GITLAB_RC_OK) {
-		return 0;
+	const std::string project_key = ns + "/" + project;
+	{
+		std::unique_lock<std::mutex> lock(s_gitlab_project_ids_mutex);
+		auto it = s_gitlab_project_ids.find(project_key);
+		if (it != s_gitlab_project_ids.end()) {
+			return it->second;
+		}
 	}
 
-	project_id = p_result["id"].asUInt();
+	// Issues of a project not resolved yet share a single lookup
+	s_gitlab_project_flights.run(project_key, project_id, [&] {
+		Json::Value p_result;
+		GitlabRetCod rc = gitlab_client.get_project_ns(project, ns, p_result);
+		if (rc != GITLAB_RC_OK) {
+			return (uint32_t) 0;
+		}
+
+		const uint32_t id = p_result["id"].asUInt();
+		if (id != 0) {
+			std::unique_lock<std::mutex> lock(s_gitlab_project_ids_mutex);
+			s_gitlab_project_ids[project_key] = id;
+		}
+		return id;
+	});
 
 	return project_id;
 }
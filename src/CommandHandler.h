@@ -24,12 +24,26 @@
  */
 
 #pragma once
+#include <json/json.h>
 #include <iostream>
-#include <core/utils/threads.h>
+#include <mutex>
+#include <unordered_map>
+#include "CommandReply.h"
+#include "JsonFields.h"
+#include "Metrics.h"
+#include "SingleFlight.h"
+#include "TTLCache.h"
 
 class IRCThread;
 class CommandHandler;
+class CommandExecutor;
 class Config;
+class ConfigStore;
+class HttpClient;
+class ContentPrefetcher;
+struct IRCChannelConfig;
+class CommandDispatchTable;
+struct CommandJob;
 
 namespace winterwind
 {
@@ -52,6 +66,10 @@ struct ChatCommand
 	bool (CommandHandler::*Handler)(const std::string &args, std::string &msg, const Permission &permission);
 	ChatCommand *childCommand;
 	const std::string help;
+	// Set instead of Handler by commands waiting on I/O: the handler returns
+	// once its requests are started and the command completes through reply
+	void (CommandHandler::*AsyncHandler)(const std::string &args, const Permission &permission,
+			const CommandReply &reply) = nullptr;
 };
 
 enum ChatCommandSearchResult : uint8_t
@@ -61,40 +79,101 @@ enum ChatCommandSearchResult : uint8_t
 	CHAT_COMMAND_UNKNOWN_SUBCOMMAND,
 };
 
-class CommandHandler: public Thread
+struct ChatCommandMatch
+{
+	const ChatCommand *command = nullptr;
+	const ChatCommand *parentCommand = nullptr;
+	// Dispatch table holding command, and its index in this table
+	const CommandDispatchTable *table = nullptr;
+	int32_t index = -1;
+};
+
+// Outcome of a coalesced upstream call, copied to every waiting handler
+struct SharedReply
+{
+	bool success = false;
+	std::string msg = "";
+};
+
+class CommandHandler
 {
 public:
-	CommandHandler(IRCThread *irc_thread, const Config *cfg, const std::string &text, const Permission &permission);
+	CommandHandler(IRCThread *irc_thread, CommandExecutor *executor, ConfigStore *config_store,
+			HttpClient *http_client, ContentPrefetcher *prefetcher);
 	~CommandHandler() {};
 
-	void *run();
+	bool handle_command(const CommandJob &job, std::string &msg);
+
+	static void configure_caches(const Config *cfg);
+	static void register_metrics();
 
-	bool handle_command(std::string &msg);
+	// Reply builders, @return false when the weather payload holds no valid city
+	static bool format_weather(const JsonFields &weather, std::string &msg);
+	static std::string format_gitlab_issue(const uint32_t issue_id, const Json::Value &issue);
 
 public:
-	ChatCommandSearchResult find_command(ChatCommand *table, const char *&text,
-										ChatCommand *&command, ChatCommand **parentCommand = nullptr);
-	ChatCommand *getCommandTable();
+	static ChatCommandSearchResult find_command(const CommandDispatchTable &table,
+			const char *&text, ChatCommandMatch &match);
+	static ChatCommand *getCommandTable();
+	static const CommandDispatchTable &get_dispatch_table();
 	bool is_permission(const Permission &permission_required, const Permission &permission, std::string &msg) const;
 
 	bool handle_command_list(const std::string &args, std::string &msg, const Permission &permission);
 	bool handle_command_help(const std::string &args, std::string &msg, const Permission &permission);
-	bool handle_command_weather(const std::string &args, std::string &msg, const Permission &permission);
+	void handle_command_weather(const std::string &args, const Permission &permission, const CommandReply &reply);
 	bool handle_command_say(const std::string &args, std::string &msg, const Permission &permission);
-	bool handle_command_stop(const std::string &args, std::string &msg, const Permission &permission);
+	void handle_command_stop(const std::string &args, const Permission &permission, const CommandReply &reply);
 	bool handle_command_vdm(const std::string &args, std::string &msg, const Permission &permission);
 	bool handle_command_chuck_norris(const std::string &args, std::string &msg, const Permission &permission);
 	bool handle_command_joke(const std::string &args, std::string &msg, const Permission &permission);
 	bool handle_command_quote(const std::string &args, std::string &msg, const Permission &permission);
 	bool handle_command_mail(const std::string &args, std::string &msg, const Permission &permission);
+	bool handle_command_status(const std::string &args, std::string &msg, const Permission &permission);
 
 	bool handle_command_gitlab_issue(const std::string &args, std::string &msg, const Permission &permission);
+	bool fetch_gitlab_issue(const uint32_t issue_id, const IRCChannelConfig *channel_config,
+			const std::string &issue_key, std::string &msg);
+	bool handle_command_gitlab_flush(const std::string &args, std::string &msg, const Permission &permission);
 	uint32_t get_gitlab_project_id(const std::string &project,
 			const  std::string &ns, winterwind::extras::GitlabAPIClient &gitlab_client);
 
+	void send_reply(const std::string &msg);
+	bool get_random_content(const uint8_t source, std::string &msg);
+	static std::string normalize_city(const std::string &city);
+	static std::string get_upstream_error(const std::chrono::steady_clock::time_point &deadline,
+			const std::string &service);
+
 	IRCThread *m_irc_thread = nullptr;
-	const std::string m_text;
-	const Permission &m_permission;
+	CommandExecutor *m_executor = nullptr;
+	ConfigStore *m_config_store = nullptr;
+	HttpClient *m_http_client = nullptr;
+	ContentPrefetcher *m_prefetcher = nullptr;
+
+	// Job being handled, the configuration snapshot it runs with and the
+	// channel it came from. Set for the duration of handle_command, so
+	// asynchronous handlers must copy what their completion needs
+	const CommandJob *m_job = nullptr;
 	const Config *m_cfg = nullptr;
+	const IRCChannelConfig *m_channel_config = nullptr;
+	// Upstream calls of the command are aborted past this point, see commands.deadlines
+	std::chrono::steady_clock::time_point m_deadline = {};
+
+	// Fields read from an OpenWeatherMap answer, see format_weather
+	static const JsonFieldSet s_weather_fields;
+
+	// Weather replies, keyed by normalized city name
+	static TTLCache<std::string> s_weather_cache;
+	static SingleFlight<SharedReply> s_weather_flights;
+
+	// GitLab project ids never change, keyed by "namespace/project"
+	static std::unordered_map<std::string, uint32_t> s_gitlab_project_ids;
+	static std::mutex s_gitlab_project_ids_mutex;
+	static SingleFlight<uint32_t> s_gitlab_project_flights;
+
+	// Issue replies, keyed by "namespace/project#issue"
+	static TTLCache<std::string> s_gitlab_issue_cache;
+	static SingleFlight<SharedReply> s_gitlab_issue_flights;
+	static const MetricId s_unknown_command_metric;
+	static const MetricId s_timed_out_metric;
 };
 
@@ -0,0 +1,85 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include "CommandReply.h"
+#include "IRCThread.h"
+
+std::atomic<int64_t> CommandReply::s_in_flight(0);
+
+CommandReply::CommandReply(IRCThread *irc_thread, IRCConnection *connection, const std::string &reply_to,
+		const MetricId duration_metric, const MetricId failure_metric) :
+		m_state(std::make_shared<State>())
+{
+	m_state->irc_thread = irc_thread;
+	m_state->connection = connection;
+	m_state->reply_to = reply_to;
+	m_state->duration_metric = duration_metric;
+	m_state->failure_metric = failure_metric;
+	m_state->start = std::chrono::steady_clock::now();
+	s_in_flight++;
+}
+
+void CommandReply::send(const std::string &msg) const
+{
+	if (!m_state || msg.empty()) {
+		return;
+	}
+
+	// Console only mode, there is no IRC session to talk to
+	if (!m_state->irc_thread || m_state->reply_to.empty()) {
+		std::cout << msg << std::endl;
+		return;
+	}
+
+	m_state->irc_thread->add_text(m_state->connection, m_state->reply_to, msg);
+}
+
+void CommandReply::finish(const bool success, const std::string &msg) const
+{
+	if (!m_state || m_state->finished.exchange(true)) {
+		return;
+	}
+
+	m_state->record(success);
+	send(msg);
+}
+
+void CommandReply::State::record(const bool success)
+{
+	Metrics::observe(duration_metric, std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start));
+	if (!success) {
+		Metrics::increment(failure_metric);
+	}
+	s_in_flight--;
+}
+
+CommandReply::State::~State()
+{
+	if (!finished) {
+		record(false);
+	}
+}
@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include "Metrics.h"
+
+class IRCThread;
+struct IRCConnection;
+
+/**
+ * Completion handle of an asynchronous command.
+ *
+ * Asynchronous handlers start their upstream calls and return at once, the
+ * worker moves on to the next job. Whoever completes the command, usually a
+ * HttpClient callback on the loop thread, calls finish() which sends the
+ * reply and records the command duration and failure metrics.
+ *
+ * Copies share the same command and may be captured by callbacks, only the
+ * first finish() counts. A command dropped without finish() is counted as
+ * failed when its last copy goes away.
+ */
+class CommandReply
+{
+public:
+	CommandReply() = default;
+	CommandReply(IRCThread *irc_thread, IRCConnection *connection, const std::string &reply_to,
+			const MetricId duration_metric, const MetricId failure_metric);
+
+	// Sends msg right away, the command stays in flight
+	void send(const std::string &msg) const;
+	void finish(const bool success, const std::string &msg) const;
+
+	// Asynchronous commands started and not finished yet
+	static int64_t get_in_flight() { return s_in_flight; }
+
+private:
+	struct State
+	{
+		~State();
+		void record(const bool success);
+
+		IRCThread *irc_thread = nullptr;
+		IRCConnection *connection = nullptr;
+		std::string reply_to = "";
+		MetricId duration_metric = METRIC_INVALID_ID;
+		MetricId failure_metric = METRIC_INVALID_ID;
+		std::chrono::steady_clock::time_point start = {};
+		std::atomic<bool> finished{false};
+	};
+
+	std::shared_ptr<State> m_state;
+	static std::atomic<int64_t> s_in_flight;
+};
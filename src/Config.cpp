@@ -24,6 +24,11 @@
  */
 
 #include "Config.h"
+#include "CommandDispatcher.h"
+#include "CommandHandler.h"
+#include "Log.h"
+#include <algorithm>
+#include <cstring>
 #include <yaml-cpp/yaml.h>
 
 #define CFG_LOAD(obj, key, type, store) \
@@ -33,12 +38,12 @@
 
 Config::~Config()
 {
-	for (auto &channel_config: m_irc_channel_configs) {
-		delete channel_config.second;
+	for (auto &server_config: m_irc_server_configs) {
+		delete server_config;
 	}
 }
 
-bool Config::load_configuration()
+bool Config::load_configuration(const std::string &path)
 {
 	YAML::Node config;
 	bool valid_config_found = false;
@@ -48,23 +53,29 @@ bool Config::load_configuration()
 			"/etc/bot.yml"
 	};
 
-	for (const auto &fname: possible_configs) {
+	for (const auto &fname: path.empty() ? possible_configs : std::vector<std::string>{path}) {
 		try {
 			config = YAML::LoadFile(fname);
 			valid_config_found = true;
+			m_config_path = fname;
 			break;
 		}
 		catch (YAML::BadFile &e) {}
+		catch (YAML::ParserException &e) {
+			LOG_ERROR("config", "Unable to parse " << fname << ": " << e.what());
+			return false;
+		}
 	}
 
 	if (!valid_config_found) {
-		std::cerr << "Unable to load configuration from known locations" << std::endl;
+		LOG_ERROR("config", "Unable to load configuration from " <<
+				(path.empty() ? "known locations" : path));
 		return false;
 	}
 
 	CFG_LOAD(config, "log_config", std::string, m_log_config_file);
 	if (m_log_config_file.empty()) {
-		std::cerr << "Invalid configuration: log_file path is empty!" << std::endl;
+		LOG_ERROR("config", "Invalid configuration: log_file path is empty!");
 		return false;
 	}
 	YAML::Node http_config = config["http"].as<YAML::Node>();
@@ -73,60 +84,111 @@ bool Config::load_configuration()
 	YAML::Node gitlab_config = config["gitlab"].as<YAML::Node>();
 	YAML::Node httpd_config = config["httpd"].as<YAML::Node>();
 	YAML::Node twitter_config = config["twitter"].as<YAML::Node>();
+	YAML::Node commands_config = config["commands"];
+	YAML::Node prefetch_config = config["prefetch"];
+	YAML::Node mail_config = config["mail"];
 
 	try {
 		CFG_LOAD(httpd_config, "port", uint16_t, m_httpd_port);
 		CFG_LOAD(httpd_config, "enable", bool, m_httpd_enabled);
+		CFG_LOAD(httpd_config, "max_body_size", uint32_t, m_httpd_max_body_size);
 
 		CFG_LOAD(http_config, "max_response_size", uint32_t, m_max_http_response_size);
+		CFG_LOAD(http_config, "timeout", uint32_t, m_http_timeout);
+		CFG_LOAD(http_config, "hedge_requests", bool, m_http_hedging_enabled);
+		CFG_LOAD(http_config, "hedge_min_delay", uint32_t, m_http_hedge_min_delay);
+
+		if (commands_config.IsDefined()) {
+			CFG_LOAD(commands_config, "workers", uint16_t, m_command_workers);
+			CFG_LOAD(commands_config, "max_queue_size", uint32_t, m_command_max_queue_size);
+			CFG_LOAD(commands_config, "rate_limit_slots", uint32_t, m_command_rate_limit_slots);
+
+			if (commands_config["rate_limits"].IsDefined() &&
+					!load_command_rate_limits(commands_config["rate_limits"])) {
+				return false;
+			}
+
+			if (commands_config["deadlines"].IsDefined() &&
+					!load_command_deadlines(commands_config["deadlines"])) {
+				return false;
+			}
+		}
+
+		if (prefetch_config.IsDefined()) {
+			CFG_LOAD(prefetch_config, "enable", bool, m_prefetch_enabled);
+			CFG_LOAD(prefetch_config, "capacity", uint32_t, m_prefetch_capacity);
+			CFG_LOAD(prefetch_config, "watermark", uint32_t, m_prefetch_watermark);
+		}
+
+		if (mail_config.IsDefined()) {
+			CFG_LOAD(mail_config, "max_per_recipient", uint32_t, m_mail_max_per_recipient);
+			CFG_LOAD(mail_config, "max_recipient_size", uint32_t, m_mail_max_recipient_size);
+			CFG_LOAD(mail_config, "max_total_size", uint32_t, m_mail_max_total_size);
+			CFG_LOAD(mail_config, "log_directory", std::string, m_mail_log_directory);
+			CFG_LOAD(mail_config, "compact_size", uint32_t, m_mail_compact_size);
+		}
 
 		CFG_LOAD(irc_config, "enable", bool, m_irc_enabled);
 		CFG_LOAD(irc_config, "server", std::string, m_irc_server);
 		CFG_LOAD(irc_config, "port", uint32_t, m_irc_port);
 		CFG_LOAD(irc_config, "name", std::string, m_irc_name);
 		CFG_LOAD(irc_config, "password", std::string, m_irc_password);
+		CFG_LOAD(irc_config, "max_line_length", uint32_t, m_irc_max_line_length);
+		CFG_LOAD(irc_config, "outbound_queue_size", uint32_t, m_irc_outbound_queue_size);
 
-		std::cout << "Config irc de base chargé" << std::endl;
+		if (irc_config["flood"].IsDefined()) {
+			YAML::Node flood_config = irc_config["flood"];
+			CFG_LOAD(flood_config, "burst", uint32_t, m_irc_flood_burst);
+			CFG_LOAD(flood_config, "interval_ms", uint32_t, m_irc_flood_interval_ms);
+		}
 
-		if (irc_config["channels"].IsDefined()) {
-			for (const auto &channel: irc_config["channels"]) {
-				if (!channel["name"].IsDefined()) {
-					std::cerr << "Invalid configuration: channel without name!"
-							  << std::endl;
-					return false;
-				}
-				std::string channel_name = channel["name"].as<std::string>();
-				std::cout << "Chargement config du channel : " << channel_name << std::endl;
+		LOG_DEBUG("config", "Config irc de base chargé");
 
-				if (m_irc_channel_configs.find(channel_name) != m_irc_channel_configs.end()) {
-					std::cerr << "Invalid configuration: duplicate channel '"
-							  << channel_name << "' found in list !" << std::endl;
-					return false;
+		if (irc_config["servers"].IsDefined()) {
+			for (const auto &server: irc_config["servers"]) {
+				IRCServerConfig *server_config = new IRCServerConfig();
+				m_irc_server_configs.push_back(server_config);
+
+				// Top level settings are the defaults of each network
+				server_config->server = m_irc_server;
+				server_config->port = m_irc_port;
+				server_config->nick = m_irc_name;
+				server_config->password = m_irc_password;
+
+				CFG_LOAD(server, "network", std::string, server_config->network);
+				CFG_LOAD(server, "server", std::string, server_config->server);
+				CFG_LOAD(server, "port", uint16_t, server_config->port);
+				CFG_LOAD(server, "nick", std::string, server_config->nick);
+				CFG_LOAD(server, "password", std::string, server_config->password);
+
+				if (server_config->network.empty()) {
+					server_config->network = server_config->server;
 				}
-				IRCChannelConfig *channel_config = new IRCChannelConfig();
-				m_irc_channel_configs[channel_name] = channel_config;
-				CFG_LOAD(channel, "passive", bool, channel_config->is_passive);
-
-				std::cout << "Passive : " << channel_config->is_passive << std::endl;
-
-				if (channel["allowed_commands"].IsDefined()) {
-					CFG_LOAD(channel, "allowed_commands", std::vector<std::string>,
-					channel_config->allowed_commands);
-					if (channel_config->allowed_commands.empty()) {
-						std::cout << "Al commands allowed" << std::endl;
-						channel_config->all_commands_allowed = true;
+
+				for (const auto &other: m_irc_server_configs) {
+					if (other != server_config && other->network == server_config->network) {
+						LOG_ERROR("config", "Invalid configuration: duplicate network '"
+								<< server_config->network << "' found in list !");
+						return false;
 					}
 				}
 
-				CFG_LOAD(channel, "gitlab_project_name", std::string,
-						channel_config->gitlab_project_name);
-
-				CFG_LOAD(channel, "gitlab_project_namespace", std::string,
-						channel_config->gitlab_project_namespace);
-
-				CFG_LOAD(channel, "gitlab_writers", std::vector<std::string>,
-						channel_config->gitlab_writers);
+				if (!load_irc_server_channels(server, server_config)) {
+					return false;
+				}
+			}
+		} else {
+			// Single network configuration
+			IRCServerConfig *server_config = new IRCServerConfig();
+			m_irc_server_configs.push_back(server_config);
+			server_config->network = m_irc_server;
+			server_config->server = m_irc_server;
+			server_config->port = m_irc_port;
+			server_config->nick = m_irc_name;
+			server_config->password = m_irc_password;
 
+			if (!load_irc_server_channels(irc_config, server_config)) {
+				return false;
 			}
 		}
 
@@ -139,8 +201,20 @@ bool Config::load_configuration()
 			}
 		}
 
+		CFG_LOAD(openweathermap_config, "cache_ttl", uint32_t, m_weather_cache_ttl);
+		CFG_LOAD(openweathermap_config, "negative_cache_ttl", uint32_t,
+				m_weather_negative_cache_ttl);
+		CFG_LOAD(openweathermap_config, "cache_size", uint32_t, m_weather_cache_size);
+
 		CFG_LOAD(gitlab_config, "api_key", std::string, m_gitlab_api_key);
 		CFG_LOAD(gitlab_config, "uri", std::string, m_gitlab_uri);
+		CFG_LOAD(gitlab_config, "issue_cache_ttl", uint32_t, m_gitlab_issue_cache_ttl);
+		CFG_LOAD(gitlab_config, "issue_cache_size", uint32_t, m_gitlab_issue_cache_size);
+		CFG_LOAD(gitlab_config, "webhook_token", std::string, m_gitlab_webhook_token);
+		CFG_LOAD(gitlab_config, "webhook_path", std::string, m_gitlab_webhook_path);
+		CFG_LOAD(gitlab_config, "webhook_window", uint32_t, m_gitlab_webhook_window);
+		CFG_LOAD(gitlab_config, "webhook_workers", uint16_t, m_gitlab_webhook_workers);
+		CFG_LOAD(gitlab_config, "webhook_max_queue_size", uint32_t, m_gitlab_webhook_max_queue_size);
 
 		CFG_LOAD(twitter_config, "enable", bool, m_twitter_enable);
 		CFG_LOAD(twitter_config, "consumer_key", std::string, m_twitter_consumer_key);
@@ -152,42 +226,307 @@ bool Config::load_configuration()
 
 	}
 	catch (std::exception &e) {
-		std::cerr << "Invalid configuration file. Please ensure all fields are valid."
-				  << std::endl << "Error was: " << e.what() << std::endl;
+		LOG_ERROR("config", "Invalid configuration file. Please ensure all fields are valid. Error was: "
+				<< e.what());
 		return false;
 	}
 	return true;
 }
 
+bool Config::load_irc_channel_configs(const YAML::Node &channels, IRCChannelConfigs &channel_configs)
+{
+	for (const auto &channel: channels) {
+		if (!channel["name"].IsDefined()) {
+			LOG_ERROR("config", "Invalid configuration: channel without name!");
+			return false;
+		}
+		std::string channel_name = channel["name"].as<std::string>();
+		LOG_DEBUG("config", "Chargement config du channel : " << channel_name);
+
+		if (channel_configs.find(channel_name) != channel_configs.end()) {
+			LOG_ERROR("config", "Invalid configuration: duplicate channel '"
+					  << channel_name << "' found in list !");
+			return false;
+		}
+		IRCChannelConfig *channel_config = new IRCChannelConfig();
+		channel_configs[channel_name] = channel_config;
+		load_irc_channel_policy(channel, channel_name, channel_config);
+
+		CFG_LOAD(channel, "gitlab_project_name", std::string,
+				channel_config->gitlab_project_name);
+
+		CFG_LOAD(channel, "gitlab_project_namespace", std::string,
+				channel_config->gitlab_project_namespace);
+
+		CFG_LOAD(channel, "gitlab_writers", std::vector<std::string>,
+				channel_config->gitlab_writers);
+	}
+
+	return true;
+}
+
+void Config::load_irc_channel_policy(const YAML::Node &channel, const std::string &channel_name,
+		IRCChannelConfig *channel_config)
+{
+	CFG_LOAD(channel, "passive", bool, channel_config->is_passive);
+
+	LOG_DEBUG("config", "Passive : " << channel_config->is_passive);
+
+	if (channel["allowed_commands"].IsDefined()) {
+		CFG_LOAD(channel, "allowed_commands", std::vector<std::string>,
+		channel_config->allowed_commands);
+		if (channel_config->allowed_commands.empty()) {
+			LOG_DEBUG("config", "Al commands allowed");
+			channel_config->all_commands_allowed = true;
+		} else {
+			channel_config->all_commands_allowed = false;
+		}
+	}
+
+	compile_command_policy(channel_name, channel_config);
+}
+
+bool Config::load_irc_server_channels(const YAML::Node &server, IRCServerConfig *server_config)
+{
+	if (server["channels"].IsDefined() &&
+			!load_irc_channel_configs(server["channels"], server_config->channels)) {
+		return false;
+	}
+
+	// Channels missing from the list get no command unless default_channel says otherwise
+	server_config->default_channel_config.is_passive = true;
+	if (server["default_channel"].IsDefined()) {
+		load_irc_channel_policy(server["default_channel"], "default_channel",
+				&server_config->default_channel_config);
+	} else {
+		compile_command_policy("default_channel", &server_config->default_channel_config);
+	}
+
+	return server_config->build_channel_index();
+}
+
+bool Config::load_command_rate_limits(const YAML::Node &rate_limits)
+{
+	if (!rate_limits.IsMap()) {
+		LOG_ERROR("config", "Invalid configuration: commands.rate_limits must be a map!");
+		return false;
+	}
+
+	const auto load_limit = [] (const YAML::Node &node, CommandRateLimit &limit) {
+		CFG_LOAD(node, "per_user", uint32_t, limit.per_user);
+		CFG_LOAD(node, "per_channel", uint32_t, limit.per_channel);
+		CFG_LOAD(node, "window", uint32_t, limit.window);
+	};
+
+	// "default" applies to every command without its own entry
+	if (rate_limits["default"].IsDefined()) {
+		load_limit(rate_limits["default"], m_default_rate_limit);
+	}
+
+	m_command_rate_limits.assign(CommandHandler::get_dispatch_table().size(), m_default_rate_limit);
+	for (const auto &entry: rate_limits) {
+		const std::string command = entry.first.as<std::string>();
+		if (command == "default") {
+			continue;
+		}
+
+		const int32_t command_id = find_command_id(command, "rate_limits");
+		if (command_id >= 0) {
+			load_limit(entry.second, m_command_rate_limits[command_id]);
+		}
+	}
+
+	return true;
+}
+
+bool Config::load_command_deadlines(const YAML::Node &deadlines)
+{
+	if (!deadlines.IsMap()) {
+		LOG_ERROR("config", "Invalid configuration: commands.deadlines must be a map!");
+		return false;
+	}
+
+	// In milliseconds, "default" applies to every command without its own entry
+	CFG_LOAD(deadlines, "default", uint32_t, m_default_command_deadline);
+
+	m_command_deadlines.assign(CommandHandler::get_dispatch_table().size(), m_default_command_deadline);
+	for (const auto &entry: deadlines) {
+		const std::string command = entry.first.as<std::string>();
+		if (command == "default") {
+			continue;
+		}
+
+		const int32_t command_id = find_command_id(command, "deadlines");
+		if (command_id >= 0) {
+			m_command_deadlines[command_id] = entry.second.as<uint32_t>();
+		}
+	}
+
+	return true;
+}
+
+int32_t Config::find_command_id(const std::string &command, const char *section)
+{
+	CommandToken token;
+	token.data = command.c_str();
+	token.length = command.size();
+	const int32_t command_id = CommandHandler::get_dispatch_table().find(token);
+	if (command_id < 0) {
+		LOG_WARN("config", "Unknown command '" << command << "' in commands." << section << ", ignored");
+	}
+	return command_id;
+}
+
+void Config::compile_command_policy(const std::string &channel, IRCChannelConfig *channel_config)
+{
+	if (channel_config->is_passive) {
+		channel_config->allowed_command_mask = 0;
+		return;
+	}
+
+	if (channel_config->all_commands_allowed) {
+		channel_config->allowed_command_mask = UINT64_MAX;
+		return;
+	}
+
+	const CommandDispatchTable &table = CommandHandler::get_dispatch_table();
+	channel_config->allowed_command_mask = 0;
+	for (const auto &command: channel_config->allowed_commands) {
+		CommandToken token;
+		token.data = command.c_str();
+		token.length = command.size();
+		const int32_t command_id = table.find(token);
+		if (command_id < 0 || command_id >= 64) {
+			LOG_WARN("config", "Unknown command '" << command << "' allowed in " << channel
+					<< ", ignored");
+			continue;
+		}
+
+		channel_config->allowed_command_mask |= 1ULL << command_id;
+	}
+}
+
+IRCServerConfig::~IRCServerConfig()
+{
+	for (auto &channel_config: channels) {
+		delete channel_config.second;
+	}
+}
+
+const IRCChannelConfig *IRCServerConfig::get_channel_config(const std::string &channel) const
+{
+	auto it = channels.find(channel);
+	if (it == channels.end()) {
+		return nullptr;
+	}
+
+	return it->second;
+}
+
+const IRCChannelConfig *IRCServerConfig::find_channel_config(const char *channel) const
+{
+	// Index names are already lower case
+	const auto compare = [] (const std::string &entry, const char *name) {
+		const char *a = entry.c_str();
+		while (*a != '\0' && *a == irc_tolower(*name)) {
+			++a;
+			++name;
+		}
+		return (int) (unsigned char) *a - (int) (unsigned char) irc_tolower(*name);
+	};
+
+	auto it = std::lower_bound(channel_index.begin(), channel_index.end(), channel,
+			[&compare] (const std::pair<std::string, const IRCChannelConfig *> &entry,
+					const char *name) {
+				return compare(entry.first, name) < 0;
+			});
+	if (it == channel_index.end() || compare(it->first, channel) != 0) {
+		return nullptr;
+	}
+
+	return it->second;
+}
+
+const IRCChannelConfig *IRCServerConfig::find_channel_policy(const char *channel) const
+{
+	const IRCChannelConfig *channel_config = find_channel_config(channel);
+	return channel_config ? channel_config : &default_channel_config;
+}
+
+bool IRCServerConfig::build_channel_index()
+{
+	channel_index.clear();
+	for (const auto &channel: channels) {
+		std::string name = channel.first;
+		std::transform(name.begin(), name.end(), name.begin(), irc_tolower);
+		channel_index.emplace_back(name, channel.second);
+	}
+	std::sort(channel_index.begin(), channel_index.end());
+
+	// The server sees both as the same channel
+	for (size_t i = 1; i < channel_index.size(); ++i) {
+		if (channel_index[i - 1].first == channel_index[i].first) {
+			LOG_ERROR("config", "Invalid configuration: duplicate channel '"
+					<< channel_index[i].first << "' found in list !");
+			return false;
+		}
+	}
+	return true;
+}
+
 const std::vector<std::string> Config::get_irc_channels() const
 {
 	std::vector<std::string> res = {};
-	for (const auto &channel: m_irc_channel_configs) {
-		res.push_back(channel.first);
+	for (const auto &server_config: m_irc_server_configs) {
+		for (const auto &channel: server_config->channels) {
+			res.push_back(channel.first);
+		}
 	}
 	return res;
 }
 
+const IRCServerConfig *Config::get_irc_server_config(const std::string &network) const
+{
+	for (const auto &server_config: m_irc_server_configs) {
+		if (server_config->network == network) {
+			return server_config;
+		}
+	}
+
+	return nullptr;
+}
+
+const IRCChannelConfig *Config::get_irc_channel_config(const std::string &channel) const
+{
+	// First network having this channel
+	for (const auto &server_config: m_irc_server_configs) {
+		const IRCChannelConfig *channel_config = server_config->find_channel_config(channel.c_str());
+		if (channel_config) {
+			return channel_config;
+		}
+	}
+
+	return nullptr;
+}
+
 const std::string Config::get_channel_gitlab_project_name(
 		const std::string &channel) const
 {
-	for (const auto &c: m_irc_channel_configs) {
-		if (channel.compare(c.first) == 0) {
-			return c.second->gitlab_project_name;
-		}
+	const IRCChannelConfig *channel_config = get_irc_channel_config(channel);
+	if (!channel_config) {
+		return "";
 	}
 
-	return "";
+	return channel_config->gitlab_project_name;
 }
 
 const std::string Config::get_channel_gitlab_project_namespace(
 		const std::string &channel) const
 {
-	for (const auto &c: m_irc_channel_configs) {
-		if (channel.compare(c.first) == 0) {
-			return c.second->gitlab_project_namespace;
-		}
+	const IRCChannelConfig *channel_config = get_irc_channel_config(channel);
+	if (!channel_config) {
+		return "";
 	}
 
-	return "";
+	return channel_config->gitlab_project_namespace;
 }
@@ -24,15 +24,30 @@
  */
 
 #pragma once
+#include <chrono>
+#include <cstdint>
 #include <iostream>
 #include <vector>
 #include <unordered_map>
 
 struct IRCChannelConfig
 {
+	// @param command_id index of the command in the dispatch table, -1 when unknown
+	bool is_command_allowed(const int32_t command_id) const
+	{
+		if (command_id < 0) {
+			// Unknown commands only get their error reply where everything is allowed
+			return all_commands_allowed && !is_passive;
+		}
+		return (allowed_command_mask >> command_id) & 1;
+	}
+
 	bool is_passive = false;
 	bool all_commands_allowed = true;
 	std::vector<std::string> allowed_commands = {};
+	// is_passive and allowed_commands compiled at load time, bit n allows the
+	// command n of the dispatch table
+	uint64_t allowed_command_mask = UINT64_MAX;
 	std::string gitlab_project_name = "";
 	std::string gitlab_project_namespace = "";
 	std::vector<std::string> gitlab_writers = {};
@@ -40,12 +55,66 @@ struct IRCChannelConfig
 
 typedef std::unordered_map<std::string, IRCChannelConfig*> IRCChannelConfigs;
 
+// rfc1459 casemapping, the one IRC servers compare channels and nicks with: []\\^ are
+// the upper case of {}|~
+inline char irc_tolower(const char c)
+{
+	return c >= 'A' && c <= '^' ? (char) (c + ('a' - 'A')) : c;
+}
+
+struct IRCServerConfig
+{
+	~IRCServerConfig();
+
+	const IRCChannelConfig *get_channel_config(const std::string &channel) const;
+	// Case insensitive lookup without building a std::string, for the IRC callbacks
+	const IRCChannelConfig *find_channel_config(const char *channel) const;
+	// Same, falling back to default_channel_config for the channels not configured
+	const IRCChannelConfig *find_channel_policy(const char *channel) const;
+	bool build_channel_index();
+
+	// Unique name of the network
+	std::string network = "";
+	std::string server = "";
+	uint16_t port = 6697;
+	std::string nick = "";
+	std::string password = "";
+	IRCChannelConfigs channels = {};
+	// channels sorted by lower case name
+	std::vector<std::pair<std::string, const IRCChannelConfig *>> channel_index = {};
+	// Policy of the channels the bot is in without configuring them, passive by default
+	IRCChannelConfig default_channel_config = {};
+};
+
+typedef std::vector<IRCServerConfig*> IRCServerConfigs;
+
+// Commands allowed per nick and per channel during a sliding window, 0 is unlimited
+struct CommandRateLimit
+{
+	uint32_t per_user = 0;
+	uint32_t per_channel = 0;
+	// seconds
+	uint32_t window = 60;
+};
+
+namespace YAML
+{
+	class Node;
+}
+
 class Config {
 public:
 	Config() {};
 	~Config();
 
-	bool load_configuration();
+	// Loads path, or the first file found in the known locations when empty
+	bool load_configuration(const std::string &path = "");
+
+	// File the configuration was loaded from
+	const std::string &get_config_path() const
+	{
+		return m_config_path;
+	}
 
 	bool is_httpd_enabled() const
 	{
@@ -67,6 +136,16 @@ public:
 		m_httpd_port = httpd_port;
 	}
 
+	uint32_t get_httpd_max_body_size() const
+	{
+		return m_httpd_max_body_size;
+	}
+
+	void set_httpd_max_body_size(uint32_t httpd_max_body_size)
+	{
+		m_httpd_max_body_size = httpd_max_body_size;
+	}
+
 	const std::string &get_irc_name() const
 	{
 		return m_irc_name;
@@ -117,14 +196,49 @@ public:
 		m_irc_port = irc_port;
 	}
 
-	const IRCChannelConfigs &get_irc_channel_configs() const
+	uint32_t get_irc_flood_burst() const
+	{
+		return m_irc_flood_burst;
+	}
+
+	void set_irc_flood_burst(uint32_t irc_flood_burst)
+	{
+		m_irc_flood_burst = irc_flood_burst;
+	}
+
+	uint32_t get_irc_flood_interval_ms() const
+	{
+		return m_irc_flood_interval_ms;
+	}
+
+	void set_irc_flood_interval_ms(uint32_t irc_flood_interval_ms)
+	{
+		m_irc_flood_interval_ms = irc_flood_interval_ms;
+	}
+
+	uint32_t get_irc_max_line_length() const
+	{
+		return m_irc_max_line_length;
+	}
+
+	void set_irc_max_line_length(uint32_t irc_max_line_length)
 	{
-		return m_irc_channel_configs;
+		m_irc_max_line_length = irc_max_line_length;
 	}
 
-	void set_irc_channel_configs(const IRCChannelConfigs &irc_channel_configs)
+	uint32_t get_irc_outbound_queue_size() const
 	{
-		m_irc_channel_configs = irc_channel_configs;
+		return m_irc_outbound_queue_size;
+	}
+
+	void set_irc_outbound_queue_size(uint32_t irc_outbound_queue_size)
+	{
+		m_irc_outbound_queue_size = irc_outbound_queue_size;
+	}
+
+	const IRCServerConfigs &get_irc_server_configs() const
+	{
+		return m_irc_server_configs;
 	}
 
 	uint32_t get_max_http_response_size() const
@@ -137,6 +251,169 @@ public:
 		m_max_http_response_size = max_http_response_size;
 	}
 
+	const std::string &get_log_config_file() const
+	{
+		return m_log_config_file;
+	}
+
+	uint32_t get_http_timeout() const
+	{
+		return m_http_timeout;
+	}
+
+	void set_http_timeout(uint32_t http_timeout)
+	{
+		m_http_timeout = http_timeout;
+	}
+
+	bool is_http_hedging_enabled() const
+	{
+		return m_http_hedging_enabled;
+	}
+
+	void set_http_hedging_enabled(bool http_hedging_enabled)
+	{
+		m_http_hedging_enabled = http_hedging_enabled;
+	}
+
+	uint32_t get_http_hedge_min_delay() const
+	{
+		return m_http_hedge_min_delay;
+	}
+
+	void set_http_hedge_min_delay(uint32_t http_hedge_min_delay)
+	{
+		m_http_hedge_min_delay = http_hedge_min_delay;
+	}
+
+	uint16_t get_command_workers() const
+	{
+		return m_command_workers;
+	}
+
+	void set_command_workers(uint16_t command_workers)
+	{
+		m_command_workers = command_workers;
+	}
+
+	uint32_t get_command_max_queue_size() const
+	{
+		return m_command_max_queue_size;
+	}
+
+	void set_command_max_queue_size(uint32_t command_max_queue_size)
+	{
+		m_command_max_queue_size = command_max_queue_size;
+	}
+
+	uint32_t get_command_rate_limit_slots() const
+	{
+		return m_command_rate_limit_slots;
+	}
+
+	void set_command_rate_limit_slots(uint32_t command_rate_limit_slots)
+	{
+		m_command_rate_limit_slots = command_rate_limit_slots;
+	}
+
+	// @param command_id index of the command in the dispatch table, -1 when unknown
+	std::chrono::milliseconds get_command_deadline(const int32_t command_id) const
+	{
+		if (command_id < 0 || (size_t) command_id >= m_command_deadlines.size()) {
+			return std::chrono::milliseconds(m_default_command_deadline);
+		}
+		return std::chrono::milliseconds(m_command_deadlines[command_id]);
+	}
+
+	// @param command_id index of the command in the dispatch table, -1 when unknown
+	const CommandRateLimit &get_command_rate_limit(const int32_t command_id) const
+	{
+		if (command_id < 0 || (size_t) command_id >= m_command_rate_limits.size()) {
+			return m_default_rate_limit;
+		}
+		return m_command_rate_limits[command_id];
+	}
+
+	bool is_prefetch_enabled() const
+	{
+		return m_prefetch_enabled;
+	}
+
+	void set_prefetch_enabled(bool prefetch_enabled)
+	{
+		m_prefetch_enabled = prefetch_enabled;
+	}
+
+	uint32_t get_prefetch_capacity() const
+	{
+		return m_prefetch_capacity;
+	}
+
+	void set_prefetch_capacity(uint32_t prefetch_capacity)
+	{
+		m_prefetch_capacity = prefetch_capacity;
+	}
+
+	uint32_t get_prefetch_watermark() const
+	{
+		return m_prefetch_watermark;
+	}
+
+	void set_prefetch_watermark(uint32_t prefetch_watermark)
+	{
+		m_prefetch_watermark = prefetch_watermark;
+	}
+
+	uint32_t get_mail_max_per_recipient() const
+	{
+		return m_mail_max_per_recipient;
+	}
+
+	void set_mail_max_per_recipient(uint32_t mail_max_per_recipient)
+	{
+		m_mail_max_per_recipient = mail_max_per_recipient;
+	}
+
+	uint32_t get_mail_max_recipient_size() const
+	{
+		return m_mail_max_recipient_size;
+	}
+
+	void set_mail_max_recipient_size(uint32_t mail_max_recipient_size)
+	{
+		m_mail_max_recipient_size = mail_max_recipient_size;
+	}
+
+	uint32_t get_mail_max_total_size() const
+	{
+		return m_mail_max_total_size;
+	}
+
+	void set_mail_max_total_size(uint32_t mail_max_total_size)
+	{
+		m_mail_max_total_size = mail_max_total_size;
+	}
+
+	const std::string &get_mail_log_directory() const
+	{
+		return m_mail_log_directory;
+	}
+
+	void set_mail_log_directory(const std::string &mail_log_directory)
+	{
+		m_mail_log_directory = mail_log_directory;
+	}
+
+	uint32_t get_mail_compact_size() const
+	{
+		return m_mail_compact_size;
+	}
+
+	void set_mail_compact_size(uint32_t mail_compact_size)
+	{
+		m_mail_compact_size = mail_compact_size;
+	}
+
 	const std::string &get_openweathermap_api_key() const
 	{
 		return m_openweathermap_api_key;
@@ -147,6 +424,36 @@ public:
 		m_openweathermap_api_key = openweathermap_api_key;
 	}
 
+	uint32_t get_weather_cache_ttl() const
+	{
+		return m_weather_cache_ttl;
+	}
+
+	void set_weather_cache_ttl(uint32_t weather_cache_ttl)
+	{
+		m_weather_cache_ttl = weather_cache_ttl;
+	}
+
+	uint32_t get_weather_negative_cache_ttl() const
+	{
+		return m_weather_negative_cache_ttl;
+	}
+
+	void set_weather_negative_cache_ttl(uint32_t weather_negative_cache_ttl)
+	{
+		m_weather_negative_cache_ttl = weather_negative_cache_ttl;
+	}
+
+	uint32_t get_weather_cache_size() const
+	{
+		return m_weather_cache_size;
+	}
+
+	void set_weather_cache_size(uint32_t weather_cache_size)
+	{
+		m_weather_cache_size = weather_cache_size;
+	}
+
 	const std::string &get_gitlab_api_key() const
 	{
 		return m_gitlab_api_key;
@@ -167,6 +474,76 @@ public:
 		m_gitlab_uri = gitlab_uri;
 	}
 
+	uint32_t get_gitlab_issue_cache_ttl() const
+	{
+		return m_gitlab_issue_cache_ttl;
+	}
+
+	void set_gitlab_issue_cache_ttl(uint32_t gitlab_issue_cache_ttl)
+	{
+		m_gitlab_issue_cache_ttl = gitlab_issue_cache_ttl;
+	}
+
+	uint32_t get_gitlab_issue_cache_size() const
+	{
+		return m_gitlab_issue_cache_size;
+	}
+
+	void set_gitlab_issue_cache_size(uint32_t gitlab_issue_cache_size)
+	{
+		m_gitlab_issue_cache_size = gitlab_issue_cache_size;
+	}
+
+	const std::string &get_gitlab_webhook_token() const
+	{
+		return m_gitlab_webhook_token;
+	}
+
+	void set_gitlab_webhook_token(const std::string &gitlab_webhook_token)
+	{
+		m_gitlab_webhook_token = gitlab_webhook_token;
+	}
+
+	const std::string &get_gitlab_webhook_path() const
+	{
+		return m_gitlab_webhook_path;
+	}
+
+	void set_gitlab_webhook_path(const std::string &gitlab_webhook_path)
+	{
+		m_gitlab_webhook_path = gitlab_webhook_path;
+	}
+
+	uint32_t get_gitlab_webhook_window() const
+	{
+		return m_gitlab_webhook_window;
+	}
+
+	void set_gitlab_webhook_window(uint32_t gitlab_webhook_window)
+	{
+		m_gitlab_webhook_window = gitlab_webhook_window;
+	}
+
+	uint16_t get_gitlab_webhook_workers() const
+	{
+		return m_gitlab_webhook_workers;
+	}
+
+	void set_gitlab_webhook_workers(uint16_t gitlab_webhook_workers)
+	{
+		m_gitlab_webhook_workers = gitlab_webhook_workers;
+	}
+
+	uint32_t get_gitlab_webhook_max_queue_size() const
+	{
+		return m_gitlab_webhook_max_queue_size;
+	}
+
+	void set_gitlab_webhook_max_queue_size(uint32_t gitlab_webhook_max_queue_size)
+	{
+		m_gitlab_webhook_max_queue_size = gitlab_webhook_max_queue_size;
+	}
+
 	const std::string &getTwitter_consumer_key() const
 	{
 		return m_twitter_consumer_key;
@@ -208,22 +585,78 @@ public:
 	}
 
 	const std::vector<std::string> get_irc_channels() const;
+	const IRCServerConfig *get_irc_server_config(const std::string &network) const;
+	const IRCChannelConfig *get_irc_channel_config(const std::string &channel) const;
 	const std::string get_channel_gitlab_project_name(const std::string &channel) const;
 	const std::string get_channel_gitlab_project_namespace(const std::string &channel) const;
 
 private:
+	bool load_irc_channel_configs(const YAML::Node &channels, IRCChannelConfigs &channel_configs);
+	static void load_irc_channel_policy(const YAML::Node &channel, const std::string &channel_name,
+			IRCChannelConfig *channel_config);
+	bool load_irc_server_channels(const YAML::Node &server, IRCServerConfig *server_config);
+	bool load_command_rate_limits(const YAML::Node &rate_limits);
+	bool load_command_deadlines(const YAML::Node &deadlines);
+	static int32_t find_command_id(const std::string &command, const char *section);
+	static void compile_command_policy(const std::string &channel, IRCChannelConfig *channel_config);
+
+	std::string m_config_path = "";
 	bool m_httpd_enabled = true;
 	uint16_t m_httpd_port = 8080;
+	uint32_t m_httpd_max_body_size = 1024 * 1024;
 	std::string m_irc_name = "mybot_name";
 	std::string m_irc_password = "";
 	std::string m_irc_server = "chat.freenode.net";
 	bool m_irc_enabled = true;
 	uint16_t m_irc_port = 6697;
-	IRCChannelConfigs m_irc_channel_configs = {};
+	// Token bucket: burst messages, then one message per interval
+	uint32_t m_irc_flood_burst = 5;
+	uint32_t m_irc_flood_interval_ms = 2000;
+	uint32_t m_irc_max_line_length = 400;
+	uint32_t m_irc_outbound_queue_size = 1024;
+	IRCServerConfigs m_irc_server_configs = {};
 	uint32_t m_max_http_response_size = 100 * 1024;
+	// milliseconds, for requests made without a command deadline
+	uint32_t m_http_timeout = 10000;
+	bool m_http_hedging_enabled = false;
+	// milliseconds
+	uint32_t m_http_hedge_min_delay = 50;
+	uint16_t m_command_workers = 4;
+	uint32_t m_command_max_queue_size = 256;
+	uint32_t m_command_rate_limit_slots = 4096;
+	CommandRateLimit m_default_rate_limit = {};
+	// Indexed by dispatch table command id
+	std::vector<CommandRateLimit> m_command_rate_limits = {};
+	// milliseconds, indexed by dispatch table command id
+	uint32_t m_default_command_deadline = 10000;
+	std::vector<uint32_t> m_command_deadlines = {};
+	bool m_prefetch_enabled = true;
+	uint32_t m_prefetch_capacity = 16;
+	uint32_t m_prefetch_watermark = 8;
+	uint32_t m_mail_max_per_recipient = 10;
+	// bytes
+	uint32_t m_mail_max_recipient_size = 4 * 1024;
+	uint32_t m_mail_max_total_size = 1024 * 1024;
+	// Empty keeps mail in memory only
+	std::string m_mail_log_directory = "mail";
+	uint32_t m_mail_compact_size = 1024 * 1024;
 	std::string m_openweathermap_api_key = "";
+	// seconds
+	uint32_t m_weather_cache_ttl = 600;
+	uint32_t m_weather_negative_cache_ttl = 60;
+	uint32_t m_weather_cache_size = 256;
 	std::string m_gitlab_api_key = "";
 	std::string m_gitlab_uri = "";
+	// seconds
+	uint32_t m_gitlab_issue_cache_ttl = 60;
+	uint32_t m_gitlab_issue_cache_size = 512;
+	// Webhooks are refused while no token is set
+	std::string m_gitlab_webhook_token = "";
+	std::string m_gitlab_webhook_path = "/gitlab/webhook";
+	// seconds
+	uint32_t m_gitlab_webhook_window = 10;
+	uint16_t m_gitlab_webhook_workers = 2;
+	uint32_t m_gitlab_webhook_max_queue_size = 128;
 
 	std::string m_log_config_file = "log4cpp.properties";
 	/*
@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <functional>
+#include <thread>
+#include "ConfigStore.h"
+#include "Config.h"
+
+ConfigStore::ConfigStore(const Config *boot_cfg) : m_boot_cfg(boot_cfg), m_current(boot_cfg),
+		m_version(1)
+{
+	for (auto &hazard: m_hazards) {
+		hazard.store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+ConfigStore::~ConfigStore()
+{
+	// Every reader is gone by now
+	const Config *current = m_current.load();
+	if (current != m_boot_cfg) {
+		delete current;
+	}
+
+	for (const Config *cfg: m_retired) {
+		delete cfg;
+	}
+	m_retired.clear();
+}
+
+ConfigSnapshot ConfigStore::acquire() const
+{
+	// Spread threads over the slots so they don't all fight for the first ones
+	static thread_local const size_t first_slot =
+			std::hash<std::thread::id>()(std::this_thread::get_id()) % CONFIG_STORE_MAX_READERS;
+
+	const Config *cfg = m_current.load();
+	while (true) {
+		for (size_t i = 0; i < CONFIG_STORE_MAX_READERS; ++i) {
+			std::atomic<const Config *> &slot = m_hazards[(first_slot + i) % CONFIG_STORE_MAX_READERS];
+			const Config *expected = nullptr;
+			if (!slot.compare_exchange_strong(expected, cfg)) {
+				continue;
+			}
+
+			// A snapshot published before the hazard became visible may be
+			// freed, protect the new one instead
+			const Config *current = m_current.load();
+			while (current != cfg) {
+				cfg = current;
+				slot.store(cfg);
+				current = m_current.load();
+			}
+
+			return ConfigSnapshot(&slot, cfg);
+		}
+
+		// More readers than slots, they only hold them for one command
+		std::this_thread::yield();
+		cfg = m_current.load();
+	}
+}
+
+void ConfigStore::publish(const Config *cfg)
+{
+	const Config *previous = m_current.exchange(cfg);
+	m_version++;
+
+	if (previous != m_boot_cfg) {
+		std::unique_lock<std::mutex> lock(m_retired_mutex);
+		m_retired.push_back(previous);
+	}
+	reclaim();
+}
+
+void ConfigStore::reclaim()
+{
+	std::unique_lock<std::mutex> lock(m_retired_mutex);
+	for (auto it = m_retired.begin(); it != m_retired.end();) {
+		if (is_hazard(*it)) {
+			++it;
+			continue;
+		}
+
+		delete *it;
+		it = m_retired.erase(it);
+	}
+}
+
+bool ConfigStore::is_hazard(const Config *cfg) const
+{
+	for (const auto &hazard: m_hazards) {
+		if (hazard.load() == cfg) {
+			return true;
+		}
+	}
+	return false;
+}
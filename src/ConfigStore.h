@@ -0,0 +1,108 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Snapshots which can be read at the same time, one per live ConfigSnapshot
+#define CONFIG_STORE_MAX_READERS 64
+
+class Config;
+
+/**
+ * Read guard on a published Config. The Config stays valid, and unchanged,
+ * until the guard is destroyed, even if a newer one was published meanwhile.
+ */
+class ConfigSnapshot
+{
+public:
+	ConfigSnapshot(ConfigSnapshot &&other) : m_slot(other.m_slot), m_cfg(other.m_cfg)
+	{
+		other.m_slot = nullptr;
+		other.m_cfg = nullptr;
+	}
+
+	~ConfigSnapshot()
+	{
+		if (m_slot) {
+			m_slot->store(nullptr, std::memory_order_release);
+		}
+	}
+
+	ConfigSnapshot(const ConfigSnapshot &) = delete;
+	ConfigSnapshot &operator=(const ConfigSnapshot &) = delete;
+
+	const Config *get() const { return m_cfg; }
+	const Config *operator->() const { return m_cfg; }
+
+private:
+	friend class ConfigStore;
+
+	ConfigSnapshot(std::atomic<const Config *> *slot, const Config *cfg) : m_slot(slot), m_cfg(cfg) {}
+
+	std::atomic<const Config *> *m_slot = nullptr;
+	const Config *m_cfg = nullptr;
+};
+
+/**
+ * Holds the current Config as an immutable snapshot behind an atomic pointer.
+ *
+ * Readers never lock: acquire() publishes the snapshot it reads in a hazard
+ * slot, and publish() only frees a replaced snapshot once no slot holds it.
+ *
+ * The boot Config is owned by the caller and never freed here, components
+ * keep reading their startup-only settings (networks, pools, queue sizes)
+ * from it.
+ */
+class ConfigStore
+{
+public:
+	ConfigStore(const Config *boot_cfg);
+	~ConfigStore();
+
+	ConfigSnapshot acquire() const;
+	// Takes ownership of cfg
+	void publish(const Config *cfg);
+	// Frees the replaced snapshots no reader holds anymore
+	void reclaim();
+
+	uint64_t get_version() const { return m_version; }
+
+private:
+	bool is_hazard(const Config *cfg) const;
+
+	const Config *m_boot_cfg = nullptr;
+	std::atomic<const Config *> m_current;
+	std::atomic<uint64_t> m_version;
+	mutable std::atomic<const Config *> m_hazards[CONFIG_STORE_MAX_READERS];
+
+	// Replaced snapshots still read by someone
+	std::mutex m_retired_mutex;
+	std::vector<const Config *> m_retired = {};
+};
@@ -0,0 +1,195 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "ConfigWatcher.h"
+#include "ConfigStore.h"
+#include "Config.h"
+#include "Log.h"
+
+// Editors write in several steps, wait for the file to settle before parsing it
+#define CONFIG_RELOAD_DELAY_MS 200
+#define CONFIG_POLL_TIMEOUT_MS 5000
+
+ConfigWatcher::ConfigWatcher(ConfigStore *store, const std::string &path) : m_store(store),
+		m_path(path), m_running(false)
+{
+	const size_t slash = path.rfind('/');
+	if (slash == std::string::npos) {
+		m_directory = ".";
+		m_file_name = path;
+	} else {
+		m_directory = slash == 0 ? "/" : path.substr(0, slash);
+		m_file_name = path.substr(slash + 1);
+	}
+
+	m_reload_metric = Metrics::register_counter("bot_config_reloads_total", "",
+			"Configuration reloads published");
+	m_failure_metric = Metrics::register_counter("bot_config_reload_failures_total", "",
+			"Configuration reloads refused because the file was invalid");
+	Metrics::register_callback("bot_config_version", "", "Version of the configuration in use",
+			"gauge", [store] { return (double) store->get_version(); });
+}
+
+ConfigWatcher::~ConfigWatcher()
+{
+	stop();
+}
+
+bool ConfigWatcher::start()
+{
+	if (m_running) {
+		return true;
+	}
+
+	m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_inotify_fd < 0) {
+		LOG_ERROR("config", "Unable to watch the configuration: " << strerror(errno));
+		return false;
+	}
+
+	m_watch_fd = inotify_add_watch(m_inotify_fd, m_directory.c_str(),
+			IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+	if (m_watch_fd < 0 || pipe(m_wakeup_pipe) != 0) {
+		LOG_ERROR("config", "Unable to watch " << m_directory << ": " << strerror(errno));
+		close(m_inotify_fd);
+		m_inotify_fd = -1;
+		return false;
+	}
+
+	fcntl(m_wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+	m_running = true;
+	m_thread = std::thread([this] { run(); });
+
+	LOG_INFO("config", "Watching " << m_path << " for configuration changes");
+	return true;
+}
+
+void ConfigWatcher::stop()
+{
+	if (!m_running.exchange(false)) {
+		return;
+	}
+
+	const char c = 0;
+	if (write(m_wakeup_pipe[1], &c, 1) < 0) {
+		LOG_ERROR("config", "Unable to wake up the configuration watcher");
+	}
+
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+
+	close(m_inotify_fd);
+	m_inotify_fd = -1;
+	for (int &fd: m_wakeup_pipe) {
+		close(fd);
+		fd = -1;
+	}
+}
+
+bool ConfigWatcher::reload()
+{
+	Config *cfg = new Config();
+	if (!cfg->load_configuration(m_path)) {
+		delete cfg;
+		Metrics::increment(m_failure_metric);
+		LOG_ERROR("config", "Configuration " << m_path << " is invalid, keeping the current one");
+		return false;
+	}
+
+	// New credentials must be redacted before anything logs them
+	Log::set_secrets(cfg);
+	m_store->publish(cfg);
+	Metrics::increment(m_reload_metric);
+	LOG_INFO("config", "Configuration reloaded from " << m_path << " (version "
+			<< m_store->get_version() << ")");
+	return true;
+}
+
+void ConfigWatcher::run()
+{
+	struct pollfd fds[2];
+	fds[0].fd = m_inotify_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = m_wakeup_pipe[0];
+	fds[1].events = POLLIN;
+
+	bool pending = false;
+	while (m_running) {
+		fds[0].revents = 0;
+		fds[1].revents = 0;
+
+		const int rc = poll(fds, 2, pending ? CONFIG_RELOAD_DELAY_MS : CONFIG_POLL_TIMEOUT_MS);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			LOG_ERROR("config", "Configuration watcher poll error: " << strerror(errno));
+			break;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			// Keep waiting while the file is still being written
+			pending = read_events() || pending;
+			continue;
+		}
+
+		if (pending) {
+			pending = false;
+			reload();
+		}
+
+		// Snapshots still read during the last reload can go now
+		m_store->reclaim();
+	}
+}
+
+bool ConfigWatcher::read_events()
+{
+	bool changed = false;
+	alignas(struct inotify_event) char buf[4096];
+	ssize_t len;
+	while ((len = read(m_inotify_fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + len;) {
+			const struct inotify_event *event = (const struct inotify_event *) p;
+			if (event->len > 0 && m_file_name == event->name) {
+				changed = true;
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	return changed;
+}
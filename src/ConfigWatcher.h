@@ -0,0 +1,72 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include "Metrics.h"
+
+class ConfigStore;
+
+/**
+ * Reloads the configuration file when it changes on disk and publishes the
+ * result in the ConfigStore. Parsing happens on the watcher thread, a file
+ * which fails to load keeps the current snapshot.
+ *
+ * The parent directory is watched with inotify so editors replacing the
+ * file through a rename are seen too.
+ */
+class ConfigWatcher
+{
+public:
+	ConfigWatcher(ConfigStore *store, const std::string &path);
+	~ConfigWatcher();
+
+	bool start();
+	void stop();
+
+	bool reload();
+
+private:
+	void run();
+	bool read_events();
+
+	ConfigStore *m_store = nullptr;
+	std::string m_path = "";
+	std::string m_directory = "";
+	std::string m_file_name = "";
+
+	int m_inotify_fd = -1;
+	int m_watch_fd = -1;
+	// Self pipe interrupting poll() on stop
+	int m_wakeup_pipe[2] = {-1, -1};
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+
+	MetricId m_reload_metric = METRIC_INVALID_ID;
+	MetricId m_failure_metric = METRIC_INVALID_ID;
+};
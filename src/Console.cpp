@@ -24,12 +24,15 @@
  */
 
 #include "Console.h"
-#include "CommandHandler.h"
+#include "CommandExecutor.h"
+#include "Config.h"
+#include "IRCThread.h"
 
 bool Console::s_is_running = true;
 Console *Console::that = nullptr;
 
-Console::Console(IRCThread *irc_thread) : m_irc_thread(irc_thread)
+Console::Console(IRCThread *irc_thread, CommandExecutor *executor) :
+		m_irc_thread(irc_thread), m_executor(executor)
 {
 	that = this;
 }
@@ -38,14 +41,24 @@ void Console::run(const Config *cfg)
 {
 	std::cout << "Console run." << std::endl;
 	std::string cmd;
-	CommandHandler *command_handler = nullptr;
-	std::string msg = "";
 
-	while(s_is_running && getline(std::cin, cmd)) {
-		command_handler = new CommandHandler(m_irc_thread, cfg, cmd, Permission::CONSOLE);
-		command_handler->start();
+	// Console replies and .say go to the first channel of the first network
+	std::string channel = "";
+	const IRCServerConfigs &servers = cfg->get_irc_server_configs();
+	if (!servers.empty() && !servers.front()->channels.empty()) {
+		channel = servers.front()->channels.begin()->first;
+	}
+	IRCConnection *connection = m_irc_thread ? m_irc_thread->get_default_connection() : nullptr;
 
-		std::cout << msg << std::endl;
+	while(s_is_running && getline(std::cin, cmd)) {
+		CommandJob job;
+		job.text = cmd;
+		job.permission = Permission::CONSOLE;
+		job.reply_to = channel;
+		job.connection = connection;
+		if (!m_executor->submit(std::move(job))) {
+			std::cout << "Too many pending commands, try again later." << std::endl;
+		}
 	}
 }
 
@@ -27,15 +27,18 @@
 
 #include "IRCThread.h"
 
+class CommandExecutor;
+
 class Console {
 public:
-	Console(IRCThread *irc_thread);
+	Console(IRCThread *irc_thread, CommandExecutor *executor);
 	void run(const Config *cfg);
 	static bool is_running() { return s_is_running; };
 	static void stop();
 
 private:
 	IRCThread *m_irc_thread = nullptr;
+	CommandExecutor *m_executor = nullptr;
 	static bool s_is_running;
 	static Console *that;
 };
@@ -0,0 +1,210 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include "ContentPrefetcher.h"
+#include "Config.h"
+#include "HttpClient.h"
+
+// Wait before retrying a source after a failed fetch
+#define PREFETCH_RETRY_DELAY std::chrono::seconds(30)
+#define PREFETCH_IDLE_WAKEUP std::chrono::seconds(5)
+
+ContentPrefetcher::ContentPrefetcher(const Config *cfg, HttpClient *http_client) :
+		m_cfg(cfg), m_http_client(http_client)
+{
+	uint32_t capacity = cfg->get_prefetch_capacity();
+	if (capacity == 0) {
+		capacity = 1;
+	}
+
+	m_watermark = std::min(cfg->get_prefetch_watermark(), capacity);
+
+	for (auto &buffer: m_buffers) {
+		buffer.items.resize(capacity);
+	}
+}
+
+ContentPrefetcher::~ContentPrefetcher()
+{
+	stop();
+}
+
+void ContentPrefetcher::start()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_running || !m_cfg->is_prefetch_enabled()) {
+		return;
+	}
+
+	m_running = true;
+	m_thread = std::thread([this] { run(); });
+}
+
+void ContentPrefetcher::stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (!m_running) {
+			return;
+		}
+		m_running = false;
+	}
+
+	m_cv.notify_all();
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+const std::string &ContentPrefetcher::get_url(const PrefetchSource source)
+{
+	static const std::string urls[PREFETCH_SOURCE_COUNT] = {
+			"http://api.icndb.com/jokes/random",
+			"http://webknox.com/api/jokes/random?apiKey=bejebgdahjzmcxjyxbkpmbmbvtttidu",
+			// Key default  A CHANGER
+			"http://q.uote.me/api.php?p=json&l=1&s=random",
+	};
+
+	return urls[source];
+}
+
+const JsonFieldSet &ContentPrefetcher::get_fields(const PrefetchSource source)
+{
+	static const JsonFieldSet fields[PREFETCH_SOURCE_COUNT] = {
+			{"value.joke"},
+			{"joke"},
+			{"data[0].text"},
+	};
+
+	return fields[source];
+}
+
+bool ContentPrefetcher::extract_item(const PrefetchSource source, const JsonFields &fields,
+		std::string &item)
+{
+	if (source >= PREFETCH_SOURCE_COUNT) {
+		return false;
+	}
+
+	// Each source declares a single path
+	item = fields.as_string(0);
+	return !item.empty();
+}
+
+bool ContentPrefetcher::pop(const PrefetchSource source, std::string &item)
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		RingBuffer &buffer = m_buffers[source];
+		if (buffer.count == 0) {
+			return false;
+		}
+
+		item = std::move(buffer.items[buffer.head]);
+		buffer.head = (buffer.head + 1) % buffer.items.size();
+		buffer.count--;
+
+		if (buffer.count + buffer.in_flight >= m_watermark) {
+			return true;
+		}
+	}
+
+	// Below the watermark, wake up the refiller
+	m_cv.notify_one();
+	return true;
+}
+
+size_t ContentPrefetcher::get_buffered(const PrefetchSource source) const
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return m_buffers[source].count;
+}
+
+void ContentPrefetcher::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_running) {
+		lock.unlock();
+		refill();
+		lock.lock();
+
+		m_cv.wait_for(lock, PREFETCH_IDLE_WAKEUP);
+	}
+}
+
+void ContentPrefetcher::refill()
+{
+	auto now = std::chrono::steady_clock::now();
+
+	for (uint8_t i = 0; i < PREFETCH_SOURCE_COUNT; ++i) {
+		const PrefetchSource source = (PrefetchSource) i;
+		uint32_t missing = 0;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			RingBuffer &buffer = m_buffers[source];
+			if (now < buffer.retry_after || buffer.count + buffer.in_flight >= m_watermark) {
+				continue;
+			}
+
+			// Fill up to the capacity once we reached the watermark
+			missing = buffer.items.size() - buffer.count - buffer.in_flight;
+			buffer.in_flight += missing;
+		}
+
+		for (uint32_t j = 0; j < missing; ++j) {
+			m_http_client->get_fields_async(get_url(source), get_fields(source),
+					[this, source] (bool success, long, const JsonFields &fields) {
+						on_item_fetched(source, success, fields);
+					});
+		}
+	}
+}
+
+void ContentPrefetcher::on_item_fetched(const PrefetchSource source, bool success,
+		const JsonFields &fields)
+{
+	// Runs on the HTTP loop thread
+	std::string item;
+	if (success) {
+		success = extract_item(source, fields, item);
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	RingBuffer &buffer = m_buffers[source];
+	buffer.in_flight--;
+
+	if (!success) {
+		buffer.retry_after = std::chrono::steady_clock::now() + PREFETCH_RETRY_DELAY;
+		return;
+	}
+
+	if (buffer.count == buffer.items.size()) {
+		return;
+	}
+
+	buffer.items[(buffer.head + buffer.count) % buffer.items.size()] = std::move(item);
+	buffer.count++;
+}
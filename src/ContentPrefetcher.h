@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "JsonFields.h"
+
+class Config;
+class HttpClient;
+
+enum PrefetchSource : uint8_t
+{
+	PREFETCH_CHUCK_NORRIS,
+	PREFETCH_JOKE,
+	PREFETCH_QUOTE,
+	PREFETCH_SOURCE_COUNT,
+};
+
+/**
+ * Keeps a ring buffer of random items per source topped up in background,
+ * so .chuck_norris, .joke and .quote answer from memory instead of waiting
+ * for the upstream API.
+ */
+class ContentPrefetcher
+{
+public:
+	ContentPrefetcher(const Config *cfg, HttpClient *http_client);
+	~ContentPrefetcher();
+
+	void start();
+	void stop();
+
+	bool pop(const PrefetchSource source, std::string &item);
+	size_t get_buffered(const PrefetchSource source) const;
+
+	static const std::string &get_url(const PrefetchSource source);
+	static const JsonFieldSet &get_fields(const PrefetchSource source);
+	static bool extract_item(const PrefetchSource source, const JsonFields &fields,
+			std::string &item);
+
+private:
+	struct RingBuffer
+	{
+		std::vector<std::string> items = {};
+		size_t head = 0;
+		size_t count = 0;
+		uint32_t in_flight = 0;
+		std::chrono::steady_clock::time_point retry_after = {};
+	};
+
+	void run();
+	void refill();
+	void on_item_fetched(const PrefetchSource source, bool success,
+			const JsonFields &fields);
+
+	const Config *m_cfg = nullptr;
+	HttpClient *m_http_client = nullptr;
+	uint32_t m_watermark = 0;
+
+	RingBuffer m_buffers[PREFETCH_SOURCE_COUNT];
+	mutable std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::thread m_thread;
+	bool m_running = false;
+};
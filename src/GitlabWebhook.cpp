@@ -0,0 +1,461 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include "GitlabWebhook.h"
+#include "IRCThread.h"
+#include "Config.h"
+#include "ConfigStore.h"
+#include "Log.h"
+
+// Items listed per category before summarizing the rest
+#define GITLAB_WEBHOOK_MAX_ITEMS 3
+#define GITLAB_WEBHOOK_MAX_TITLE_LENGTH 60
+
+static std::string shorten(const std::string &title)
+{
+	const std::string line = title.substr(0, title.find('\n'));
+	if (line.size() <= GITLAB_WEBHOOK_MAX_TITLE_LENGTH) {
+		return line;
+	}
+	return line.substr(0, GITLAB_WEBHOOK_MAX_TITLE_LENGTH - 3) + "...";
+}
+
+static std::string strip_ref(const std::string &ref)
+{
+	static const std::string prefixes[] = {"refs/heads/", "refs/tags/"};
+	for (const auto &prefix: prefixes) {
+		if (ref.compare(0, prefix.size(), prefix) == 0) {
+			return ref.substr(prefix.size());
+		}
+	}
+	return ref;
+}
+
+static std::string join(const std::vector<std::string> &items, const std::string &separator)
+{
+	std::string result = "";
+	for (size_t i = 0; i < items.size() && i < GITLAB_WEBHOOK_MAX_ITEMS; ++i) {
+		result += (i ? separator : "") + items[i];
+	}
+
+	if (items.size() > GITLAB_WEBHOOK_MAX_ITEMS) {
+		result += " and " + std::to_string(items.size() - GITLAB_WEBHOOK_MAX_ITEMS) + " more";
+	}
+	return result;
+}
+
+static std::string get_past_tense(const std::string &action)
+{
+	if (action == "close") {
+		return "closed";
+	}
+	if (action == "merge") {
+		return "merged";
+	}
+	return action + "ed";
+}
+
+// Compares the whole token whatever the mismatch position, not to leak it by timing
+static bool is_token_valid(const std::string &expected, const std::string &token)
+{
+	// A reload may clear the token, webhooks are refused until one is set again
+	if (expected.empty()) {
+		return false;
+	}
+
+	unsigned char diff = expected.size() != token.size();
+	for (size_t i = 0; i < expected.size(); ++i) {
+		diff |= expected[i] ^ (i < token.size() ? token[i] : 0);
+	}
+	return diff == 0;
+}
+
+GitlabWebhook::GitlabWebhook(const Config *cfg, ConfigStore *config_store, IRCThread *irc_thread) :
+		m_cfg(cfg), m_config_store(config_store), m_irc_thread(irc_thread)
+{
+	for (const auto &server_config: cfg->get_irc_server_configs()) {
+		for (const auto &channel: server_config->channels) {
+			const IRCChannelConfig *channel_config = channel.second;
+			if (channel_config->gitlab_project_name.empty() ||
+					channel_config->gitlab_project_namespace.empty()) {
+				continue;
+			}
+
+			Route route;
+			route.server = server_config;
+			route.channel = channel.first;
+			m_routes[get_project_key(channel_config->gitlab_project_namespace + "/" +
+					channel_config->gitlab_project_name)].push_back(route);
+		}
+	}
+
+	m_received_metric = Metrics::register_counter("bot_gitlab_webhooks_total", "",
+			"GitLab webhooks accepted");
+	m_rejected_metric = Metrics::register_counter("bot_gitlab_webhooks_rejected_total", "",
+			"GitLab webhooks refused for a bad token or a full queue");
+	m_announced_metric = Metrics::register_counter("bot_gitlab_announcements_total", "",
+			"Coalesced GitLab activity lines sent to channels");
+	m_dropped_metric = Metrics::register_counter("bot_gitlab_announcements_dropped_total", "",
+			"GitLab activity lines dropped because their network was not connected");
+	Metrics::register_callback("bot_gitlab_webhook_queue_depth", "", "GitLab webhooks waiting for a worker",
+			"gauge", [this] { return (double) get_queue_depth(); });
+}
+
+GitlabWebhook::~GitlabWebhook()
+{
+	stop();
+}
+
+void GitlabWebhook::start()
+{
+	std::unique_lock<std::mutex> lock(m_queue_mutex);
+	if (m_running) {
+		return;
+	}
+
+	m_running = true;
+
+	uint16_t pool_size = m_cfg->get_gitlab_webhook_workers();
+	if (pool_size == 0) {
+		pool_size = 1;
+	}
+
+	for (uint16_t i = 0; i < pool_size; ++i) {
+		m_workers.emplace_back([this] { worker_loop(); });
+	}
+	m_flusher = std::thread([this] { flusher_loop(); });
+
+	LOG_INFO("gitlab", "GitLab webhooks accepted on " << m_cfg->get_gitlab_webhook_path() << " for "
+			<< m_routes.size() << " projects");
+}
+
+void GitlabWebhook::stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_queue_mutex);
+		if (!m_running) {
+			return;
+		}
+		m_running = false;
+	}
+
+	m_queue_cv.notify_all();
+	for (auto &worker: m_workers) {
+		if (worker.joinable()) {
+			worker.join();
+		}
+	}
+	m_workers.clear();
+	m_queue.clear();
+
+	// The flusher announces what is still pending before leaving
+	{
+		std::unique_lock<std::mutex> lock(m_activity_mutex);
+	}
+	m_activity_cv.notify_all();
+	if (m_flusher.joinable()) {
+		m_flusher.join();
+	}
+}
+
+void GitlabWebhook::handle_request(const HttpRequest &request, HttpResponse &response)
+{
+	auto token = request.headers.find("x-gitlab-token");
+	if (token == request.headers.end() ||
+			!is_token_valid(m_config_store->acquire()->get_gitlab_webhook_token(), token->second)) {
+		Metrics::increment(m_rejected_metric);
+		response.status = 401;
+		return;
+	}
+
+	auto kind = request.headers.find("x-gitlab-event");
+	Event event;
+	event.kind = kind != request.headers.end() ? kind->second : "";
+	event.body = request.body;
+
+	{
+		std::unique_lock<std::mutex> lock(m_queue_mutex);
+		if (!m_running || m_queue.size() >= m_cfg->get_gitlab_webhook_max_queue_size()) {
+			Metrics::increment(m_rejected_metric);
+			response.status = 503;
+			return;
+		}
+
+		m_queue.push_back(std::move(event));
+	}
+
+	m_queue_cv.notify_one();
+	Metrics::increment(m_received_metric);
+	response.status = 202;
+}
+
+size_t GitlabWebhook::get_queue_depth() const
+{
+	std::unique_lock<std::mutex> lock(m_queue_mutex);
+	return m_queue.size();
+}
+
+void GitlabWebhook::worker_loop()
+{
+	while (true) {
+		Event event;
+		{
+			std::unique_lock<std::mutex> lock(m_queue_mutex);
+			m_queue_cv.wait(lock, [this] { return !m_running || !m_queue.empty(); });
+			if (!m_running) {
+				return;
+			}
+
+			event = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		handle_event(event);
+	}
+}
+
+void GitlabWebhook::handle_event(const Event &event)
+{
+	Json::Value payload;
+	Json::Reader reader;
+	if (!reader.parse(event.body, payload) || !payload.isObject()) {
+		LOG_ERROR("gitlab", "Invalid GitLab webhook payload for " << event.kind);
+		return;
+	}
+
+	const std::string project = payload["project"]["path_with_namespace"].asString();
+	const std::string key = get_project_key(project);
+	if (m_routes.find(key) == m_routes.end()) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(m_activity_mutex);
+	auto it = m_activity.find(key);
+	if (it == m_activity.end()) {
+		it = m_activity.emplace(key, ProjectActivity()).first;
+		it->second.project = project;
+		it->second.flush_at = std::chrono::steady_clock::now() +
+				std::chrono::seconds(m_config_store->acquire()->get_gitlab_webhook_window());
+	}
+
+	ProjectActivity &activity = it->second;
+	if (event.kind == "Push Hook" || event.kind == "Tag Push Hook") {
+		record_push(activity, payload);
+	} else if (event.kind == "Issue Hook") {
+		record_issue(activity, payload);
+	} else if (event.kind == "Merge Request Hook") {
+		record_merge_request(activity, payload);
+	} else if (event.kind == "Pipeline Hook") {
+		record_pipeline(activity, payload);
+	}
+
+	lock.unlock();
+	m_activity_cv.notify_one();
+}
+
+void GitlabWebhook::record_push(ProjectActivity &activity, const Json::Value &payload)
+{
+	const std::string ref = payload["ref"].asString();
+	const std::string user = payload["user_name"].asString();
+
+	if (ref.compare(0, 10, "refs/tags/") == 0) {
+		if (payload["after"].asString().find_first_not_of('0') != std::string::npos) {
+			activity.tags.push_back(user + " tagged " + strip_ref(ref));
+		}
+		return;
+	}
+
+	const Json::Value &commits = payload["commits"];
+	BranchPush &push = activity.pushes[strip_ref(ref)];
+	push.commits += payload["total_commits_count"].asUInt64();
+	push.pushers.insert(user);
+
+	// The checkout sha is the branch head, the list may be truncated by GitLab
+	const std::string head = payload["checkout_sha"].asString();
+	for (const auto &commit: commits) {
+		if (commit["id"].asString() == head || push.last_commit.empty()) {
+			push.last_commit = shorten(commit["title"].isString() ? commit["title"].asString() :
+					commit["message"].asString());
+		}
+	}
+}
+
+void GitlabWebhook::record_issue(ProjectActivity &activity, const Json::Value &payload)
+{
+	const Json::Value &attributes = payload["object_attributes"];
+	const std::string action = attributes["action"].asString();
+	if (action != "open" && action != "close" && action != "reopen") {
+		return;
+	}
+
+	activity.issues.push_back("#" + attributes["iid"].asString() + " " + get_past_tense(action) + " by " +
+			payload["user"]["name"].asString() + " \"" + shorten(attributes["title"].asString()) + "\"");
+}
+
+void GitlabWebhook::record_merge_request(ProjectActivity &activity, const Json::Value &payload)
+{
+	const Json::Value &attributes = payload["object_attributes"];
+	const std::string action = attributes["action"].asString();
+	if (action != "open" && action != "close" && action != "reopen" && action != "merge") {
+		return;
+	}
+
+	activity.merge_requests.push_back("!" + attributes["iid"].asString() + " " +
+			get_past_tense(action) + " by " + payload["user"]["name"].asString() +
+			" \"" + shorten(attributes["title"].asString()) + "\"");
+}
+
+void GitlabWebhook::record_pipeline(ProjectActivity &activity, const Json::Value &payload)
+{
+	const Json::Value &attributes = payload["object_attributes"];
+	const std::string status = attributes["status"].asString();
+
+	// Only finished pipelines are worth a line
+	if (status != "success" && status != "failed" && status != "canceled") {
+		return;
+	}
+
+	activity.pipelines.push_back("#" + attributes["id"].asString() + " " + status + " on " +
+			strip_ref(attributes["ref"].asString()));
+}
+
+void GitlabWebhook::flusher_loop()
+{
+	std::unique_lock<std::mutex> lock(m_activity_mutex);
+	while (true) {
+		bool running;
+		{
+			std::unique_lock<std::mutex> queue_lock(m_queue_mutex);
+			running = m_running;
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		auto next_flush = now + std::chrono::seconds(1);
+		std::vector<ProjectActivity> ready;
+		for (auto it = m_activity.begin(); it != m_activity.end();) {
+			if (!running || it->second.flush_at <= now) {
+				ready.push_back(std::move(it->second));
+				it = m_activity.erase(it);
+			} else {
+				next_flush = std::min(next_flush, it->second.flush_at);
+				++it;
+			}
+		}
+
+		if (!ready.empty()) {
+			lock.unlock();
+			for (const auto &activity: ready) {
+				announce(activity);
+			}
+			lock.lock();
+		}
+
+		if (!running) {
+			return;
+		}
+
+		m_activity_cv.wait_until(lock, next_flush);
+	}
+}
+
+void GitlabWebhook::announce(const ProjectActivity &activity)
+{
+	const std::string msg = format(activity);
+	if (msg.empty()) {
+		return;
+	}
+
+	auto routes = m_routes.find(get_project_key(activity.project));
+	if (routes == m_routes.end()) {
+		return;
+	}
+
+	for (const auto &route: routes->second) {
+		IRCConnection *connection = m_irc_thread ? m_irc_thread->get_connection(route.server) : nullptr;
+		if (!connection) {
+			LOG_INFO("gitlab", "Not connected to " << route.server->network << ", dropping announce to "
+					<< route.channel << ": " << msg);
+			Metrics::increment(m_dropped_metric);
+			continue;
+		}
+
+		m_irc_thread->add_text(connection, route.channel, msg);
+		Metrics::increment(m_announced_metric);
+	}
+}
+
+std::string GitlabWebhook::format(const ProjectActivity &activity)
+{
+	std::vector<std::string> parts;
+
+	std::vector<std::string> pushes;
+	for (const auto &push: activity.pushes) {
+		if (push.second.commits == 0) {
+			continue;
+		}
+
+		std::vector<std::string> pushers(push.second.pushers.begin(), push.second.pushers.end());
+		std::string line = join(pushers, ", ") + " pushed " + std::to_string(push.second.commits) +
+				(push.second.commits > 1 ? " commits" : " commit") + " to " + push.first;
+		if (!push.second.last_commit.empty()) {
+			line += " (" + push.second.last_commit + ")";
+		}
+		pushes.push_back(line);
+	}
+
+	if (!pushes.empty()) {
+		parts.push_back(join(pushes, ", "));
+	}
+	if (!activity.tags.empty()) {
+		parts.push_back(join(activity.tags, ", "));
+	}
+	if (!activity.issues.empty()) {
+		parts.push_back("issues: " + join(activity.issues, ", "));
+	}
+	if (!activity.merge_requests.empty()) {
+		parts.push_back("merge requests: " + join(activity.merge_requests, ", "));
+	}
+	if (!activity.pipelines.empty()) {
+		parts.push_back("pipelines: " + join(activity.pipelines, ", "));
+	}
+
+	if (parts.empty()) {
+		return "";
+	}
+
+	std::string msg = "[" + activity.project + "] ";
+	for (size_t i = 0; i < parts.size(); ++i) {
+		msg += (i ? " | " : "") + parts[i];
+	}
+	return msg;
+}
+
+std::string GitlabWebhook::get_project_key(const std::string &project)
+{
+	std::string key = project;
+	std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+	return key;
+}
@@ -0,0 +1,133 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <json/json.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "HttpServer.h"
+#include "Metrics.h"
+
+class Config;
+class ConfigStore;
+class IRCThread;
+struct IRCServerConfig;
+
+/**
+ * Announces GitLab webhook events in the channels following the project.
+ *
+ * The httpd thread only checks the token and queues the payload, a small
+ * worker pool parses it. Activity is accumulated per project and flushed
+ * as a single line once the webhook window elapses, so a large push or a
+ * burst of pipelines doesn't flood the channels.
+ *
+ * The token and the window follow configuration reloads, routes and the
+ * worker pool are set up at startup.
+ */
+class GitlabWebhook
+{
+public:
+	GitlabWebhook(const Config *cfg, ConfigStore *config_store, IRCThread *irc_thread);
+	~GitlabWebhook();
+
+	void start();
+	void stop();
+
+	void handle_request(const HttpRequest &request, HttpResponse &response);
+	size_t get_queue_depth() const;
+
+private:
+	struct Event
+	{
+		std::string kind = "";
+		std::string body = "";
+	};
+
+	struct BranchPush
+	{
+		uint64_t commits = 0;
+		std::set<std::string> pushers = {};
+		std::string last_commit = "";
+	};
+
+	struct ProjectActivity
+	{
+		std::string project = "";
+		std::chrono::steady_clock::time_point flush_at = {};
+		std::map<std::string, BranchPush> pushes = {};
+		std::vector<std::string> tags = {};
+		std::vector<std::string> issues = {};
+		std::vector<std::string> merge_requests = {};
+		std::vector<std::string> pipelines = {};
+	};
+
+	struct Route
+	{
+		const IRCServerConfig *server = nullptr;
+		std::string channel = "";
+	};
+
+	void worker_loop();
+	void flusher_loop();
+	void handle_event(const Event &event);
+	void record_push(ProjectActivity &activity, const Json::Value &payload);
+	void record_issue(ProjectActivity &activity, const Json::Value &payload);
+	void record_merge_request(ProjectActivity &activity, const Json::Value &payload);
+	void record_pipeline(ProjectActivity &activity, const Json::Value &payload);
+	void announce(const ProjectActivity &activity);
+
+	static std::string format(const ProjectActivity &activity);
+	static std::string get_project_key(const std::string &project);
+
+	const Config *m_cfg = nullptr;
+	ConfigStore *m_config_store = nullptr;
+	IRCThread *m_irc_thread = nullptr;
+	// Channels following each project, by lower case namespace/name
+	std::unordered_map<std::string, std::vector<Route>> m_routes = {};
+
+	std::vector<std::thread> m_workers = {};
+	std::deque<Event> m_queue = {};
+	mutable std::mutex m_queue_mutex;
+	std::condition_variable m_queue_cv;
+	bool m_running = false;
+
+	std::thread m_flusher;
+	std::mutex m_activity_mutex;
+	std::condition_variable m_activity_cv;
+	std::unordered_map<std::string, ProjectActivity> m_activity = {};
+
+	MetricId m_received_metric = METRIC_INVALID_ID;
+	MetricId m_rejected_metric = METRIC_INVALID_ID;
+	MetricId m_announced_metric = METRIC_INVALID_ID;
+	MetricId m_dropped_metric = METRIC_INVALID_ID;
+};
@@ -24,47 +24,626 @@
  */
 
 #include "HttpClient.h"
-#include <curlpp/cURLpp.hpp>
-#include <curlpp/Options.hpp>
-#include <sstream>
-#include <json/json.h>
-/*
-HttpClient::HttpClient(IRCThread *irc_thread) : m_irc_thread(irc_thread)
-{}
- */
+#include "Config.h"
+#include "Log.h"
+#include <algorithm>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+
+// Idle connections kept open by the multi handle
+#define HTTP_MAX_CACHED_CONNECTIONS 16
+#define HTTP_DNS_CACHE_TIMEOUT 300L
+// Body buffers kept for reuse, matches the connection cache
+#define HTTP_MAX_CACHED_BUFFERS HTTP_MAX_CACHED_CONNECTIONS
+#define HTTP_BUFFER_INITIAL_SIZE 16384
+// Latencies kept per host to pick the hedging delay, and how many are needed first
+#define HTTP_HEDGE_LATENCY_SAMPLES 64
+#define HTTP_HEDGE_MIN_SAMPLES 20
+
+static std::once_flag s_curl_global_init;
 
-bool HttpClient::get_json(Json::Value &json_value, const std::string &url)
+HttpClient::HttpClient(const Config *cfg) : m_running(false),
+		m_max_response_size(cfg->get_max_http_response_size()),
+		m_timeout(cfg->get_http_timeout()),
+		m_hedging_enabled(cfg->is_http_hedging_enabled()),
+		m_hedge_min_delay(cfg->get_http_hedge_min_delay()), m_requests(0), m_failures(0),
+		m_new_connections(0), m_reused_connections(0), m_total_time_us(0)
 {
-	curl_global_init(CURL_GLOBAL_ALL);
-	m_curl = curl_easy_init();
+	// curl_global_init is not thread safe and must only run once per process
+	std::call_once(s_curl_global_init, [] {
+		curl_global_init(CURL_GLOBAL_ALL);
+		std::atexit(curl_global_cleanup);
+	});
 
-	curl_easy_setopt(m_curl, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(m_curl, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, curl_writer);
-	curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, &m_data);
+	m_multi = curl_multi_init();
+	curl_multi_setopt(m_multi, CURLMOPT_MAXCONNECTS, (long) HTTP_MAX_CACHED_CONNECTIONS);
 
-	bool success = curl_easy_perform(m_curl);
-	if (success) {
-		std::cerr << "curl error" << std::endl;
+	m_share = curl_share_init();
+	curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+	curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+	m_too_large_metric = Metrics::register_counter("bot_http_response_too_large_total", "",
+			"Upstream HTTP responses aborted for exceeding http.max_response_size");
+	m_timeout_metric = Metrics::register_counter("bot_http_timeouts_total", "",
+			"Upstream HTTP requests aborted at their deadline");
+	m_hedged_metric = Metrics::register_counter("bot_http_hedged_requests_total", "",
+			"Upstream HTTP requests sent a second time after the p95 latency of their host");
+	m_hedge_wins_metric = Metrics::register_counter("bot_http_hedge_wins_total", "",
+			"Hedged HTTP requests answered by the second copy first");
+}
+
+HttpClient::~HttpClient()
+{
+	stop();
+
+	for (CURL *curl: m_idle_handles) {
+		curl_easy_cleanup(curl);
+	}
+	m_idle_handles.clear();
+
+	for (std::string *buffer: m_idle_buffers) {
+		delete buffer;
+	}
+	m_idle_buffers.clear();
+
+	curl_multi_cleanup(m_multi);
+	curl_share_cleanup(m_share);
+}
+
+void HttpClient::start()
+{
+	if (m_running.exchange(true)) {
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(m_pending_mutex);
+		m_accepting = true;
+	}
+	m_thread = std::thread([this] { run(); });
+}
+
+void HttpClient::stop()
+{
+	if (!m_running.exchange(false)) {
+		return;
+	}
+
+	curl_multi_wakeup(m_multi);
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+void HttpClient::get_json_async(const std::string &url, const HttpJsonCallback &callback,
+		const HttpDeadline &deadline)
+{
+	if (!m_running) {
+		callback(false, Json::Value());
+		return;
+	}
+
+	Request *request = new Request();
+	request->url = url;
+	request->callback = callback;
+	queue_request(request, deadline);
+}
+
+void HttpClient::get_fields_async(const std::string &url, const JsonFieldSet &field_set,
+		const HttpFieldsCallback &callback, const HttpDeadline &deadline)
+{
+	if (!m_running) {
+		callback(false, 0, JsonFields());
+		return;
 	}
 
-	curl_easy_cleanup(m_curl);
-	curl_global_cleanup();
+	Request *request = new Request();
+	request->url = url;
+	request->field_set = &field_set;
+	request->fields_callback = callback;
+	queue_request(request, deadline);
+}
+
+void HttpClient::call_later(const std::chrono::milliseconds &delay, const std::function<void()> &callback)
+{
+	if (!m_running) {
+		callback();
+		return;
+	}
+
+	Timer timer;
+	timer.due = std::chrono::steady_clock::now() + delay;
+	timer.callback = callback;
+	bool queued = false;
+	{
+		std::unique_lock<std::mutex> lock(m_pending_mutex);
+		if (m_accepting) {
+			m_pending_timers.push_back(std::move(timer));
+			queued = true;
+		}
+	}
+
+	// The loop already drained its queue for the last time
+	if (!queued) {
+		callback();
+		return;
+	}
+
+	curl_multi_wakeup(m_multi);
+}
+
+void HttpClient::queue_request(Request *request, const HttpDeadline &deadline)
+{
+	// Time spent in the queue counts against the deadline
+	request->deadline = deadline == HttpDeadline() ?
+			std::chrono::steady_clock::now() + m_timeout : deadline;
+	bool queued = false;
+	{
+		std::unique_lock<std::mutex> lock(m_pending_mutex);
+		if (m_accepting) {
+			m_pending_requests.push_back(request);
+			queued = true;
+		}
+	}
 
-	Json::Reader *reader = new Json::Reader();
-	if (!reader->parse(m_data, json_value)) {
-		std::cerr << "Error parse" << std::endl;
+	// The loop already drained its queue for the last time. The request holds
+	// no handle nor buffer yet, completing it here touches no loop state
+	if (!queued) {
+		complete_request(request, false);
+		return;
+	}
+
+	curl_multi_wakeup(m_multi);
+}
+
+bool HttpClient::get_json(Json::Value &json_value, const std::string &url, const HttpDeadline &deadline)
+{
+	std::promise<bool> result;
+	std::future<bool> future = result.get_future();
+
+	get_json_async(url, [&result, &json_value] (bool success, const Json::Value &value) {
+		json_value = value;
+		result.set_value(success);
+	}, deadline);
+
+	return future.get();
+}
+
+bool HttpClient::get_fields(JsonFields &fields, const std::string &url, const JsonFieldSet &field_set,
+		const HttpDeadline &deadline)
+{
+	std::promise<bool> result;
+	std::future<bool> future = result.get_future();
+
+	get_fields_async(url, field_set, [&result, &fields] (bool success, long, const JsonFields &values) {
+		fields = values;
+		result.set_value(success);
+	}, deadline);
+
+	return future.get();
+}
+
+void HttpClient::run()
+{
+	int running_handles = 0;
+	while (m_running) {
+		add_pending_requests();
+
+		CURLMcode rc = curl_multi_perform(m_multi, &running_handles);
+		if (rc != CURLM_OK) {
+			LOG_ERROR("http", "curl multi error: " << curl_multi_strerror(rc));
+		}
+
+		read_completed_requests();
+		const int timeout_ms = run_due_timers(false);
+
+		// Sleep until a socket is ready, curl needs a timeout, a timer is
+		// due or get_json_async wakes us up
+		curl_multi_poll(m_multi, nullptr, 0, timeout_ms, nullptr);
+	}
+
+	// Fail everything still queued or in flight so waiters are released,
+	// requests queued from now on are failed by queue_request itself
+	{
+		std::unique_lock<std::mutex> lock(m_pending_mutex);
+		m_accepting = false;
+	}
+	add_pending_requests();
+	read_completed_requests();
+	run_due_timers(true);
+
+	std::vector<Request *> in_flight = {};
+	std::swap(in_flight, m_in_flight_requests);
+	for (Request *request: in_flight) {
+		complete_request(request, false);
+	}
+}
+
+void HttpClient::add_pending_requests()
+{
+	std::vector<Request *> requests = {};
+	std::vector<Timer> timers = {};
+	{
+		std::unique_lock<std::mutex> lock(m_pending_mutex);
+		std::swap(requests, m_pending_requests);
+		std::swap(timers, m_pending_timers);
+	}
+
+	for (Timer &timer: timers) {
+		m_timers.push_back(std::move(timer));
+		std::push_heap(m_timers.begin(), m_timers.end());
+	}
+
+	for (Request *request: requests) {
+		// A request which failed to start is already completed and freed
+		if (start_request(request) && m_hedging_enabled) {
+			schedule_hedge(request);
+		}
+	}
+}
+
+bool HttpClient::start_request(Request *request)
+{
+	const auto now = std::chrono::steady_clock::now();
+	if (request->deadline <= now) {
+		Metrics::increment(m_timeout_metric);
+		complete_request(request, false);
 		return false;
 	}
 
-	running = false;
+	request->curl = acquire_handle();
+	if (!request->curl) {
+		complete_request(request, false);
+		return false;
+	}
+
+	request->id = ++m_next_request_id;
+	request->data = acquire_buffer();
+	request->max_size = m_max_response_size;
 
+	// curl aborts the transfer itself once the deadline is reached
+	const long timeout_ms = (long) std::chrono::duration_cast<std::chrono::milliseconds>(
+			request->deadline - now).count();
+	curl_easy_setopt(request->curl, CURLOPT_URL, request->url.c_str());
+	curl_easy_setopt(request->curl, CURLOPT_TIMEOUT_MS, std::max(timeout_ms, 1L));
+	curl_easy_setopt(request->curl, CURLOPT_WRITEFUNCTION, curl_writer);
+	curl_easy_setopt(request->curl, CURLOPT_WRITEDATA, request);
+	// Rejects upfront when the server announces a Content-Length above the cap,
+	// curl_writer covers chunked and unannounced bodies
+	curl_easy_setopt(request->curl, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) m_max_response_size);
+	curl_easy_setopt(request->curl, CURLOPT_PRIVATE, request);
+
+	curl_multi_add_handle(m_multi, request->curl);
+	m_in_flight_requests.push_back(request);
 	return true;
 }
 
-size_t HttpClient::curl_writer(char *data, size_t size, size_t nmemb, void *read_buffer)
+void HttpClient::schedule_hedge(Request *request)
+{
+	const HostStats &host_stats = get_host_stats(request->url);
+	if (host_stats.latencies.size() < HTTP_HEDGE_MIN_SAMPLES) {
+		return;
+	}
+
+	std::vector<uint32_t> latencies = host_stats.latencies;
+	const size_t p95 = latencies.size() * 95 / 100;
+	std::nth_element(latencies.begin(), latencies.begin() + p95, latencies.end());
+	const std::chrono::milliseconds delay = std::max(m_hedge_min_delay,
+			std::chrono::milliseconds(latencies[p95] / 1000));
+
+	Timer timer;
+	timer.due = std::chrono::steady_clock::now() + delay;
+	if (timer.due >= request->deadline) {
+		return;
+	}
+
+	const uint64_t id = request->id;
+	timer.callback = [this, request, id] { hedge_request(request, id); };
+	m_timers.push_back(std::move(timer));
+	std::push_heap(m_timers.begin(), m_timers.end());
+}
+
+void HttpClient::hedge_request(Request *request, const uint64_t id)
+{
+	// The request may have completed and its memory reused meanwhile
+	if (!m_running || std::find(m_in_flight_requests.begin(), m_in_flight_requests.end(), request) ==
+			m_in_flight_requests.end() || request->id != id || request->twin) {
+		return;
+	}
+
+	Request *hedge = new Request();
+	hedge->url = request->url;
+	hedge->callback = request->callback;
+	hedge->field_set = request->field_set;
+	hedge->fields_callback = request->fields_callback;
+	hedge->deadline = request->deadline;
+	hedge->is_hedge = true;
+	hedge->twin = request;
+	request->twin = hedge;
+
+	Metrics::increment(m_hedged_metric);
+	start_request(hedge);
+}
+
+void HttpClient::cancel_request(Request *request)
+{
+	// Removing the handle aborts the transfer
+	if (request->curl) {
+		curl_multi_remove_handle(m_multi, request->curl);
+		release_handle(request->curl);
+	}
+
+	if (request->data) {
+		release_buffer(request->data);
+	}
+
+	delete request;
+}
+
+int HttpClient::run_due_timers(bool all)
+{
+	while (!m_timers.empty()) {
+		const auto now = std::chrono::steady_clock::now();
+		if (!all && m_timers.front().due > now) {
+			// Time left before the next timer, capped to the idle poll timeout
+			return (int) std::min<int64_t>(1000, std::chrono::duration_cast<std::chrono::milliseconds>(
+					m_timers.front().due - now).count() + 1);
+		}
+
+		std::pop_heap(m_timers.begin(), m_timers.end());
+		Timer timer = std::move(m_timers.back());
+		m_timers.pop_back();
+		timer.callback();
+	}
+
+	return 1000;
+}
+
+void HttpClient::read_completed_requests()
+{
+	CURLMsg *msg = nullptr;
+	int msgs_left = 0;
+	while ((msg = curl_multi_info_read(m_multi, &msgs_left))) {
+		if (msg->msg != CURLMSG_DONE) {
+			continue;
+		}
+
+		Request *request = nullptr;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &request);
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &request->status);
+		bool success = msg->data.result == CURLE_OK && request->status >= 200 && request->status < 300;
+		if (msg->data.result == CURLE_OK && !success) {
+			LOG_WARN("http", "Request to " << request->url << " answered with status " << request->status);
+		} else if (msg->data.result == CURLE_OPERATION_TIMEDOUT) {
+			LOG_WARN("http", "Request to " << request->url << " reached its deadline");
+			Metrics::increment(m_timeout_metric);
+		} else if (request->too_large || msg->data.result == CURLE_FILESIZE_EXCEEDED) {
+			LOG_ERROR("http", "Response from " << request->url << " too large, limit is "
+					<< m_max_response_size << " bytes");
+			Metrics::increment(m_too_large_metric);
+		} else if (!success) {
+			LOG_ERROR("http", "curl error on " << request->url << ": "
+					<< curl_easy_strerror(msg->data.result));
+		}
+
+		update_stats(msg->easy_handle, request->url, success);
+
+		m_in_flight_requests.erase(std::find(m_in_flight_requests.begin(),
+				m_in_flight_requests.end(), request));
+		complete_request(request, success);
+	}
+}
+
+void HttpClient::complete_request(Request *request, bool success)
 {
+	if (request->twin) {
+		Request *twin = request->twin;
+		twin->twin = nullptr;
+		request->twin = nullptr;
+		if (!success) {
+			// The other copy may still succeed, it answers alone now
+			cancel_request(request);
+			return;
+		}
+
+		// First answer wins, the other transfer is aborted
+		m_in_flight_requests.erase(std::find(m_in_flight_requests.begin(),
+				m_in_flight_requests.end(), twin));
+		cancel_request(twin);
+		if (request->is_hedge) {
+			Metrics::increment(m_hedge_wins_metric);
+		}
+	}
+
+	if (request->curl) {
+		curl_multi_remove_handle(m_multi, request->curl);
+		release_handle(request->curl);
+	}
+
+	if (request->field_set) {
+		JsonFields fields;
+		if (success && !request->field_set->extract(*request->data, fields)) {
+			LOG_ERROR("http", "Unable to parse the answer from " << request->url);
+			success = false;
+		}
+
+		if (request->data) {
+			release_buffer(request->data);
+			request->data = nullptr;
+		}
+
+		request->fields_callback(success, request->status, fields);
+		delete request;
+		return;
+	}
+
+	Json::Value json_value;
+	if (success) {
+		Json::Reader reader;
+		if (!reader.parse(*request->data, json_value)) {
+			LOG_ERROR("http", "Unable to parse the answer from " << request->url);
+			success = false;
+		}
+	}
+
+	if (request->data) {
+		release_buffer(request->data);
+		request->data = nullptr;
+	}
+
+	request->callback(success, json_value);
+	delete request;
+}
+
+HttpClient::HostStats &HttpClient::get_host_stats(const std::string &url)
+{
+	size_t host_start = url.find("://");
+	host_start = host_start == std::string::npos ? 0 : host_start + 3;
+	const size_t host_end = url.find_first_of(":/?", host_start);
+	const std::string host = url.substr(host_start, host_end == std::string::npos ?
+			std::string::npos : host_end - host_start);
+
+	auto it = m_host_stats.find(host);
+	if (it == m_host_stats.end()) {
+		const std::string labels = "host=\"" + host + "\"";
+		HostStats host_stats;
+		host_stats.duration_metric = Metrics::register_histogram("bot_http_request_duration_seconds",
+				labels, "Upstream HTTP request latency");
+		host_stats.failure_metric = Metrics::register_counter("bot_http_request_failures_total",
+				labels, "Upstream HTTP requests which failed");
+		it = m_host_stats.emplace(host, std::move(host_stats)).first;
+	}
+	return it->second;
+}
+
+void HttpClient::update_stats(CURL *curl, const std::string &url, bool success)
+{
+	HostStats &host_stats = get_host_stats(url);
+
+	m_requests++;
+	if (!success) {
+		m_failures++;
+		Metrics::increment(host_stats.failure_metric);
+		return;
+	}
+
+	// curl reports 0 new connections when the transfer reused a cached one
+	long num_connects = 0;
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &num_connects);
+	if (num_connects == 0) {
+		m_reused_connections++;
+	} else {
+		m_new_connections += num_connects;
+	}
+
+	double total_time = 0;
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total_time);
+	const uint32_t total_time_us = (uint32_t) (total_time * 1000000);
+	m_total_time_us += total_time_us;
+	Metrics::observe(host_stats.duration_metric, std::chrono::microseconds(total_time_us));
+
+	if (host_stats.latencies.size() < HTTP_HEDGE_LATENCY_SAMPLES) {
+		host_stats.latencies.push_back(total_time_us);
+	} else {
+		host_stats.latencies[host_stats.next_latency] = total_time_us;
+		host_stats.next_latency = (host_stats.next_latency + 1) % HTTP_HEDGE_LATENCY_SAMPLES;
+	}
+}
+
+HttpClientStats HttpClient::get_stats() const
+{
+	HttpClientStats stats;
+	stats.requests = m_requests;
+	stats.failures = m_failures;
+	stats.new_connections = m_new_connections;
+	stats.reused_connections = m_reused_connections;
+	stats.total_time_us = m_total_time_us;
+	return stats;
+}
+
+CURL *HttpClient::acquire_handle()
+{
+	CURL *curl = nullptr;
+	if (!m_idle_handles.empty()) {
+		curl = m_idle_handles.back();
+		m_idle_handles.pop_back();
+	} else {
+		curl = curl_easy_init();
+		if (!curl) {
+			return nullptr;
+		}
+	}
+
+	// Options are reset on release, apply the common ones again
+	curl_easy_setopt(curl, CURLOPT_SHARE, m_share);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 60L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 30L);
+	curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, HTTP_DNS_CACHE_TIMEOUT);
+	return curl;
+}
+
+void HttpClient::release_handle(CURL *curl)
+{
+	// curl_easy_reset keeps live connections and caches attached to the handle
+	curl_easy_reset(curl);
+	m_idle_handles.push_back(curl);
+}
+
+std::string *HttpClient::acquire_buffer()
+{
+	if (!m_idle_buffers.empty()) {
+		std::string *buffer = m_idle_buffers.back();
+		m_idle_buffers.pop_back();
+		return buffer;
+	}
+
+	std::string *buffer = new std::string();
+	buffer->reserve(std::min<size_t>(HTTP_BUFFER_INITIAL_SIZE, m_max_response_size));
+	return buffer;
+}
+
+void HttpClient::release_buffer(std::string *buffer)
+{
+	if (m_idle_buffers.size() >= HTTP_MAX_CACHED_BUFFERS) {
+		delete buffer;
+		return;
+	}
+
+	// clear() keeps the capacity, which is bounded by the response cap
+	buffer->clear();
+	m_idle_buffers.push_back(buffer);
+}
+
+void HttpClient::share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *user_data)
+{
+	((HttpClient *) user_data)->m_share_mutexes[data].lock();
+}
+
+void HttpClient::share_unlock(CURL *curl, curl_lock_data data, void *user_data)
+{
+	((HttpClient *) user_data)->m_share_mutexes[data].unlock();
+}
+
+size_t HttpClient::curl_writer(char *data, size_t size, size_t nmemb, void *user_data)
+{
+	Request *request = (Request *) user_data;
 	size_t realsize = size * nmemb;
-	((std::string *) read_buffer)->append((const char *) data, realsize);
+
+	// Returning less than realsize aborts the transfer with CURLE_WRITE_ERROR
+	if (request->data->size() + realsize > request->max_size) {
+		request->too_large = true;
+		return 0;
+	}
+
+	request->data->append((const char *) data, realsize);
 	return realsize;
-}
\ No newline at end of file
+}
@@ -26,24 +26,173 @@
 #pragma once
 #include <json/json.h>
 #include <curl/curl.h>
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "JsonFields.h"
+#include "Metrics.h"
 
-class IRCThread;
+class Config;
 
-typedef std::function<void(int)> FunctionCallback;
+typedef std::function<void(bool success, const Json::Value &json_value)> HttpJsonCallback;
+// status is the HTTP status of the answer, 0 when none was received
+typedef std::function<void(bool success, long status, const JsonFields &fields)> HttpFieldsCallback;
+// Point past which a request is aborted, the default value means http.timeout from now
+typedef std::chrono::steady_clock::time_point HttpDeadline;
 
+struct HttpClientStats
+{
+	uint64_t requests = 0;
+	uint64_t failures = 0;
+	uint64_t new_connections = 0;
+	uint64_t reused_connections = 0;
+	uint64_t total_time_us = 0;
+};
+
+/**
+ * HTTP client driven by a single curl multi loop.
+ *
+ * Requests are queued from any thread and performed concurrently by the loop
+ * thread, which invokes the completion callback as soon as the transfer ends.
+ * Callbacks run on the loop thread and must not block.
+ *
+ * Easy handles are pooled and DNS, TLS sessions and connections are shared
+ * through a curl share handle, so repeated calls to the same API host skip
+ * the lookup and handshakes.
+ *
+ * get_fields_async only extracts the given paths from the answer, without
+ * building a jsoncpp DOM. Requests answered with a non-2xx status fail.
+ *
+ * Response bodies are capped at http.max_response_size: the transfer is
+ * aborted as soon as the cap is crossed. Body buffers are pooled and keep
+ * their capacity between requests.
+ *
+ * Each request has a deadline, after which curl aborts the transfer and the
+ * request fails. When http.hedge_requests is set, a request still running
+ * after the p95 latency of its host is sent a second time and the first
+ * answer wins, the other transfer is aborted. Every request is an
+ * idempotent GET, so they can all be hedged.
+ *
+ * The loop also runs timers (call_later), so asynchronous commands can wait
+ * without holding a thread. Timers still pending on stop() fire right away.
+ */
 class HttpClient {
 public:
-	//HttpClient(IRCThread *irc_thread);
-	HttpClient() {};
-	bool get_json(Json::Value &json_value, const std::string &url);
-	bool is_running() const { return running; };
+	HttpClient(const Config *cfg);
+	~HttpClient();
+
+	void start();
+	void stop();
+
+	void get_json_async(const std::string &url, const HttpJsonCallback &callback,
+			const HttpDeadline &deadline = HttpDeadline());
+	bool get_json(Json::Value &json_value, const std::string &url,
+			const HttpDeadline &deadline = HttpDeadline());
+	void get_fields_async(const std::string &url, const JsonFieldSet &field_set,
+			const HttpFieldsCallback &callback, const HttpDeadline &deadline = HttpDeadline());
+	bool get_fields(JsonFields &fields, const std::string &url, const JsonFieldSet &field_set,
+			const HttpDeadline &deadline = HttpDeadline());
+	void call_later(const std::chrono::milliseconds &delay, const std::function<void()> &callback);
+
+	HttpClientStats get_stats() const;
 
 private:
+	struct Request
+	{
+		CURL *curl = nullptr;
+		std::string url = "";
+		std::string *data = nullptr;
+		size_t max_size = 0;
+		bool too_large = false;
+		long status = 0;
+		HttpJsonCallback callback;
+		// Set for get_fields_async, the body is not decoded into a DOM then
+		const JsonFieldSet *field_set = nullptr;
+		HttpFieldsCallback fields_callback;
+		HttpDeadline deadline = {};
+		// Tells a recycled pointer from the request a hedge timer was set for
+		uint64_t id = 0;
+		// Both copies of a hedged request point to each other while in flight
+		Request *twin = nullptr;
+		bool is_hedge = false;
+	};
+
+	struct HostStats
+	{
+		MetricId duration_metric = METRIC_INVALID_ID;
+		MetricId failure_metric = METRIC_INVALID_ID;
+		// Latest successful durations in microseconds, a ring buffer
+		std::vector<uint32_t> latencies = {};
+		size_t next_latency = 0;
+	};
+
+	struct Timer
+	{
+		std::chrono::steady_clock::time_point due = {};
+		std::function<void()> callback;
+
+		// Orders m_timers as a min heap on due
+		bool operator<(const Timer &other) const { return due > other.due; }
+	};
+
+	void queue_request(Request *request, const HttpDeadline &deadline);
+	void run();
+	void add_pending_requests();
+	// @return false when the request could not start, it is completed and freed then
+	bool start_request(Request *request);
+	void schedule_hedge(Request *request);
+	void hedge_request(Request *request, const uint64_t id);
+	void cancel_request(Request *request);
+	int run_due_timers(bool all);
+	void read_completed_requests();
+	void complete_request(Request *request, bool success);
+	void update_stats(CURL *curl, const std::string &url, bool success);
+	HostStats &get_host_stats(const std::string &url);
+
+	CURL *acquire_handle();
+	void release_handle(CURL *curl);
+	std::string *acquire_buffer();
+	void release_buffer(std::string *buffer);
+
 	static size_t curl_writer(char *data, size_t size, size_t nmemb, void *user_data);
+	static void share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *user_data);
+	static void share_unlock(CURL *curl, curl_lock_data data, void *user_data);
 
-	CURL *m_curl = nullptr;
-	std::string m_data = "";
-	bool running = true;
-};
+	CURLM *m_multi = nullptr;
+	CURLSH *m_share = nullptr;
+	std::mutex m_share_mutexes[CURL_LOCK_DATA_LAST];
+	std::thread m_thread;
+	std::atomic<bool> m_running;
+	const size_t m_max_response_size;
+	const std::chrono::milliseconds m_timeout;
+	const bool m_hedging_enabled;
+	const std::chrono::milliseconds m_hedge_min_delay;
+
+	std::mutex m_pending_mutex;
+	// Cleared by the loop before its final drain, protected by m_pending_mutex
+	bool m_accepting = false;
+	std::vector<Request *> m_pending_requests = {};
+	std::vector<Timer> m_pending_timers = {};
 
+	// Only touched by the loop thread
+	std::vector<Request *> m_in_flight_requests = {};
+	std::vector<Timer> m_timers = {};
+	std::vector<CURL *> m_idle_handles = {};
+	std::vector<std::string *> m_idle_buffers = {};
+	uint64_t m_next_request_id = 0;
+	MetricId m_too_large_metric;
+	MetricId m_timeout_metric;
+	MetricId m_hedged_metric;
+	MetricId m_hedge_wins_metric;
+	std::unordered_map<std::string, HostStats> m_host_stats = {};
+
+	std::atomic<uint64_t> m_requests;
+	std::atomic<uint64_t> m_failures;
+	std::atomic<uint64_t> m_new_connections;
+	std::atomic<uint64_t> m_reused_connections;
+	std::atomic<uint64_t> m_total_time_us;
+};
@@ -0,0 +1,353 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "HttpServer.h"
+#include "Log.h"
+
+#define HTTP_SERVER_MAX_CONNECTIONS 64
+#define HTTP_SERVER_MAX_HEADER_SIZE (16 * 1024)
+#define HTTP_SERVER_TIMEOUT std::chrono::seconds(10)
+
+HttpServer::HttpServer(uint16_t port, size_t max_body_size) : m_port(port),
+		m_max_body_size(max_body_size), m_running(false)
+{
+}
+
+HttpServer::~HttpServer()
+{
+	stop();
+}
+
+void HttpServer::register_handler(const std::string &method, const std::string &path,
+		const HttpHandler &handler)
+{
+	std::unique_lock<std::mutex> lock(m_handlers_mutex);
+	m_handlers[std::make_pair(method, path)] = handler;
+}
+
+bool HttpServer::start()
+{
+	if (m_running) {
+		return true;
+	}
+
+	m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_listen_fd < 0) {
+		LOG_ERROR("httpd", "Unable to create httpd socket: " << strerror(errno));
+		return false;
+	}
+
+	int reuse = 1;
+	setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(m_port);
+
+	if (bind(m_listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(m_listen_fd, 16) != 0) {
+		LOG_ERROR("httpd", "Unable to listen on httpd port " << m_port << ": " << strerror(errno));
+		close(m_listen_fd);
+		m_listen_fd = -1;
+		return false;
+	}
+
+	if (pipe2(m_wakeup_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+		LOG_ERROR("httpd", "Unable to create httpd wakeup pipe: " << strerror(errno));
+		close(m_listen_fd);
+		m_listen_fd = -1;
+		return false;
+	}
+
+	LOG_INFO("httpd", "httpd listening on port " << m_port);
+	m_running = true;
+	m_thread = std::thread([this] { run(); });
+	return true;
+}
+
+void HttpServer::stop()
+{
+	if (!m_running.exchange(false)) {
+		return;
+	}
+
+	const char c = 0;
+	if (write(m_wakeup_pipe[1], &c, 1) < 0) {
+		LOG_ERROR("httpd", "Unable to wake up httpd: " << strerror(errno));
+	}
+
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+
+	close(m_listen_fd);
+	close(m_wakeup_pipe[0]);
+	close(m_wakeup_pipe[1]);
+	m_listen_fd = -1;
+	m_wakeup_pipe[0] = m_wakeup_pipe[1] = -1;
+}
+
+void HttpServer::run()
+{
+	std::unordered_map<int, Connection> connections;
+	std::vector<struct pollfd> fds;
+
+	while (m_running) {
+		fds.clear();
+		fds.push_back({m_wakeup_pipe[0], POLLIN, 0});
+		fds.push_back({m_listen_fd, POLLIN, 0});
+		for (const auto &connection: connections) {
+			fds.push_back({connection.first, (short) (connection.second.out.empty() ? POLLIN : POLLOUT), 0});
+		}
+
+		if (poll(fds.data(), fds.size(), 1000) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			LOG_ERROR("httpd", "httpd poll error: " << strerror(errno));
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			char buf[64];
+			while (read(m_wakeup_pipe[0], buf, sizeof(buf)) > 0) {}
+		}
+
+		if (fds[1].revents & POLLIN) {
+			int fd;
+			while ((fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+				if (connections.size() >= HTTP_SERVER_MAX_CONNECTIONS) {
+					close(fd);
+					continue;
+				}
+
+				connections[fd].deadline = std::chrono::steady_clock::now() + HTTP_SERVER_TIMEOUT;
+			}
+		}
+
+		const auto now = std::chrono::steady_clock::now();
+		for (size_t i = 2; i < fds.size(); ++i) {
+			const int fd = fds[i].fd;
+			Connection &connection = connections[fd];
+			bool done = (fds[i].revents & (POLLERR | POLLNVAL)) || now >= connection.deadline;
+
+			if (!done && (fds[i].revents & (POLLIN | POLLHUP)) && connection.out.empty()) {
+				// Never buffer more than the largest valid request, plus a byte to notice it
+				const size_t max_request = HTTP_SERVER_MAX_HEADER_SIZE + 4 + m_max_body_size;
+				size_t allowance = max_request + 1 - std::min(connection.in.size(), max_request);
+				char buf[4096];
+				ssize_t received = 0;
+				while (allowance > 0 &&
+						(received = read(fd, buf, std::min(sizeof(buf), allowance))) > 0) {
+					connection.in.append(buf, (size_t) received);
+					allowance -= (size_t) received;
+				}
+
+				// Over the limits handle_input() answers 413 or 431 right away, and a peer
+				// closing before sending a whole request gets nothing
+				if (allowance == 0 || received == 0 ||
+						(received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+					done = !handle_input(connection) || connection.out.empty();
+				} else {
+					handle_input(connection);
+				}
+			}
+
+			if (!done && !connection.out.empty()) {
+				ssize_t sent = write(fd, connection.out.data() + connection.out_offset,
+						connection.out.size() - connection.out_offset);
+				if (sent > 0) {
+					connection.out_offset += (size_t) sent;
+				}
+
+				done = connection.out_offset >= connection.out.size() ||
+						(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+			}
+
+			if (done) {
+				close(fd);
+				connections.erase(fd);
+			}
+		}
+	}
+
+	for (const auto &connection: connections) {
+		close(connection.first);
+	}
+}
+
+bool HttpServer::handle_input(Connection &connection)
+{
+	HttpResponse response;
+	const size_t header_end = connection.in.find("\r\n\r\n");
+	if (header_end == std::string::npos || header_end > HTTP_SERVER_MAX_HEADER_SIZE) {
+		if (header_end == std::string::npos && connection.in.size() <= HTTP_SERVER_MAX_HEADER_SIZE) {
+			return false;
+		}
+
+		response.status = 431;
+		write_response(connection, response);
+		return true;
+	}
+
+	HttpRequest request;
+	size_t line_end = connection.in.find("\r\n");
+	const std::string request_line = connection.in.substr(0, line_end);
+	const size_t method_end = request_line.find(' ');
+	const size_t target_end = request_line.find(' ', method_end + 1);
+	if (method_end == std::string::npos || target_end == std::string::npos) {
+		response.status = 400;
+		write_response(connection, response);
+		return true;
+	}
+
+	request.method = request_line.substr(0, method_end);
+	const std::string target = request_line.substr(method_end + 1, target_end - method_end - 1);
+	const size_t query_start = target.find('?');
+	request.path = target.substr(0, query_start);
+	if (query_start != std::string::npos) {
+		request.query = target.substr(query_start + 1);
+	}
+
+	while (line_end < header_end) {
+		const size_t start = line_end + 2;
+		line_end = connection.in.find("\r\n", start);
+		const size_t colon = connection.in.find(':', start);
+		if (colon == std::string::npos || colon > line_end) {
+			continue;
+		}
+
+		std::string name = connection.in.substr(start, colon - start);
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+		size_t value_start = colon + 1;
+		while (value_start < line_end && (connection.in[value_start] == ' ' || connection.in[value_start] == '\t')) {
+			value_start++;
+		}
+		request.headers[name] = connection.in.substr(value_start, line_end - value_start);
+	}
+
+	if (request.headers.count("transfer-encoding")) {
+		response.status = 411;
+		write_response(connection, response);
+		return true;
+	}
+
+	size_t content_length = 0;
+	auto length_it = request.headers.find("content-length");
+	if (length_it != request.headers.end()) {
+		content_length = strtoul(length_it->second.c_str(), nullptr, 10);
+	}
+
+	if (content_length > m_max_body_size) {
+		response.status = 413;
+		write_response(connection, response);
+		return true;
+	}
+
+	const size_t body_start = header_end + 4;
+	if (connection.in.size() < body_start + content_length) {
+		return false;
+	}
+
+	request.body = connection.in.substr(body_start, content_length);
+	connection.in.clear();
+
+	handle_request(request, response);
+	write_response(connection, response);
+	return true;
+}
+
+void HttpServer::handle_request(HttpRequest &request, HttpResponse &response)
+{
+	HttpHandler handler;
+	bool path_found = false;
+	{
+		std::unique_lock<std::mutex> lock(m_handlers_mutex);
+		auto it = m_handlers.find(std::make_pair(request.method, request.path));
+		if (it != m_handlers.end()) {
+			handler = it->second;
+		}
+
+		for (const auto &h: m_handlers) {
+			path_found |= h.first.second == request.path;
+		}
+	}
+
+	if (!handler) {
+		response.status = path_found ? 405 : 404;
+		return;
+	}
+
+	handler(request, response);
+}
+
+void HttpServer::write_response(Connection &connection, const HttpResponse &response)
+{
+	std::string body = response.body;
+	if (body.empty() && response.status >= 400) {
+		body = std::string(get_status_text(response.status)) + "\n";
+	}
+
+	connection.out = "HTTP/1.1 " + std::to_string(response.status) + " " +
+			get_status_text(response.status) + "\r\n";
+	connection.out += "Content-Type: " + response.content_type + "\r\n";
+	connection.out += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+	connection.out += "Connection: close\r\n\r\n";
+	connection.out += body;
+	connection.out_offset = 0;
+}
+
+const char *HttpServer::get_status_text(int status)
+{
+	switch (status) {
+		case 200: return "OK";
+		case 202: return "Accepted";
+		case 204: return "No Content";
+		case 400: return "Bad Request";
+		case 401: return "Unauthorized";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 411: return "Length Required";
+		case 413: return "Payload Too Large";
+		case 431: return "Request Header Fields Too Large";
+		case 503: return "Service Unavailable";
+		default: return status < 500 ? "Bad Request" : "Internal Server Error";
+	}
+}
@@ -0,0 +1,98 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+struct HttpRequest
+{
+	std::string method = "";
+	std::string path = "";
+	std::string query = "";
+	// Header names are lower case
+	std::unordered_map<std::string, std::string> headers = {};
+	std::string body = "";
+};
+
+struct HttpResponse
+{
+	int status = 200;
+	std::string content_type = "text/plain; charset=utf-8";
+	std::string body = "";
+};
+
+typedef std::function<void(const HttpRequest &request, HttpResponse &response)> HttpHandler;
+
+/**
+ * Minimal embedded HTTP/1.1 server for the httpd section of the config.
+ *
+ * A single thread multiplexes every connection with poll() and runs the
+ * handlers inline, so handlers must return quickly and hand heavy work over
+ * to another thread. Connections are closed after each response.
+ */
+class HttpServer
+{
+public:
+	HttpServer(uint16_t port, size_t max_body_size);
+	~HttpServer();
+
+	void register_handler(const std::string &method, const std::string &path, const HttpHandler &handler);
+	bool start();
+	void stop();
+
+private:
+	struct Connection
+	{
+		std::string in = "";
+		std::string out = "";
+		size_t out_offset = 0;
+		std::chrono::steady_clock::time_point deadline = {};
+	};
+
+	void run();
+	bool handle_input(Connection &connection);
+	void handle_request(HttpRequest &request, HttpResponse &response);
+	static void write_response(Connection &connection, const HttpResponse &response);
+	static const char *get_status_text(int status);
+
+	uint16_t m_port;
+	size_t m_max_body_size;
+	int m_listen_fd = -1;
+	int m_wakeup_pipe[2] = {-1, -1};
+
+	std::mutex m_handlers_mutex;
+	std::map<std::pair<std::string, std::string>, HttpHandler> m_handlers = {};
+
+	std::atomic<bool> m_running;
+	std::thread m_thread;
+};
@@ -0,0 +1,178 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include "IRCSender.h"
+#include "Config.h"
+#include "Log.h"
+
+#define IRC_SENDER_COALESCE_SEPARATOR " | "
+#define IRC_SENDER_IDLE_WAIT std::chrono::milliseconds(1000)
+
+IRCSender::IRCSender(const Config *cfg, const std::function<void()> &wakeup) :
+		m_burst(cfg->get_irc_flood_burst() > 0 ? cfg->get_irc_flood_burst() : 1),
+		m_interval(cfg->get_irc_flood_interval_ms()),
+		m_max_line_length(cfg->get_irc_max_line_length() > 0 ? cfg->get_irc_max_line_length() : 400),
+		m_queue(cfg->get_irc_outbound_queue_size()),
+		m_backlog_size(0), m_wakeup(wakeup)
+{
+	m_tokens = m_burst;
+	m_last_refill = std::chrono::steady_clock::now();
+}
+
+bool IRCSender::send(const std::string &target, const std::string &text)
+{
+	// IRC messages can't hold new lines, and must fit in a protocol line
+	size_t start = 0;
+	while (start < text.size()) {
+		size_t end = text.find('\n', start);
+		if (end == std::string::npos) {
+			end = text.size();
+		}
+
+		size_t line_end = end;
+		if (line_end > start && text[line_end - 1] == '\r') {
+			line_end--;
+		}
+
+		size_t pos = start;
+		while (pos < line_end) {
+			size_t split = std::min(pos + m_max_line_length, line_end);
+
+			// Don't cut an UTF-8 sequence: split before its lead byte, not on a 10xxxxxx one
+			if (split < line_end) {
+				size_t lead = split;
+				while (lead > pos && (text[lead] & 0xC0) == 0x80) {
+					lead--;
+				}
+				if (lead > pos) {
+					split = lead;
+				}
+			}
+
+			OutboundMessage message;
+			message.target = target;
+			message.text = text.substr(pos, split - pos);
+			if (!m_queue.try_push(std::move(message))) {
+				LOG_WARN("irc", "Outbound IRC queue is full, message to " << target
+						<< " dropped");
+				return false;
+			}
+			pos = split;
+		}
+
+		start = end + 1;
+	}
+
+	m_wakeup();
+	return true;
+}
+
+size_t IRCSender::get_queue_depth() const
+{
+	return m_queue.size_approx() + m_backlog_size;
+}
+
+void IRCSender::refill_tokens(const std::chrono::steady_clock::time_point &now)
+{
+	double elapsed = std::chrono::duration<double, std::milli>(now - m_last_refill).count();
+	m_last_refill = now;
+
+	if (m_interval.count() == 0) {
+		m_tokens = m_burst;
+		return;
+	}
+
+	m_tokens = std::min((double) m_burst, m_tokens + elapsed / m_interval.count());
+}
+
+std::chrono::milliseconds IRCSender::pump()
+{
+	refill_tokens(std::chrono::steady_clock::now());
+
+	OutboundMessage message;
+	while (m_tokens >= 1 && next_message(message)) {
+		if (!m_session || !irc_is_connected(m_session)) {
+			LOG_WARN("irc", "Not connected to IRC, message to " << message.target
+					<< " dropped");
+			continue;
+		}
+
+		if (irc_cmd_msg(m_session, message.target.c_str(), message.text.c_str())) {
+			LOG_ERROR("irc", "Unable to send message to " << message.target << ": "
+					<< irc_strerror(irc_errno(m_session)));
+		}
+		m_tokens -= 1;
+	}
+
+	m_backlog_size = m_backlog.size();
+
+	if (m_backlog.empty() && m_queue.size_approx() == 0) {
+		return IRC_SENDER_IDLE_WAIT;
+	}
+
+	// Time until the next token
+	return std::chrono::milliseconds((int64_t) ((1 - m_tokens) * m_interval.count()) + 1);
+}
+
+bool IRCSender::next_message(OutboundMessage &message)
+{
+	OutboundMessage queued;
+	while (m_backlog.size() < m_queue.capacity() && m_queue.try_pop(queued)) {
+		m_backlog.push_back(std::move(queued));
+	}
+
+	if (m_backlog.empty()) {
+		return false;
+	}
+
+	message = std::move(m_backlog.front());
+	m_backlog.pop_front();
+	coalesce(message);
+	return true;
+}
+
+void IRCSender::coalesce(OutboundMessage &message)
+{
+	static const size_t separator_length = strlen(IRC_SENDER_COALESCE_SEPARATOR);
+
+	// Merge following messages for the same target while they fit in a line.
+	// Messages to other targets keep their relative order.
+	for (auto it = m_backlog.begin(); it != m_backlog.end();) {
+		if (it->target != message.target) {
+			++it;
+			continue;
+		}
+
+		if (message.text.size() + separator_length + it->text.size() > m_max_line_length) {
+			break;
+		}
+
+		message.text += IRC_SENDER_COALESCE_SEPARATOR + it->text;
+		it = m_backlog.erase(it);
+	}
+}
@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <libircclient.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <string>
+#include "LockFreeQueue.h"
+
+class Config;
+
+struct OutboundMessage
+{
+	std::string target = "";
+	std::string text = "";
+};
+
+/**
+ * Single outbound stage for an IRC session.
+ *
+ * Any thread can queue messages through the lock-free queue. The IRC event
+ * loop calls pump(), which paces them with a token bucket matching the
+ * server flood limits and merges consecutive small messages for the same
+ * target into one line. The wakeup callback lets send() interrupt the loop.
+ */
+class IRCSender
+{
+public:
+	IRCSender(const Config *cfg, const std::function<void()> &wakeup);
+	~IRCSender() {};
+
+	void set_session(irc_session_t *session) { m_session = session; }
+
+	bool send(const std::string &target, const std::string &text);
+	size_t get_queue_depth() const;
+
+	/**
+	 * Send what the token bucket allows.
+	 * @return delay before the next message can be sent
+	 */
+	std::chrono::milliseconds pump();
+
+	/**
+	 * Pop the next message to send, merged with the following ones for the
+	 * same target. Doesn't consume flood tokens.
+	 */
+	bool next_message(OutboundMessage &message);
+
+private:
+	void refill_tokens(const std::chrono::steady_clock::time_point &now);
+	void coalesce(OutboundMessage &message);
+
+	irc_session_t *m_session = nullptr;
+	const uint32_t m_burst;
+	const std::chrono::milliseconds m_interval;
+	const size_t m_max_line_length;
+
+	LockFreeQueue<OutboundMessage> m_queue;
+
+	// Only touched by the consumer
+	std::deque<OutboundMessage> m_backlog = {};
+	double m_tokens = 0;
+	std::chrono::steady_clock::time_point m_last_refill = {};
+	std::atomic<size_t> m_backlog_size;
+
+	std::function<void()> m_wakeup;
+};
@@ -23,124 +23,262 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <chrono>
-#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
 #include "IRCThread.h"
-#include "CommandHandler.h"
+#include "CommandExecutor.h"
+#include "IRCSender.h"
+#include "CommandDispatcher.h"
 #include "Config.h"
+#include "ConfigStore.h"
 #include "Mail.h"
+#include "Log.h"
 
-std::string IRCThread::s_bot_name = "mybot_new";
-irc_info_session IRCThread::s_iis = irc_info_session("server", "nick");
-IRCThread *IRCThread::that = nullptr;
-const Config *IRCThread::s_cfg = nullptr;
+// Delay before connecting again to a network after an error
+#define IRC_RECONNECT_DELAY std::chrono::seconds(30)
 
-IRCThread::IRCThread(const Config *cfg)
+IRCThread::IRCThread(const Config *cfg, ConfigStore *config_store, CommandExecutor *executor) :
+		m_cfg(cfg), m_config_store(config_store), m_executor(executor), m_run(true),
+		m_wakeup_pending(false), m_rate_limiter(cfg->get_command_rate_limit_slots())
 {
-	s_iis.channel = cfg->get_irc_channel_configs().begin()->first;
-	s_iis.nick = cfg->get_irc_name();
-	that = this;
-	s_cfg = cfg;
+	memset(&m_callbacks, 0, sizeof(m_callbacks));
+	m_callbacks.event_connect = &IRCThread::event_connect;
+	m_callbacks.event_join = &IRCThread::event_join;
+	m_callbacks.event_channel = &IRCThread::event_channel;
+	m_callbacks.event_privmsg = &IRCThread::event_privmsg;
+
+	if (pipe(m_wakeup_pipe) == 0) {
+		fcntl(m_wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+		fcntl(m_wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+	} else {
+		LOG_ERROR("irc", "Unable to create IRC wakeup pipe");
+	}
+
+	for (const auto &server_config: cfg->get_irc_server_configs()) {
+		IRCConnection *connection = new IRCConnection();
+		connection->irc_thread = this;
+		connection->cfg = server_config;
+		connection->bot_name = server_config->nick;
+		connection->sender = new IRCSender(cfg, [this] { wakeup(); });
+		m_connections.push_back(connection);
+	}
+
+	m_passive_rejected_metric = Metrics::register_counter("bot_commands_rejected_total",
+			"reason=\"passive\"", "Channel commands dropped by the channel policy");
+	m_not_allowed_rejected_metric = Metrics::register_counter("bot_commands_rejected_total",
+			"reason=\"not_allowed\"", "Channel commands dropped by the channel policy");
+	m_user_rate_limited_metric = Metrics::register_counter("bot_commands_rate_limited_total",
+			"scope=\"user\"", "Commands dropped by commands.rate_limits");
+	m_channel_rate_limited_metric = Metrics::register_counter("bot_commands_rate_limited_total",
+			"scope=\"channel\"", "Commands dropped by commands.rate_limits");
+	Metrics::register_callback("bot_rate_limit_slots_used", "", "Rate limiter slots holding a live window",
+			"gauge", [this] { return (double) m_rate_limiter.get_used_slots(); });
+	Metrics::register_callback("bot_rate_limit_table_full_total", "",
+			"Commands let through because the rate limiter table was full",
+			"counter", [this] { return (double) m_rate_limiter.get_table_full(); });
 }
 
 IRCThread::~IRCThread()
 {
-	delete that;
+	for (auto &connection: m_connections) {
+		if (connection->session) {
+			irc_destroy_session(connection->session);
+		}
+		delete connection->sender;
+		delete connection;
+	}
+
+	for (int fd: m_wakeup_pipe) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
 }
-void IRCThread::run(const Config *cfg)
+
+void IRCThread::run()
 {
-	irc_callbacks_t callbacks = { 0 };
-	irc_session_t *s;
+	LOG_DEBUG("irc", "Debut du thread connexion");
+
+	for (auto &connection: m_connections) {
+		connection->session = irc_create_session(&m_callbacks);
+		if (!connection->session) {
+			LOG_ERROR("irc", "Could not create session for " << connection->cfg->network);
+			continue;
+		}
 
-	callbacks.event_connect = &IRCThread::event_connect;
-	callbacks.event_join = &IRCThread::event_join;
-	callbacks.event_channel = &IRCThread::event_channel;
-	callbacks.event_privmsg = &IRCThread::event_privmsg;
+		irc_set_ctx(connection->session, connection);
+		connection->sender->set_session(connection->session);
+		connect(connection);
+	}
 
-	//std::thread co(IRCThread::connect(callbacks, server, port), this);
-	// Ne sert à rien
-	//std::thread thread_connect([this, callbacks, server, port] { this->connect(callbacks, server, port); });
-	connect(callbacks, cfg->get_irc_server().c_str(), cfg->get_irc_port());
-}
+	while (m_run) {
+		fd_set in_set, out_set;
+		int max_fd = 0;
+		FD_ZERO(&in_set);
+		FD_ZERO(&out_set);
 
-void IRCThread::connect(irc_callbacks_t callbacks, const char *server, unsigned short port)
-{
-	std::cout << "Debut du thread connexion" << std::endl;
-	//while (m_run) {
-		m_irc_session = irc_create_session(&callbacks);
+		if (m_wakeup_pipe[0] >= 0) {
+			FD_SET(m_wakeup_pipe[0], &in_set);
+			max_fd = m_wakeup_pipe[0];
+		}
 
-		if (!m_irc_session) {
-			std::cout << "Could not create session" << std::endl;
-			return;
+		// Send what flood limits allow, and wait at most until the next slot
+		auto now = std::chrono::steady_clock::now();
+		std::chrono::milliseconds timeout = std::chrono::milliseconds(1000);
+		for (auto &connection: m_connections) {
+			if (!connection->session) {
+				continue;
+			}
+
+			if (!irc_is_connected(connection->session)) {
+				if (now >= connection->reconnect_at) {
+					connect(connection);
+				}
+				continue;
+			}
+
+			timeout = std::min(timeout, connection->sender->pump());
+			irc_add_select_descriptors(connection->session, &in_set, &out_set, &max_fd);
 		}
 
-		irc_set_ctx(m_irc_session, &s_iis);
+		struct timeval tv;
+		tv.tv_sec = timeout.count() / 1000;
+		tv.tv_usec = (timeout.count() % 1000) * 1000;
 
-		if (server[0] == '#' && server[1] == '#') {
-			server++;
+		if (select(max_fd + 1, &in_set, &out_set, nullptr, &tv) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
 
-			irc_option_set(m_irc_session, LIBIRC_OPTION_SSL_NO_VERIFY);
+			LOG_ERROR("irc", "IRC select error: " << strerror(errno));
+			break;
 		}
 
-		std::cout << "Connection wait..." << std::endl;
-		std::cout << "Server : " << server << " port : " << port << " nick : " << s_iis.nick.c_str()
-				  << " Channel : '" << s_iis.channel.c_str() << "'" << std::endl;
-		// Initiate the IRC server connection
-		if (irc_connect(m_irc_session, server, port, 0, s_iis.nick.c_str(), 0, 0)) {
-			std::cout << std::endl << "Could not connect " << irc_strerror(irc_errno(m_irc_session)) << std::endl;
-			return;
+		if (m_wakeup_pipe[0] >= 0 && FD_ISSET(m_wakeup_pipe[0], &in_set)) {
+			char buf[64];
+			while (read(m_wakeup_pipe[0], buf, sizeof(buf)) > 0) {}
+			m_wakeup_pending = false;
 		}
 
-		std::cout << "..." << std::endl;
+		for (auto &connection: m_connections) {
+			if (!connection->session || !irc_is_connected(connection->session)) {
+				continue;
+			}
+
+			if (irc_process_select_descriptors(connection->session, &in_set, &out_set)) {
+				LOG_ERROR("irc", "I/O error on " << connection->cfg->network << ": "
+						<< irc_strerror(irc_errno(connection->session)));
+				irc_disconnect(connection->session);
+				connection->reconnect_at = std::chrono::steady_clock::now() + IRC_RECONNECT_DELAY;
+			}
+		}
+	}
 
-		if (irc_run(m_irc_session)) {
-			std::cout << "Could not connect or I/O error: " << irc_strerror(irc_errno(m_irc_session)) << std::endl;
-			return;
+	for (auto &connection: m_connections) {
+		if (connection->session) {
+			irc_disconnect(connection->session);
 		}
+	}
 
-		std::cout << "Connection done !" << std::endl;
-	//}
+	LOG_DEBUG("irc", "Connection done !");
+}
+
+bool IRCThread::connect(IRCConnection *connection)
+{
+	const IRCServerConfig *server_config = connection->cfg;
+	const char *server = server_config->server.c_str();
+
+	if (server[0] == '#' && server[1] == '#') {
+		server++;
+
+		irc_option_set(connection->session, LIBIRC_OPTION_SSL_NO_VERIFY);
+	}
+
+	LOG_DEBUG("irc", "Connection wait...");
+	LOG_INFO("irc", "Network : " << server_config->network << " server : " << server
+			<< " port : " << server_config->port << " nick : " << server_config->nick
+			<< " Channels : " << server_config->channels.size());
+
+	const char *password = server_config->password.empty() ? nullptr : server_config->password.c_str();
+
+	// Initiate the IRC server connection
+	if (irc_connect(connection->session, server, server_config->port, password,
+			server_config->nick.c_str(), 0, 0)) {
+		LOG_ERROR("irc", "Could not connect " << irc_strerror(irc_errno(connection->session)));
+		connection->reconnect_at = std::chrono::steady_clock::now() + IRC_RECONNECT_DELAY;
+		return false;
+	}
+
+	return true;
+}
+
+void IRCThread::wakeup()
+{
+	if (m_wakeup_pending.exchange(true) || m_wakeup_pipe[1] < 0) {
+		return;
+	}
+
+	const char c = 0;
+	if (write(m_wakeup_pipe[1], &c, 1) < 0) {
+		m_wakeup_pending = false;
+	}
 }
 
 void IRCThread::stop()
 {
-	Mail::delete_all_mail();
-	irc_disconnect(m_irc_session);
+	m_run = false;
+	m_wakeup_pending = false;
+	wakeup();
 }
 
 void IRCThread::event_connect(irc_session_t *session, const char *event, const char *origin,
 			const char **params, unsigned int count)
 {
+	IRCConnection *connection = (IRCConnection *) irc_get_ctx(session);
+
 	if (!irc_is_connected(session)) {
-		std::cout << "Not connected to IRC" << std::endl;
+		LOG_ERROR("irc", "Not connected to IRC");
 	}
-	std::cout << "Connected to IRC" << std::endl;
+	LOG_INFO("irc", "Connected to IRC network " << connection->cfg->network);
 
-	s_bot_name = std::string(params[0]);
+	connection->bot_name = std::string(params[0]);
 
-	if (irc_cmd_join(session, s_iis.channel.c_str(), NULL)) {
-		std::cerr << "Unable to join channel " << s_iis.channel << ", aborting." << std::endl;
-		irc_disconnect(session);
+	for (const auto &channel: connection->cfg->channels) {
+		if (irc_cmd_join(session, channel.first.c_str(), NULL)) {
+			LOG_ERROR("irc", "Unable to join channel " << channel.first << ", aborting.");
+			connection->reconnect_at = std::chrono::steady_clock::now() + IRC_RECONNECT_DELAY;
+			irc_disconnect(session);
+			return;
+		}
 	}
-
 }
 
 void IRCThread::event_join(irc_session_t *session, const char *event, const char *origin,
 			const char **params, unsigned int count)
 {
+	IRCConnection *connection = (IRCConnection *) irc_get_ctx(session);
+
 	if (!irc_is_connected(session)) {
-		std::cerr << "Error: not connected to IRC on " << __FUNCTION__ << std::endl;
+		LOG_ERROR("irc", "Error: not connected to IRC on " << __FUNCTION__);
+		return;
+	}
+
+	if (count < 1) {
 		return;
 	}
 
-	std::cout << "Join channel" << std::endl;
+	const std::string channel = params[0];
+	LOG_INFO("irc", "Join channel " << channel);
 	std::string msg = "";
 	std::string ori = (std::string) origin;
 	std::string pseudo = ori.substr(0, ori.find("!"));
-	std::cout << s_bot_name << " et " << s_iis.nick << std::endl;
 
-	if (strcmp(pseudo.c_str(), s_bot_name.c_str()) != 0) {
+	if (strcmp(pseudo.c_str(), connection->bot_name.c_str()) != 0) {
 		std::string name = std::string(pseudo);
 		msg = "Salut " + name + " ! Tu vas bien ?";
 		std::string mail = "";
@@ -149,35 +287,136 @@ void IRCThread::event_join(irc_session_t *session, const char *event, const char
 		}
 	}
 	else
-		msg = "Salut " + s_iis.channel + " ! Vous allez bien ? ";
+		msg = "Salut " + channel + " ! Vous allez bien ? ";
 
-	irc_cmd_msg(session, s_iis.channel.c_str(), msg.c_str());
+	connection->sender->send(channel, msg);
 }
 
 void IRCThread::event_channel(irc_session_t *session, const char *event, const char *origin,
 			const char **params, unsigned int count)
 {
+	IRCConnection *connection = (IRCConnection *) irc_get_ctx(session);
+
 	if (!irc_is_connected(session)) {
-		std::cerr << "Error: not connected to IRC on " << __FUNCTION__ << std::endl;
+		LOG_ERROR("irc", "Error: not connected to IRC on " << __FUNCTION__);
 		return;
 	}
 
-	if (strcmp(origin, IRCThread::s_bot_name.c_str()) == 0 || count == 1) {
+	if (strcmp(origin, connection->bot_name.c_str()) == 0 || count == 1) {
 		return;
 	}
 
-	std::cout << "Event channel : " << params[0] << " : " << params[1] << std::endl;
+	if (params[1][0] == '.' &&
+			connection->irc_thread->is_command_allowed(connection, params[0], origin, params[1])) {
+		dispatch_command(connection, params[0], origin, params[1]);
+	}
+}
+
+bool IRCThread::is_command_allowed(const IRCConnection *connection, const char *channel,
+		const char *origin, const char *text)
+{
+	// Runs before anything is allocated for the command
+	const ConfigSnapshot cfg = m_config_store->acquire();
+	const char *command = text + 1;
+	const int32_t command_id = CommandHandler::get_dispatch_table().find(
+			CommandDispatchTable::next_token(command));
+
+	// Private messages have no channel policy
+	if (channel) {
+		// A network removed by a reload has no policy anymore, stay passive there
+		const IRCServerConfig *server_config = cfg->get_irc_server_config(connection->cfg->network);
+		const IRCChannelConfig *channel_config = server_config ?
+				server_config->find_channel_policy(channel) : nullptr;
+		if (!channel_config || channel_config->is_passive) {
+			Metrics::increment(m_passive_rejected_metric);
+			return false;
+		}
+
+		if (!channel_config->is_command_allowed(command_id)) {
+			Metrics::increment(m_not_allowed_rejected_metric);
+			return false;
+		}
+	}
+
+	// The user is only charged once the channel accepted the command, a full channel
+	// must not eat the quota of its users
+	const CommandRateLimit &rate_limit = cfg->get_command_rate_limit(command_id);
+	const uint64_t user_key = RateLimiter::make_key(origin, '!', command_id, RATE_LIMIT_USER);
+	if (rate_limit.per_user &&
+			!m_rate_limiter.would_allow(user_key, rate_limit.per_user, rate_limit.window)) {
+		Metrics::increment(m_user_rate_limited_metric);
+		return false;
+	}
+
+	if (channel && rate_limit.per_channel && !m_rate_limiter.allow(
+			RateLimiter::make_key(channel, '\0', command_id, RATE_LIMIT_CHANNEL),
+			rate_limit.per_channel, rate_limit.window)) {
+		Metrics::increment(m_channel_rate_limited_metric);
+		return false;
+	}
 
-	if (params[1][0] == '.') {
-		std::string msg = "";
-		CommandHandler *command_handler = new CommandHandler(that, s_cfg, params[1], Permission::USER);
-		command_handler->start();
+	// Concurrent commands of the same user may have used the quota since the check
+	if (rate_limit.per_user && !m_rate_limiter.allow(user_key, rate_limit.per_user, rate_limit.window)) {
+		Metrics::increment(m_user_rate_limited_metric);
+		return false;
 	}
+
+	return true;
 }
 
-void IRCThread::add_text(const std::string &text)
+void IRCThread::dispatch_command(IRCConnection *connection, const char *channel, const char *origin,
+		const char *text)
 {
-	irc_cmd_msg(m_irc_session, s_iis.channel.c_str(), text.c_str());
+	CommandJob job;
+	job.text = text;
+	job.permission = Permission::USER;
+	job.connection = connection;
+
+	const char *nick_end = strchr(origin, '!');
+	job.nick = nick_end ? std::string(origin, nick_end - origin) : std::string(origin);
+
+	job.reply_to = channel ? channel : job.nick;
+
+	const std::string reply_to = job.reply_to;
+	if (!connection->irc_thread->m_executor->submit(std::move(job))) {
+		connection->sender->send(reply_to, "Too many pending commands, try again later.");
+	}
+}
+
+void IRCThread::add_text(IRCConnection *connection, const std::string &target, const std::string &text)
+{
+	if (!connection) {
+		connection = get_default_connection();
+		if (!connection) {
+			return;
+		}
+	}
+
+	connection->sender->send(target, text);
+}
+
+IRCConnection *IRCThread::get_default_connection() const
+{
+	return m_connections.empty() ? nullptr : m_connections.front();
+}
+
+IRCConnection *IRCThread::get_connection(const IRCServerConfig *server_config) const
+{
+	for (const auto &connection: m_connections) {
+		if (connection->cfg == server_config) {
+			return connection;
+		}
+	}
+	return nullptr;
+}
+
+size_t IRCThread::get_outbound_queue_depth() const
+{
+	size_t depth = 0;
+	for (const auto &connection: m_connections) {
+		depth += connection->sender->get_queue_depth();
+	}
+	return depth;
 }
 
 void IRCThread::event_numeric(irc_session_t *session, const char *event, const char *origin,
@@ -188,19 +427,18 @@ void IRCThread::event_numeric(irc_session_t *session, const char *event, const c
 
 void IRCThread::event_privmsg(irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count)
 {
+	IRCConnection *connection = (IRCConnection *) irc_get_ctx(session);
+
 	if (!irc_is_connected(session)) {
-		std::cerr << "Error: not connected to IRC on " << __FUNCTION__ << std::endl;
+		LOG_ERROR("irc", "Error: not connected to IRC on " << __FUNCTION__);
 		return;
 	}
 
-	if (strcmp(origin, IRCThread::s_bot_name.c_str()) == 0 || count == 1) {
+	if (strcmp(origin, connection->bot_name.c_str()) == 0 || count == 1) {
 		return;
 	}
-	std::string ori = (std::string) origin; 
-	std::string pseudo = ori.substr(0, ori.find("!"));
-	if (params[1][0] == '.') {
-		std::string msg = "";
-		CommandHandler *command_handler = new CommandHandler(that, s_cfg, params[1], Permission::USER);
-		command_handler->start();
+	if (params[1][0] == '.' &&
+			connection->irc_thread->is_command_allowed(connection, nullptr, origin, params[1])) {
+		dispatch_command(connection, nullptr, origin, params[1]);
 	}
 }
@@ -27,40 +27,81 @@
 
 #include <libircclient.h>
 #include <libirc_events.h>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <vector>
+#include "Metrics.h"
+#include "RateLimiter.h"
 
 class Config;
+class ConfigStore;
+class CommandExecutor;
+class IRCSender;
+class IRCThread;
+struct IRCServerConfig;
 
-struct irc_info_session {
-	std::string channel;
-	std::string nick;
-
-	irc_info_session(std::string channel, std::string nick) :
-			channel(channel), nick(nick) {};
+/**
+ * One IRC network connection, attached to its session as libircclient context
+ */
+struct IRCConnection
+{
+	IRCThread *irc_thread = nullptr;
+	const IRCServerConfig *cfg = nullptr;
+	irc_session_t *session = nullptr;
+	IRCSender *sender = nullptr;
+	std::string bot_name = "";
+	std::chrono::steady_clock::time_point reconnect_at = {};
 };
 
+/**
+ * Drives every configured IRC network from a single thread: all sessions are
+ * multiplexed with select() and share the same command executor.
+ *
+ * Channel commands are checked against the channel policy in the callback,
+ * rejected ones never reach the executor. Nicks and channels sending commands
+ * faster than commands.rate_limits allows are silently dropped the same way.
+ */
 class IRCThread {
 public:
-	IRCThread(const Config *cfg);
+	IRCThread(const Config *cfg, ConfigStore *config_store, CommandExecutor *executor);
 	~IRCThread();
-	void run(const Config *cfg);
-	void connect(irc_callbacks_t callbacks, const char *server, unsigned short port);
+	void run();
 
-	void add_text(const std::string &text);
+	void add_text(IRCConnection *connection, const std::string &target, const std::string &text);
+	IRCConnection *get_default_connection() const;
+	IRCConnection *get_connection(const IRCServerConfig *server_config) const;
+	size_t get_outbound_queue_depth() const;
 	void stop();
 
 private:
+	bool connect(IRCConnection *connection);
+	void wakeup();
+
 	static void event_join(irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count);
 	static void event_connect(irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count);
 	static void event_numeric(irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count);
 	static void event_channel(irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count);
 	static void event_privmsg(irc_session_t *session, const char *event, const char *origin, const char **params, unsigned int count);
+	static void dispatch_command(IRCConnection *connection, const char *channel, const char *origin, const char *text);
+	bool is_command_allowed(const IRCConnection *connection, const char *channel, const char *origin,
+			const char *text);
 
-	static const Config *s_cfg;
-	static irc_info_session s_iis;
-	bool m_run = true;
-	irc_session_t *m_irc_session = nullptr;
-	static std::string s_bot_name;
-	static IRCThread *that;
-};
+	const Config *m_cfg = nullptr;
+	ConfigStore *m_config_store = nullptr;
+	CommandExecutor *m_executor = nullptr;
+	irc_callbacks_t m_callbacks;
+	std::vector<IRCConnection *> m_connections = {};
+
+	std::atomic<bool> m_run;
+	// Self pipe interrupting select() when messages are queued or on stop
+	int m_wakeup_pipe[2] = {-1, -1};
+	std::atomic<bool> m_wakeup_pending;
 
+	MetricId m_passive_rejected_metric = METRIC_INVALID_ID;
+	MetricId m_not_allowed_rejected_metric = METRIC_INVALID_ID;
+	MetricId m_user_rate_limited_metric = METRIC_INVALID_ID;
+	MetricId m_channel_rate_limited_metric = METRIC_INVALID_ID;
+
+	RateLimiter m_rate_limiter;
+};
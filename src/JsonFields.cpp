@@ -0,0 +1,638 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include "JsonFields.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Next '"' or '\\' at or after p, or end
+static inline const char *find_string_special(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	for (; end - p >= 16; p += 16) {
+		const __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+		const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+				_mm_cmpeq_epi8(chunk, backslash)));
+		if (mask) {
+			return p + __builtin_ctz((unsigned) mask);
+		}
+	}
+#endif
+
+	while (p < end && *p != '"' && *p != '\\') {
+		++p;
+	}
+	return p;
+}
+
+// Next '"', '{', '}', '[' or ']' at or after p, or end
+static inline const char *find_structural(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+	// Setting bit 0x20 folds '[' on '{' and ']' on '}', no other byte lands on them
+	const __m128i fold = _mm_set1_epi8(0x20);
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i open = _mm_set1_epi8('{');
+	const __m128i close = _mm_set1_epi8('}');
+	for (; end - p >= 16; p += 16) {
+		const __m128i chunk = _mm_loadu_si128((const __m128i *) p);
+		const __m128i folded = _mm_or_si128(chunk, fold);
+		const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+				_mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close))));
+		if (mask) {
+			return p + __builtin_ctz((unsigned) mask);
+		}
+	}
+#endif
+
+	for (; p < end; ++p) {
+		switch (*p) {
+			case '"': case '{': case '}': case '[': case ']':
+				return p;
+			default:
+				break;
+		}
+	}
+	return p;
+}
+
+static inline bool is_whitespace(const char c)
+{
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline bool is_delimiter(const char c)
+{
+	return c == ',' || c == '}' || c == ']' || is_whitespace(c);
+}
+
+static void append_utf8(std::string &out, uint32_t code_point)
+{
+	if (code_point < 0x80) {
+		out += (char) code_point;
+	} else if (code_point < 0x800) {
+		out += (char) (0xC0 | (code_point >> 6));
+		out += (char) (0x80 | (code_point & 0x3F));
+	} else if (code_point < 0x10000) {
+		out += (char) (0xE0 | (code_point >> 12));
+		out += (char) (0x80 | ((code_point >> 6) & 0x3F));
+		out += (char) (0x80 | (code_point & 0x3F));
+	} else {
+		out += (char) (0xF0 | (code_point >> 18));
+		out += (char) (0x80 | ((code_point >> 12) & 0x3F));
+		out += (char) (0x80 | ((code_point >> 6) & 0x3F));
+		out += (char) (0x80 | (code_point & 0x3F));
+	}
+}
+
+void JsonFields::reset(const size_t count)
+{
+	m_fields.resize(count);
+	for (Field &field: m_fields) {
+		field.value.clear();
+		field.type = JSON_FIELD_MISSING;
+	}
+}
+
+double JsonFields::as_double(const size_t index) const
+{
+	const Field &field = m_fields[index];
+	switch (field.type) {
+		case JSON_FIELD_NUMBER:
+			return strtod(field.value.c_str(), nullptr);
+		case JSON_FIELD_BOOL:
+			return field.value == "true" ? 1.0 : 0.0;
+		default:
+			return 0.0;
+	}
+}
+
+uint64_t JsonFields::as_uint(const size_t index) const
+{
+	const Field &field = m_fields[index];
+	switch (field.type) {
+		case JSON_FIELD_NUMBER:
+			return field.value[0] == '-' ? 0 : strtoull(field.value.c_str(), nullptr, 10);
+		case JSON_FIELD_BOOL:
+			return field.value == "true" ? 1 : 0;
+		default:
+			return 0;
+	}
+}
+
+bool JsonFields::as_bool(const size_t index) const
+{
+	const Field &field = m_fields[index];
+	switch (field.type) {
+		case JSON_FIELD_BOOL:
+			return field.value == "true";
+		case JSON_FIELD_NUMBER:
+			return as_double(index) != 0.0;
+		default:
+			return false;
+	}
+}
+
+/**
+ * Single pass over a document. Each level receives the mask of the paths
+ * whose segments matched so far, and skips the values no path goes through.
+ */
+class JsonFieldSet::Parser
+{
+public:
+	Parser(const JsonFieldSet &set, const char *data, const size_t length, JsonFields &fields) :
+			m_set(set), m_p(data), m_end(data + length), m_fields(fields),
+			m_remaining(set.m_all_paths)
+	{
+	}
+
+	bool parse_value(const size_t depth, const uint64_t alive);
+	bool done() const { return m_remaining == 0; }
+
+private:
+	bool parse_object(const size_t depth, const uint64_t alive);
+	bool parse_array(const size_t depth, const uint64_t alive);
+	bool capture(const uint64_t paths);
+
+	bool skip_value();
+	bool skip_container();
+	bool skip_literal();
+	bool skip_string(bool &escaped);
+	bool read_string(std::string &out);
+
+	void skip_whitespace()
+	{
+		while (m_p < m_end && is_whitespace(*m_p)) {
+			++m_p;
+		}
+	}
+
+	// Paths of alive which end at depth
+	uint64_t ending_at(const size_t depth, const uint64_t alive) const
+	{
+		uint64_t mask = 0;
+		for (size_t i = 0; i < m_set.m_paths.size(); ++i) {
+			if ((alive & (1ULL << i)) && m_set.m_paths[i].size() == depth) {
+				mask |= 1ULL << i;
+			}
+		}
+		return mask;
+	}
+
+	const JsonFieldSet &m_set;
+	const char *m_p = nullptr;
+	const char *m_end = nullptr;
+	JsonFields &m_fields;
+	uint64_t m_remaining = 0;
+	std::string m_key = "";
+};
+
+bool JsonFieldSet::Parser::parse_value(const size_t depth, const uint64_t alive)
+{
+	skip_whitespace();
+	if (m_p >= m_end) {
+		return false;
+	}
+
+	const uint64_t live = alive & m_remaining;
+	const uint64_t terminal = ending_at(depth, live);
+	if (terminal) {
+		return capture(terminal);
+	}
+
+	if (!live) {
+		return skip_value();
+	}
+
+	switch (*m_p) {
+		case '{':
+			return parse_object(depth, live);
+		case '[':
+			return parse_array(depth, live);
+		default:
+			// Scalar where the paths expect a container, they stay missing
+			return skip_value();
+	}
+}
+
+bool JsonFieldSet::Parser::parse_object(const size_t depth, const uint64_t alive)
+{
+	++m_p;
+	skip_whitespace();
+	if (m_p < m_end && *m_p == '}') {
+		++m_p;
+		return true;
+	}
+
+	while (true) {
+		skip_whitespace();
+		if (m_p >= m_end || *m_p != '"') {
+			return false;
+		}
+
+		const char *key_start = m_p + 1;
+		bool escaped = false;
+		if (!skip_string(escaped)) {
+			return false;
+		}
+
+		const char *key = key_start;
+		size_t key_length = (size_t) (m_p - 1 - key_start);
+		if (escaped) {
+			// Rare, compare the unescaped key
+			const char *end = m_p;
+			m_p = key_start - 1;
+			if (!read_string(m_key)) {
+				return false;
+			}
+			m_p = end;
+			key = m_key.c_str();
+			key_length = m_key.size();
+		}
+
+		uint64_t child = 0;
+		for (size_t i = 0; i < m_set.m_paths.size(); ++i) {
+			if (!(alive & (1ULL << i))) {
+				continue;
+			}
+
+			const Segment &segment = m_set.m_paths[i][depth];
+			if (segment.index < 0 && segment.key.size() == key_length &&
+					memcmp(segment.key.data(), key, key_length) == 0) {
+				child |= 1ULL << i;
+			}
+		}
+
+		skip_whitespace();
+		if (m_p >= m_end || *m_p != ':') {
+			return false;
+		}
+		++m_p;
+
+		if (!(child ? parse_value(depth + 1, child) : skip_value())) {
+			return false;
+		}
+
+		if (done()) {
+			return true;
+		}
+
+		skip_whitespace();
+		if (m_p >= m_end) {
+			return false;
+		}
+
+		if (*m_p == '}') {
+			++m_p;
+			return true;
+		}
+
+		if (*m_p != ',') {
+			return false;
+		}
+		++m_p;
+	}
+}
+
+bool JsonFieldSet::Parser::parse_array(const size_t depth, const uint64_t alive)
+{
+	++m_p;
+	skip_whitespace();
+	if (m_p < m_end && *m_p == ']') {
+		++m_p;
+		return true;
+	}
+
+	for (int32_t index = 0; ; ++index) {
+		uint64_t child = 0;
+		for (size_t i = 0; i < m_set.m_paths.size(); ++i) {
+			if ((alive & (1ULL << i)) && m_set.m_paths[i][depth].index == index) {
+				child |= 1ULL << i;
+			}
+		}
+
+		if (!(child ? parse_value(depth + 1, child) : skip_value())) {
+			return false;
+		}
+
+		if (done()) {
+			return true;
+		}
+
+		skip_whitespace();
+		if (m_p >= m_end) {
+			return false;
+		}
+
+		if (*m_p == ']') {
+			++m_p;
+			return true;
+		}
+
+		if (*m_p != ',') {
+			return false;
+		}
+		++m_p;
+	}
+}
+
+bool JsonFieldSet::Parser::capture(const uint64_t paths)
+{
+	size_t first = 0;
+	while (!(paths & (1ULL << first))) {
+		++first;
+	}
+
+	JsonFields::Field &field = m_fields.m_fields[first];
+	const char *start = m_p;
+	switch (*m_p) {
+		case '"':
+			if (!read_string(field.value)) {
+				return false;
+			}
+			field.type = JSON_FIELD_STRING;
+			break;
+		case '{':
+		case '[':
+			if (!skip_container()) {
+				return false;
+			}
+			field.value.assign(start, m_p);
+			field.type = JSON_FIELD_RAW;
+			break;
+		default:
+			if (!skip_literal()) {
+				return false;
+			}
+
+			if (m_p - start == 4 && memcmp(start, "null", 4) == 0) {
+				field.type = JSON_FIELD_NULL;
+				break;
+			}
+
+			field.value.assign(start, m_p);
+			if (field.value == "true" || field.value == "false") {
+				field.type = JSON_FIELD_BOOL;
+			} else if (*start == '-' || (*start >= '0' && *start <= '9')) {
+				field.type = JSON_FIELD_NUMBER;
+			} else {
+				return false;
+			}
+			break;
+	}
+
+	// The same path declared twice gets the same value
+	for (size_t i = first + 1; i < m_set.m_paths.size(); ++i) {
+		if (paths & (1ULL << i)) {
+			m_fields.m_fields[i] = field;
+		}
+	}
+
+	m_remaining &= ~paths;
+	return true;
+}
+
+bool JsonFieldSet::Parser::skip_value()
+{
+	skip_whitespace();
+	if (m_p >= m_end) {
+		return false;
+	}
+
+	switch (*m_p) {
+		case '"': {
+			bool escaped = false;
+			return skip_string(escaped);
+		}
+		case '{':
+		case '[':
+			return skip_container();
+		default:
+			return skip_literal();
+	}
+}
+
+bool JsonFieldSet::Parser::skip_container()
+{
+	uint32_t level = 0;
+	while (true) {
+		m_p = find_structural(m_p, m_end);
+		if (m_p >= m_end) {
+			return false;
+		}
+
+		switch (*m_p) {
+			case '"': {
+				bool escaped = false;
+				if (!skip_string(escaped)) {
+					return false;
+				}
+				break;
+			}
+			case '{':
+			case '[':
+				++level;
+				++m_p;
+				break;
+			default:
+				++m_p;
+				if (--level == 0) {
+					return true;
+				}
+				break;
+		}
+	}
+}
+
+bool JsonFieldSet::Parser::skip_literal()
+{
+	// Numbers, true, false or null
+	const char *start = m_p;
+	if (m_p >= m_end || *m_p == '\0' || !strchr("-0123456789tfn", *m_p)) {
+		return false;
+	}
+
+	while (m_p < m_end && !is_delimiter(*m_p)) {
+		++m_p;
+	}
+	return m_p != start;
+}
+
+bool JsonFieldSet::Parser::skip_string(bool &escaped)
+{
+	++m_p;
+	while (true) {
+		m_p = find_string_special(m_p, m_end);
+		if (m_p >= m_end) {
+			return false;
+		}
+
+		if (*m_p == '"') {
+			++m_p;
+			return true;
+		}
+
+		escaped = true;
+		m_p += 2;
+	}
+}
+
+bool JsonFieldSet::Parser::read_string(std::string &out)
+{
+	out.clear();
+	++m_p;
+	while (true) {
+		const char *special = find_string_special(m_p, m_end);
+		out.append(m_p, special);
+		m_p = special;
+		if (m_p >= m_end) {
+			return false;
+		}
+
+		if (*m_p == '"') {
+			++m_p;
+			return true;
+		}
+
+		if (m_end - m_p < 2) {
+			return false;
+		}
+
+		const char c = m_p[1];
+		m_p += 2;
+		switch (c) {
+			case '"': out += '"'; break;
+			case '\\': out += '\\'; break;
+			case '/': out += '/'; break;
+			case 'b': out += '\b'; break;
+			case 'f': out += '\f'; break;
+			case 'n': out += '\n'; break;
+			case 'r': out += '\r'; break;
+			case 't': out += '\t'; break;
+			case 'u': {
+				uint32_t code_point = 0;
+				for (uint8_t pair = 0; pair < 2; ++pair) {
+					if (m_end - m_p < 4) {
+						return false;
+					}
+
+					uint32_t unit = 0;
+					for (uint8_t i = 0; i < 4; ++i) {
+						const char h = m_p[i];
+						unit <<= 4;
+						if (h >= '0' && h <= '9') {
+							unit |= (uint32_t) (h - '0');
+						} else if (h >= 'a' && h <= 'f') {
+							unit |= (uint32_t) (h - 'a' + 10);
+						} else if (h >= 'A' && h <= 'F') {
+							unit |= (uint32_t) (h - 'A' + 10);
+						} else {
+							return false;
+						}
+					}
+					m_p += 4;
+
+					if (pair == 1) {
+						if (unit < 0xDC00 || unit > 0xDFFF) {
+							return false;
+						}
+						code_point = 0x10000 + ((code_point - 0xD800) << 10) + (unit - 0xDC00);
+						break;
+					}
+
+					code_point = unit;
+					// High surrogate, the low one follows as another \u escape
+					if (unit < 0xD800 || unit > 0xDBFF) {
+						break;
+					}
+
+					if (m_end - m_p < 2 || m_p[0] != '\\' || m_p[1] != 'u') {
+						return false;
+					}
+					m_p += 2;
+				}
+				append_utf8(out, code_point);
+				break;
+			}
+			default:
+				return false;
+		}
+	}
+}
+
+JsonFieldSet::JsonFieldSet(std::initializer_list<const char *> paths)
+{
+	for (const char *path: paths) {
+		if (m_paths.size() == JSON_FIELDS_MAX_PATHS) {
+			break;
+		}
+
+		// "data[0].text" gives the segments data, 0 and text
+		std::vector<Segment> segments;
+		const char *p = path;
+		while (*p) {
+			Segment segment;
+			if (*p == '[') {
+				segment.index = (int32_t) strtol(p + 1, nullptr, 10);
+				p = strchr(p, ']');
+				p = p ? p + 1 : path + strlen(path);
+			} else {
+				const char *end = p + strcspn(p, ".[");
+				segment.key.assign(p, end);
+				p = end;
+			}
+
+			if (*p == '.') {
+				++p;
+			}
+			segments.push_back(segment);
+		}
+
+		m_all_paths |= 1ULL << m_paths.size();
+		m_paths.push_back(segments);
+	}
+}
+
+bool JsonFieldSet::extract(const std::string &document, JsonFields &fields) const
+{
+	return extract(document.data(), document.size(), fields);
+}
+
+bool JsonFieldSet::extract(const char *data, const size_t length, JsonFields &fields) const
+{
+	fields.reset(m_paths.size());
+	if (m_paths.empty()) {
+		return true;
+	}
+
+	Parser parser(*this, data, length, fields);
+	return parser.parse_value(0, m_all_paths) || parser.done();
+}
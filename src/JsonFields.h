@@ -0,0 +1,113 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+// Paths of a field set are tracked in a 64 bits mask
+#define JSON_FIELDS_MAX_PATHS 64
+
+enum JsonFieldType : uint8_t
+{
+	JSON_FIELD_MISSING,
+	JSON_FIELD_NULL,
+	JSON_FIELD_STRING,
+	JSON_FIELD_NUMBER,
+	JSON_FIELD_BOOL,
+	// Object or array, the value holds its raw text
+	JSON_FIELD_RAW,
+};
+
+/**
+ * Values extracted by a JsonFieldSet, in the order of its paths.
+ *
+ * Strings are unescaped, numbers and booleans keep their JSON text. Missing
+ * fields read as an empty string or 0, as jsoncpp does for null members.
+ */
+class JsonFields
+{
+public:
+	bool has(const size_t index) const { return m_fields[index].type != JSON_FIELD_MISSING; }
+	JsonFieldType get_type(const size_t index) const { return m_fields[index].type; }
+
+	const std::string &as_string(const size_t index) const { return m_fields[index].value; }
+	double as_double(const size_t index) const;
+	uint64_t as_uint(const size_t index) const;
+	bool as_bool(const size_t index) const;
+
+private:
+	friend class JsonFieldSet;
+
+	struct Field
+	{
+		std::string value = "";
+		JsonFieldType type = JSON_FIELD_MISSING;
+	};
+
+	// Keeps the string capacities when the object is reused
+	void reset(const size_t count);
+
+	std::vector<Field> m_fields = {};
+};
+
+/**
+ * Set of JSON paths a command needs from an upstream answer, such as
+ * "main.temp" or "data[0].text", built once at startup.
+ *
+ * extract() scans the document on demand instead of building a DOM: members
+ * and elements outside the paths are skipped without being decoded, using
+ * SSE2 to jump over strings and nested containers, and the scan stops as soon
+ * as every path was found. Skipped parts are not validated.
+ *
+ * Paths must not be prefixes of each other.
+ */
+class JsonFieldSet
+{
+public:
+	JsonFieldSet(std::initializer_list<const char *> paths);
+
+	size_t size() const { return m_paths.size(); }
+
+	// @return false when the document is malformed before every field was found
+	bool extract(const std::string &document, JsonFields &fields) const;
+	bool extract(const char *data, const size_t length, JsonFields &fields) const;
+
+private:
+	struct Segment
+	{
+		std::string key = "";
+		// Array index, or -1 for an object member
+		int32_t index = -1;
+	};
+
+	class Parser;
+
+	std::vector<std::vector<Segment>> m_paths = {};
+	uint64_t m_all_paths = 0;
+};
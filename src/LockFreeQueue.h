@@ -0,0 +1,133 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+/**
+ * Bounded lock-free multi-producer/multi-consumer queue (Dmitry Vyukov's
+ * sequence based ring). Capacity is rounded up to a power of two.
+ */
+template<typename T>
+class LockFreeQueue
+{
+public:
+	LockFreeQueue(size_t capacity) : m_enqueue_pos(0), m_dequeue_pos(0)
+	{
+		size_t size = 2;
+		while (size < capacity) {
+			size <<= 1;
+		}
+
+		m_mask = size - 1;
+		m_cells.reset(new Cell[size]);
+		for (size_t i = 0; i < size; ++i) {
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	template<typename U>
+	bool try_push(U &&value)
+	{
+		Cell *cell = nullptr;
+		size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &m_cells[pos & m_mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+			if (diff == 0) {
+				if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				// Full
+				return false;
+			} else {
+				pos = m_enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data = std::forward<U>(value);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool try_pop(T &value)
+	{
+		Cell *cell = nullptr;
+		size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		while (true) {
+			cell = &m_cells[pos & m_mask];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+			if (diff == 0) {
+				if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				// Empty
+				return false;
+			} else {
+				pos = m_dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+
+		value = std::move(cell->data);
+		cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t size_approx() const
+	{
+		size_t enqueue_pos = m_enqueue_pos.load(std::memory_order_relaxed);
+		size_t dequeue_pos = m_dequeue_pos.load(std::memory_order_relaxed);
+		return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+	}
+
+	size_t capacity() const { return m_mask + 1; }
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> m_cells;
+	size_t m_mask = 0;
+
+	// Keep producer and consumer positions on separate cache lines. Padding
+	// instead of alignas, C++14 operator new ignores extended alignment.
+	char m_pad0[64];
+	std::atomic<size_t> m_enqueue_pos;
+	char m_pad1[64 - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> m_dequeue_pos;
+	char m_pad2[64 - sizeof(std::atomic<size_t>)];
+};
@@ -0,0 +1,265 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <log4cplus/configurator.h>
+#include <log4cplus/logger.h>
+#include "Log.h"
+#include "Config.h"
+#include "LockFreeQueue.h"
+#include "Metrics.h"
+
+// Secrets shorter than this are not redacted, they would mangle every message
+#define LOG_MIN_SECRET_SIZE 4
+#define LOG_IDLE_WAKEUP std::chrono::milliseconds(100)
+
+std::atomic<bool> Log::s_running(false);
+std::atomic<uint8_t> Log::s_min_level(LOG_LEVEL_INFO);
+std::atomic<uint64_t> Log::s_dropped(0);
+
+static LockFreeQueue<LogRecord> s_queue(LOG_QUEUE_SIZE);
+static std::thread s_thread;
+// Only wakes the writer up early, it also polls the queue
+static std::mutex s_wakeup_mutex;
+static std::condition_variable s_wakeup_cv;
+static std::atomic<bool> s_sleeping(false);
+
+static std::mutex s_secrets_mutex;
+// Secrets of the current and the previous configuration
+static std::vector<std::string> s_secrets = {};
+static std::vector<std::string> s_config_secrets = {};
+
+static const char *s_level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+static const log4cplus::LogLevel s_log4cplus_levels[] = {
+		log4cplus::DEBUG_LOG_LEVEL,
+		log4cplus::INFO_LOG_LEVEL,
+		log4cplus::WARN_LOG_LEVEL,
+		log4cplus::ERROR_LOG_LEVEL,
+};
+
+void Log::start(const Config *cfg)
+{
+	if (s_running) {
+		return;
+	}
+
+	log4cplus::initialize();
+	log4cplus::PropertyConfigurator::doConfigure(LOG4CPLUS_STRING_TO_TSTRING(cfg->get_log_config_file()));
+	log4cplus::Logger root = log4cplus::Logger::getRoot();
+	if (root.getAllAppenders().empty()) {
+		log4cplus::BasicConfigurator::doConfigure();
+	}
+
+	// Records below every configured logger level are not even queued
+	log4cplus::LogLevel min_level = root.getChainedLogLevel();
+	for (const log4cplus::Logger &logger: log4cplus::Logger::getCurrentLoggers()) {
+		min_level = std::min(min_level, logger.getChainedLogLevel());
+	}
+
+	uint8_t level = LOG_LEVEL_ERROR;
+	while (level > LOG_LEVEL_DEBUG && s_log4cplus_levels[level - 1] >= min_level) {
+		level--;
+	}
+	s_min_level = level;
+
+	set_secrets(cfg);
+	Metrics::register_callback("bot_log_dropped_total", "", "Log records dropped because the log queue was full",
+			"counter", [] { return (double) s_dropped; });
+
+	s_running = true;
+	s_thread = std::thread(&Log::run);
+}
+
+void Log::stop()
+{
+	if (!s_running.exchange(false)) {
+		return;
+	}
+
+	s_wakeup_cv.notify_one();
+	if (s_thread.joinable()) {
+		s_thread.join();
+	}
+
+	// Records pushed while the writer was exiting
+	LogRecord record;
+	while (s_queue.try_pop(record)) {
+		output(record);
+	}
+}
+
+void Log::set_secrets(const Config *cfg)
+{
+	const std::string *config_secrets[] = {
+			&cfg->get_irc_password(),
+			&cfg->get_openweathermap_api_key(),
+			&cfg->get_gitlab_api_key(),
+			&cfg->get_gitlab_webhook_token(),
+			&cfg->getTwitter_consumer_key(),
+			&cfg->getTwitter_consumer_secret(),
+			&cfg->getTwitter_access_token(),
+			&cfg->getTwitter_access_token_secret(),
+	};
+
+	std::vector<std::string> secrets;
+	const auto add_secret = [] (std::vector<std::string> &list, const std::string &secret) {
+		if (secret.size() >= LOG_MIN_SECRET_SIZE &&
+				std::find(list.begin(), list.end(), secret) == list.end()) {
+			list.push_back(secret);
+		}
+	};
+
+	for (const std::string *secret: config_secrets) {
+		add_secret(secrets, *secret);
+	}
+
+	for (const auto &server_config: cfg->get_irc_server_configs()) {
+		add_secret(secrets, server_config->password);
+	}
+
+	std::unique_lock<std::mutex> lock(s_secrets_mutex);
+	s_secrets = secrets;
+	for (const std::string &secret: s_config_secrets) {
+		add_secret(s_secrets, secret);
+	}
+	s_config_secrets.swap(secrets);
+}
+
+void Log::write(const LogRecord &record)
+{
+	if (!s_running) {
+		std::cerr << s_level_names[record.level] << " " << record.logger << ": " << format(record) << std::endl;
+		return;
+	}
+
+	if (!s_queue.try_push(record)) {
+		s_dropped++;
+		return;
+	}
+
+	if (s_sleeping.load(std::memory_order_relaxed)) {
+		s_wakeup_cv.notify_one();
+	}
+}
+
+void Log::run()
+{
+	LogRecord record;
+	while (s_running) {
+		while (s_queue.try_pop(record)) {
+			output(record);
+		}
+
+		std::unique_lock<std::mutex> lock(s_wakeup_mutex);
+		s_sleeping = true;
+		s_wakeup_cv.wait_for(lock, LOG_IDLE_WAKEUP);
+		s_sleeping = false;
+	}
+
+	while (s_queue.try_pop(record)) {
+		output(record);
+	}
+}
+
+std::string Log::format(const LogRecord &record)
+{
+	std::string message(record.message, record.length);
+	redact(message, record.truncated);
+	if (record.truncated) {
+		message += "...";
+	}
+	return message;
+}
+
+void Log::output(const LogRecord &record)
+{
+	// Only the writer thread touches the cache, and stop() once it exited
+	static std::unordered_map<const char *, log4cplus::Logger> loggers = {};
+	auto it = loggers.find(record.logger);
+	if (it == loggers.end()) {
+		it = loggers.emplace(record.logger,
+				log4cplus::Logger::getInstance(LOG4CPLUS_C_STR_TO_TSTRING(record.logger))).first;
+	}
+
+	it->second.log(s_log4cplus_levels[record.level], LOG4CPLUS_STRING_TO_TSTRING(format(record)));
+}
+
+void Log::redact(std::string &message, const bool truncated)
+{
+	std::unique_lock<std::mutex> lock(s_secrets_mutex);
+	for (const std::string &secret: s_secrets) {
+		size_t pos = 0;
+		while ((pos = message.find(secret, pos)) != std::string::npos) {
+			message.replace(pos, secret.size(), "***");
+			pos += 3;
+		}
+	}
+
+	if (!truncated) {
+		return;
+	}
+
+	// A secret cut by the truncation would leak as the end of the message
+	size_t leaked = 0;
+	for (const std::string &secret: s_secrets) {
+		for (size_t size = std::min(secret.size() - 1, message.size()); size > leaked; --size) {
+			if (message.compare(message.size() - size, size, secret, 0, size) == 0) {
+				leaked = size;
+				break;
+			}
+		}
+	}
+
+	if (leaked) {
+		message.replace(message.size() - leaked, leaked, "***");
+	}
+}
+
+LogMessage::LogMessage(const LogLevel level, const char *logger) : m_stream(this)
+{
+	m_record.logger = logger;
+	m_record.level = level;
+	setp(m_record.message, m_record.message + LOG_MESSAGE_SIZE);
+}
+
+LogMessage::~LogMessage()
+{
+	m_record.length = (uint16_t) (pptr() - pbase());
+	Log::write(m_record);
+}
+
+LogMessage::int_type LogMessage::overflow(int_type c)
+{
+	// The buffer is full, the rest of the message is dropped
+	m_record.truncated = true;
+	return traits_type::eof();
+}
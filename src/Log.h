@@ -0,0 +1,129 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <streambuf>
+#include <string>
+
+class Config;
+
+// Longer messages are truncated
+#define LOG_MESSAGE_SIZE 240
+#define LOG_QUEUE_SIZE 4096
+
+enum LogLevel : uint8_t
+{
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_ERROR,
+};
+
+// Fixed-size entry copied into the log queue
+struct LogRecord
+{
+	// log4cplus logger name, a string literal
+	const char *logger = nullptr;
+	LogLevel level = LOG_LEVEL_INFO;
+	bool truncated = false;
+	uint16_t length = 0;
+	char message[LOG_MESSAGE_SIZE];
+};
+
+/**
+ * Asynchronous logging through log4cplus, configured by log_config.
+ *
+ * Callers only write their message into a fixed-size record and push it to
+ * a lock-free ring. A background thread redacts secrets, then hands records
+ * to log4cplus which formats and writes them. Logging never blocks nor
+ * allocates on the calling thread: records are dropped when the ring is
+ * full, and counted in bot_log_dropped_total.
+ *
+ * Before start() and after stop(), records are written to stderr directly,
+ * so configuration errors are still reported.
+ */
+class Log
+{
+public:
+	static void start(const Config *cfg);
+	static void stop();
+
+	// Registers the credentials of cfg, they are replaced by *** in every record. Those
+	// of the previous cfg stay redacted until the next call, for the records still queued
+	static void set_secrets(const Config *cfg);
+
+	static bool is_enabled(const LogLevel level)
+	{
+		return level >= s_min_level.load(std::memory_order_relaxed);
+	}
+
+	static void write(const LogRecord &record);
+	static uint64_t get_dropped() { return s_dropped; }
+
+private:
+	static void run();
+	static void output(const LogRecord &record);
+	static std::string format(const LogRecord &record);
+	static void redact(std::string &message, const bool truncated);
+
+	static std::atomic<bool> s_running;
+	static std::atomic<uint8_t> s_min_level;
+	static std::atomic<uint64_t> s_dropped;
+};
+
+/**
+ * Builds one record on the stack through an std::ostream, see the LOG_* macros
+ */
+class LogMessage : private std::streambuf
+{
+public:
+	LogMessage(const LogLevel level, const char *logger);
+	~LogMessage();
+
+	std::ostream &stream() { return m_stream; }
+
+private:
+	int_type overflow(int_type c) override;
+
+	LogRecord m_record;
+	std::ostream m_stream;
+};
+
+#define LOG(level, logger, message) \
+	do { \
+		if (Log::is_enabled(level)) { \
+			LogMessage log_message(level, logger); \
+			log_message.stream() << message; \
+		} \
+	} while (0)
+
+#define LOG_DEBUG(logger, message) LOG(LOG_LEVEL_DEBUG, logger, message)
+#define LOG_INFO(logger, message) LOG(LOG_LEVEL_INFO, logger, message)
+#define LOG_WARN(logger, message) LOG(LOG_LEVEL_WARN, logger, message)
+#define LOG_ERROR(logger, message) LOG(LOG_LEVEL_ERROR, logger, message)
@@ -23,30 +23,261 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <iterator>
 #include "Mail.h"
+#include "MailLog.h"
+#include "Config.h"
+#include "Log.h"
 
-std::unordered_map<std::string, std::string> Mail::s_mails = {};
+Mail::Shard Mail::s_shards[MAIL_SHARD_COUNT];
+std::atomic<size_t> Mail::s_total_size(0);
+std::atomic<uint32_t> Mail::s_max_per_recipient(10);
+std::atomic<uint32_t> Mail::s_max_recipient_size(4 * 1024);
+std::atomic<uint32_t> Mail::s_max_total_size(1024 * 1024);
+MailLog *Mail::s_log = nullptr;
 
-Mail::~Mail()
+size_t Mail::NickHash::operator()(const std::string &nick) const
 {
-	s_mails.clear();
+	// FNV-1a on the lower case nick
+	size_t hash = 2166136261u;
+	for (const char c: nick) {
+		hash ^= (size_t) (unsigned char) irc_tolower(c);
+		hash *= 16777619u;
+	}
+	return hash;
 }
 
-void Mail::add_mail(const std::string &to, const std::string &from, const std::string &msg)
+bool Mail::NickEqual::operator()(const std::string &a, const std::string &b) const
 {
-	if (s_mails[to] != "") {
-		s_mails[to] += " |||| And message from " + from + " : " + msg;
+	if (a.size() != b.size()) {
+		return false;
+	}
+
+	for (size_t i = 0; i < a.size(); ++i) {
+		if (irc_tolower(a[i]) != irc_tolower(b[i])) {
+			return false;
+		}
 	}
-	else
-		s_mails[to] = "Message from " + from + " : " + msg;
+	return true;
 }
 
-bool Mail::get_mail(const std::string &pseudo, std::string &msg)
+void Mail::configure(const Config *cfg)
+{
+	s_max_per_recipient = cfg->get_mail_max_per_recipient() > 0 ? cfg->get_mail_max_per_recipient() : 1;
+	s_max_recipient_size = cfg->get_mail_max_recipient_size();
+	s_max_total_size = cfg->get_mail_max_total_size();
+}
+
+bool Mail::open_log(const Config *cfg)
 {
-	if (s_mails[pseudo] != "") {
-		msg = s_mails[pseudo];
-		s_mails.erase(pseudo);
+	if (cfg->get_mail_log_directory().empty()) {
+		LOG_INFO("mail", "Mail log disabled, pending mail is lost on restart");
 		return true;
 	}
-	return false;
-}
\ No newline at end of file
+
+	MailLog *log = new MailLog(cfg->get_mail_log_directory(), cfg->get_mail_compact_size());
+
+	// Replayed mail was accepted before, don't apply the quotas again
+	const bool opened = log->open([](MailRecordType type, const std::string &to, MailMessage &message) {
+		Shard &shard = get_shard(to);
+		auto it = shard.mailboxes.find(to);
+		if (type == MAIL_RECORD_DELIVER) {
+			if (it != shard.mailboxes.end()) {
+				s_total_size -= it->second.size;
+				shard.mailboxes.erase(it);
+				get_mailbox_count(to)--;
+			}
+			return;
+		}
+
+		if (it == shard.mailboxes.end()) {
+			it = shard.mailboxes.emplace(to, Mailbox()).first;
+			get_mailbox_count(to)++;
+		}
+
+		const size_t size = message.from.size() + message.text.size();
+		it->second.messages.push_back(std::move(message));
+		it->second.size += size;
+		s_total_size += size;
+	});
+
+	if (!opened) {
+		delete log;
+		return false;
+	}
+
+	LOG_INFO("mail", "Mail log loaded, " << s_total_size << " bytes of pending mail");
+	log->start(&Mail::write_snapshot);
+	s_log = log;
+	return true;
+}
+
+void Mail::close_log()
+{
+	// Called once nothing sends or receives mail anymore
+	delete s_log;
+	s_log = nullptr;
+}
+
+void Mail::write_snapshot(std::string &snapshot)
+{
+	// Freeze the whole store so the snapshot matches the log rotation point
+	std::unique_lock<std::mutex> locks[MAIL_SHARD_COUNT];
+	for (size_t i = 0; i < MAIL_SHARD_COUNT; ++i) {
+		locks[i] = std::unique_lock<std::mutex>(s_shards[i].mutex);
+	}
+
+	s_log->rotate();
+
+	for (const auto &shard: s_shards) {
+		for (const auto &mailbox: shard.mailboxes) {
+			for (const auto &message: mailbox.second.messages) {
+				MailLog::encode_add(snapshot, mailbox.first, message);
+			}
+		}
+	}
+}
+
+Mail::Shard &Mail::get_shard(const std::string &pseudo)
+{
+	return s_shards[NickHash()(pseudo) % MAIL_SHARD_COUNT];
+}
+
+std::atomic<uint32_t> &Mail::get_mailbox_count(const std::string &pseudo)
+{
+	// Hash bits the shard index did not use
+	const size_t hash = NickHash()(pseudo);
+	Shard &shard = s_shards[hash % MAIL_SHARD_COUNT];
+	return shard.mailbox_counts[(hash / MAIL_SHARD_COUNT) % MAIL_MAILBOX_COUNT_SLOTS];
+}
+
+bool Mail::reserve(size_t size)
+{
+	size_t total = s_total_size;
+	do {
+		if (total + size > s_max_total_size) {
+			return false;
+		}
+	} while (!s_total_size.compare_exchange_weak(total, total + size));
+
+	return true;
+}
+
+MailStatus Mail::add_mail(const std::string &to, const std::string &from, const std::string &msg)
+{
+	const size_t size = from.size() + msg.size();
+	if (size > s_max_recipient_size) {
+		return MAIL_RECIPIENT_FULL;
+	}
+
+	Shard &shard = get_shard(to);
+	std::unique_lock<std::mutex> lock(shard.mutex);
+	uint64_t lsn = 0;
+
+	auto it = shard.mailboxes.find(to);
+	if (it != shard.mailboxes.end() && (it->second.messages.size() >= s_max_per_recipient ||
+			it->second.size + size > s_max_recipient_size)) {
+		return MAIL_RECIPIENT_FULL;
+	}
+
+	if (!reserve(size)) {
+		return MAIL_STORE_FULL;
+	}
+
+	if (it == shard.mailboxes.end()) {
+		it = shard.mailboxes.emplace(to, Mailbox()).first;
+		get_mailbox_count(to)++;
+	}
+
+	MailMessage message;
+	message.from = from;
+	message.text = msg;
+	message.sent_at = std::chrono::system_clock::now();
+	const auto sent_at = message.sent_at;
+	if (s_log) {
+		lsn = s_log->append_add(to, message);
+	}
+	it->second.messages.push_back(std::move(message));
+	it->second.size += size;
+	lock.unlock();
+
+	// Answer once the mail is on disk, concurrent senders share the same sync
+	if (!lsn || s_log->wait_durable(lsn)) {
+		return MAIL_OK;
+	}
+
+	// Not on disk: take the mail back unless it was delivered meanwhile
+	lock.lock();
+	it = shard.mailboxes.find(to);
+	if (it == shard.mailboxes.end()) {
+		return MAIL_OK;
+	}
+
+	auto &messages = it->second.messages;
+	for (auto msg_it = messages.rbegin(); msg_it != messages.rend(); ++msg_it) {
+		if (msg_it->sent_at == sent_at && msg_it->from == from && msg_it->text == msg) {
+			messages.erase(std::next(msg_it).base());
+			it->second.size -= size;
+			s_total_size -= size;
+			if (messages.empty()) {
+				shard.mailboxes.erase(it);
+				get_mailbox_count(to)--;
+			}
+			return MAIL_LOG_ERROR;
+		}
+	}
+	return MAIL_OK;
+}
+
+bool Mail::get_mail(const std::string &pseudo, std::vector<MailMessage> &messages)
+{
+	// Most joining users have no mail, don't take the lock for them
+	if (get_mailbox_count(pseudo) == 0) {
+		return false;
+	}
+
+	Shard &shard = get_shard(pseudo);
+	std::unique_lock<std::mutex> lock(shard.mutex);
+	auto it = shard.mailboxes.find(pseudo);
+	if (it == shard.mailboxes.end()) {
+		return false;
+	}
+
+	messages.reserve(messages.size() + it->second.messages.size());
+	for (auto &message: it->second.messages) {
+		messages.push_back(std::move(message));
+	}
+
+	// Not waited for: after a crash, mail may be delivered twice but never lost
+	if (s_log) {
+		s_log->append_deliver(pseudo);
+	}
+
+	s_total_size -= it->second.size;
+	shard.mailboxes.erase(it);
+	get_mailbox_count(pseudo)--;
+	return true;
+}
+
+bool Mail::get_mail(const std::string &pseudo, std::string &msg)
+{
+	std::vector<MailMessage> messages;
+	if (!get_mail(pseudo, messages)) {
+		return false;
+	}
+
+	size_t size = 0;
+	for (const auto &message: messages) {
+		size += message.from.size() + message.text.size() + 32;
+	}
+
+	msg.clear();
+	msg.reserve(size);
+	for (const auto &message: messages) {
+		msg += msg.empty() ? "Message from " : " |||| And message from ";
+		msg += message.from;
+		msg += " : ";
+		msg += message.text;
+	}
+	return true;
+}
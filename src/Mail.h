@@ -25,19 +25,100 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
+#define MAIL_SHARD_COUNT 16
+// Mailbox counters per shard, a nick without mail is told apart without locking
+#define MAIL_MAILBOX_COUNT_SLOTS 256
+
+class Config;
+class MailLog;
+
+struct MailMessage
+{
+	std::string from = "";
+	std::string text = "";
+	std::chrono::system_clock::time_point sent_at = {};
+};
+
+enum MailStatus
+{
+	MAIL_OK,
+	MAIL_RECIPIENT_FULL,
+	MAIL_STORE_FULL,
+	// The mail log could not write it, the mail was dropped
+	MAIL_LOG_ERROR,
+};
+
+/**
+ * Mail waiting for offline users, delivered when they join a channel.
+ *
+ * Recipients are spread over lock-striped shards so command workers and the
+ * IRC thread only contend on the same shard. Each recipient keeps a bounded
+ * queue of messages, and both per-recipient and global sizes are capped.
+ * Nicks are compared with the rfc1459 casemapping, as IRC servers do. When a log directory
+ * is configured, pending mail is journaled by MailLog and survives restarts.
+ */
 class Mail {
 public:
-	Mail() {};
-	~Mail();
+	static void configure(const Config *cfg);
+	static bool open_log(const Config *cfg);
+	static void close_log();
 
-	static void delete_all_mail() { s_mails.clear(); }
-
-	static void add_mail(const std::string &to, const std::string &from, const std::string &msg);
+	static MailStatus add_mail(const std::string &to, const std::string &from, const std::string &msg);
+	static bool get_mail(const std::string &pseudo, std::vector<MailMessage> &messages);
 	static bool get_mail(const std::string &pseudo, std::string &msg);
 
+	static size_t get_total_size() { return s_total_size; }
+
 private:
-	static std::unordered_map<std::string, std::string> s_mails;
+	struct NickHash
+	{
+		size_t operator()(const std::string &nick) const;
+	};
+
+	struct NickEqual
+	{
+		bool operator()(const std::string &a, const std::string &b) const;
+	};
+
+	struct Mailbox
+	{
+		std::deque<MailMessage> messages = {};
+		size_t size = 0;
+	};
+
+	struct Shard
+	{
+		std::mutex mutex;
+		std::unordered_map<std::string, Mailbox, NickHash, NickEqual> mailboxes;
+		// Mailboxes per hash slot, only changed with mutex held. Lookups for
+		// nicks without mail find their slot empty and skip the lock
+		std::atomic<uint32_t> mailbox_counts[MAIL_MAILBOX_COUNT_SLOTS];
+
+		Shard()
+		{
+			for (auto &count: mailbox_counts) {
+				count = 0;
+			}
+		}
+	};
+
+	static Shard &get_shard(const std::string &pseudo);
+	static std::atomic<uint32_t> &get_mailbox_count(const std::string &pseudo);
+	static bool reserve(size_t size);
+	static void write_snapshot(std::string &snapshot);
+
+	static Shard s_shards[MAIL_SHARD_COUNT];
+	static std::atomic<size_t> s_total_size;
+	static std::atomic<uint32_t> s_max_per_recipient;
+	static std::atomic<uint32_t> s_max_recipient_size;
+	static std::atomic<uint32_t> s_max_total_size;
+	static MailLog *s_log;
 };
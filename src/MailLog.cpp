@@ -0,0 +1,517 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "MailLog.h"
+#include "Log.h"
+
+#define MAIL_SNAPSHOT_MAGIC "BOTMAIL1"
+#define MAIL_SNAPSHOT_HEADER_SIZE 16
+// Record header: payload length and CRC32 of the payload
+#define MAIL_RECORD_HEADER_SIZE 8
+#define MAIL_LOG_FAILED_BATCHES 64
+
+static uint32_t crc32(const char *data, size_t size)
+{
+	static const std::vector<uint32_t> table = [] {
+		std::vector<uint32_t> t(256);
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) {
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			t[i] = c;
+		}
+		return t;
+	}();
+
+	uint32_t crc = 0xFFFFFFFFu;
+	for (size_t i = 0; i < size; ++i) {
+		crc = table[(crc ^ (uint8_t) data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return crc ^ 0xFFFFFFFFu;
+}
+
+template<typename T>
+static void put(std::string &buffer, T value)
+{
+	buffer.append((const char *) &value, sizeof(T));
+}
+
+template<typename T>
+static bool get(const char *&p, const char *end, T &value)
+{
+	if ((size_t) (end - p) < sizeof(T)) {
+		return false;
+	}
+
+	memcpy(&value, p, sizeof(T));
+	p += sizeof(T);
+	return true;
+}
+
+template<typename L>
+static void put_string(std::string &buffer, const std::string &str)
+{
+	put<L>(buffer, (L) std::min(str.size(), (size_t) std::numeric_limits<L>::max()));
+	buffer.append(str, 0, std::numeric_limits<L>::max());
+}
+
+template<typename L>
+static bool get_string(const char *&p, const char *end, std::string &str)
+{
+	L length;
+	if (!get(p, end, length) || (size_t) (end - p) < length) {
+		return false;
+	}
+
+	str.assign(p, length);
+	p += length;
+	return true;
+}
+
+static size_t begin_record(std::string &buffer, MailRecordType type)
+{
+	const size_t start = buffer.size();
+	buffer.append(MAIL_RECORD_HEADER_SIZE, '\0');
+	put<uint8_t>(buffer, type);
+	return start;
+}
+
+static void end_record(std::string &buffer, size_t start)
+{
+	const size_t payload = start + MAIL_RECORD_HEADER_SIZE;
+	const uint32_t length = (uint32_t) (buffer.size() - payload);
+	const uint32_t crc = crc32(&buffer[payload], length);
+	memcpy(&buffer[start], &length, sizeof(length));
+	memcpy(&buffer[start + sizeof(length)], &crc, sizeof(crc));
+}
+
+/**
+ * Replays every valid record, returns the length of the valid prefix
+ */
+static size_t replay_records(const char *data, size_t size, const MailLog::ReplayCallback &replay)
+{
+	const char *p = data;
+	const char *end = data + size;
+
+	while (p < end) {
+		const char *record = p;
+		uint32_t length, crc;
+		if (!get(p, end, length) || !get(p, end, crc) || (size_t) (end - p) < length ||
+				crc32(p, length) != crc) {
+			return record - data;
+		}
+
+		const char *payload_end = p + length;
+		uint8_t type;
+		std::string to;
+		MailMessage message;
+		if (!get(p, payload_end, type) || !get_string<uint16_t>(p, payload_end, to)) {
+			return record - data;
+		}
+
+		if (type == MAIL_RECORD_ADD) {
+			int64_t sent_at;
+			if (!get(p, payload_end, sent_at) ||
+					!get_string<uint16_t>(p, payload_end, message.from) ||
+					!get_string<uint32_t>(p, payload_end, message.text)) {
+				return record - data;
+			}
+			message.sent_at = std::chrono::system_clock::time_point(std::chrono::milliseconds(sent_at));
+		}
+
+		replay((MailRecordType) type, to, message);
+		p = payload_end;
+	}
+
+	return size;
+}
+
+/**
+ * Maps a whole file read-only, returns false if it doesn't exist or is empty
+ */
+static bool map_file(const std::string &path, const char *&data, size_t &size)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+
+	madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+	data = (const char *) map;
+	size = (size_t) st.st_size;
+	return true;
+}
+
+static bool write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t written = write(fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		data += written;
+		size -= (size_t) written;
+	}
+	return true;
+}
+
+MailLog::MailLog(const std::string &directory, uint64_t compact_size) :
+		m_directory(directory), m_compact_size(compact_size > 0 ? compact_size : 1)
+{
+	m_compact_threshold = m_compact_size;
+}
+
+MailLog::~MailLog()
+{
+	stop();
+
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+}
+
+std::string MailLog::get_log_path(uint64_t generation) const
+{
+	return m_directory + "/mail." + std::to_string(generation) + ".log";
+}
+
+bool MailLog::open(const ReplayCallback &replay)
+{
+	if (mkdir(m_directory.c_str(), 0750) != 0 && errno != EEXIST) {
+		LOG_ERROR("mail", "Unable to create mail directory " << m_directory << ": " << strerror(errno));
+		return false;
+	}
+
+	uint64_t snapshot_generation = 0;
+	const char *data = nullptr;
+	size_t size = 0;
+	if (map_file(m_directory + "/mail.snapshot", data, size)) {
+		if (size >= MAIL_SNAPSHOT_HEADER_SIZE && memcmp(data, MAIL_SNAPSHOT_MAGIC, 8) == 0) {
+			memcpy(&snapshot_generation, data + 8, sizeof(snapshot_generation));
+			replay_records(data + MAIL_SNAPSHOT_HEADER_SIZE, size - MAIL_SNAPSHOT_HEADER_SIZE, replay);
+		} else {
+			LOG_WARN("mail", "Ignoring invalid mail snapshot in " << m_directory);
+		}
+		munmap((void *) data, size);
+	}
+
+	std::vector<uint64_t> generations;
+	if (DIR *dir = opendir(m_directory.c_str())) {
+		while (struct dirent *entry = readdir(dir)) {
+			unsigned long long generation;
+			char suffix[8];
+			if (sscanf(entry->d_name, "mail.%llu.%7s", &generation, suffix) == 2 &&
+					strcmp(suffix, "log") == 0) {
+				generations.push_back(generation);
+			}
+		}
+		closedir(dir);
+	}
+	std::sort(generations.begin(), generations.end());
+
+	m_generation = std::max<uint64_t>(snapshot_generation, 1);
+	for (const uint64_t generation: generations) {
+		const std::string path = get_log_path(generation);
+
+		// Already part of the snapshot, compaction stopped before removing it
+		if (generation < snapshot_generation) {
+			unlink(path.c_str());
+			continue;
+		}
+
+		if (map_file(path, data, size)) {
+			const size_t valid = replay_records(data, size, replay);
+			munmap((void *) data, size);
+
+			// Drop a record torn by a crash, new records go after the last valid one
+			if (valid < size) {
+				LOG_WARN("mail", "Truncating mail log " << path << " to " << valid << " bytes");
+				if (truncate(path.c_str(), (off_t) valid) != 0) {
+					LOG_ERROR("mail", "Unable to truncate " << path << ": " << strerror(errno));
+				}
+			}
+		}
+
+		m_generation = std::max(m_generation, generation);
+	}
+
+	return open_log_file(m_generation);
+}
+
+bool MailLog::open_log_file(uint64_t generation)
+{
+	const std::string path = get_log_path(generation);
+	m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+	if (m_fd < 0) {
+		LOG_ERROR("mail", "Unable to open mail log " << path << ": " << strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+	m_log_size = fstat(m_fd, &st) == 0 ? (uint64_t) st.st_size : 0;
+	return true;
+}
+
+void MailLog::start(const SnapshotCallback &snapshot)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_running) {
+		return;
+	}
+
+	m_snapshot = snapshot;
+	m_running = true;
+	m_thread = std::thread([this] { run(); });
+}
+
+void MailLog::stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_running = false;
+	}
+	m_cv.notify_all();
+
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+void MailLog::encode_add(std::string &buffer, const std::string &to, const MailMessage &message)
+{
+	const size_t start = begin_record(buffer, MAIL_RECORD_ADD);
+	put_string<uint16_t>(buffer, to);
+	put<int64_t>(buffer, std::chrono::duration_cast<std::chrono::milliseconds>(
+			message.sent_at.time_since_epoch()).count());
+	put_string<uint16_t>(buffer, message.from);
+	put_string<uint32_t>(buffer, message.text);
+	end_record(buffer, start);
+}
+
+uint64_t MailLog::append_add(const std::string &to, const MailMessage &message)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	encode_add(m_pending, to, message);
+	const uint64_t lsn = ++m_appended_lsn;
+	lock.unlock();
+
+	m_cv.notify_one();
+	return lsn;
+}
+
+uint64_t MailLog::append_deliver(const std::string &to)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	const size_t start = begin_record(m_pending, MAIL_RECORD_DELIVER);
+	put_string<uint16_t>(m_pending, to);
+	end_record(m_pending, start);
+	const uint64_t lsn = ++m_appended_lsn;
+	lock.unlock();
+
+	m_cv.notify_one();
+	return lsn;
+}
+
+bool MailLog::wait_durable(uint64_t lsn)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_durable_cv.wait(lock, [this, lsn] { return m_durable_lsn >= lsn || !m_running; });
+	if (m_durable_lsn < lsn) {
+		return false;
+	}
+
+	for (const auto &failed : m_failed_batches) {
+		if (lsn >= failed.first && lsn <= failed.second) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void MailLog::rotate()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_rotated += m_pending;
+	m_pending.clear();
+	m_rotated_lsn = m_appended_lsn;
+	m_generation++;
+}
+
+bool MailLog::write_batch(const std::string &batch)
+{
+	if (m_fd < 0) {
+		return false;
+	}
+
+	if (!write_all(m_fd, batch.data(), batch.size()) || fdatasync(m_fd) != 0) {
+		LOG_ERROR("mail", "Unable to write mail log: " << strerror(errno));
+		// Drop a partial record, or replay would stop there and lose the next batches
+		if (ftruncate(m_fd, (off_t) m_log_size) != 0) {
+			LOG_ERROR("mail", "Unable to truncate mail log: " << strerror(errno));
+		}
+		return false;
+	}
+
+	m_log_size += batch.size();
+	return true;
+}
+
+void MailLog::mark_durable(uint64_t lsn, bool written)
+{
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (lsn <= m_durable_lsn) {
+			return;
+		}
+
+		if (!written) {
+			// Waiters wake up right away, only the last failures need to be kept
+			if (m_failed_batches.size() >= MAIL_LOG_FAILED_BATCHES) {
+				m_failed_batches.pop_front();
+			}
+			m_failed_batches.emplace_back(m_durable_lsn + 1, lsn);
+		}
+		m_durable_lsn = lsn;
+	}
+	m_durable_cv.notify_all();
+}
+
+void MailLog::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_cv.wait(lock, [this] { return !m_running || !m_pending.empty(); });
+		if (m_pending.empty()) {
+			break;
+		}
+
+		// Everything appended while the previous batch was syncing goes in one write
+		std::string batch;
+		batch.swap(m_pending);
+		const uint64_t lsn = m_appended_lsn;
+		lock.unlock();
+
+		mark_durable(lsn, write_batch(batch));
+		if (m_log_size >= m_compact_threshold) {
+			compact();
+		}
+
+		lock.lock();
+	}
+}
+
+void MailLog::compact()
+{
+	std::string snapshot;
+	m_snapshot(snapshot);
+
+	std::string tail;
+	uint64_t tail_lsn, generation;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		tail.swap(m_rotated);
+		tail_lsn = m_rotated_lsn;
+		generation = m_generation;
+	}
+
+	// Records appended before the snapshot was taken still go to the old log
+	if (!tail.empty()) {
+		mark_durable(tail_lsn, write_batch(tail));
+	}
+
+	if (m_fd >= 0) {
+		close(m_fd);
+		m_fd = -1;
+	}
+
+	if (!open_log_file(generation)) {
+		return;
+	}
+
+	// Grow the threshold with the live size, or a full store compacts at each batch
+	m_compact_threshold = std::max<uint64_t>(m_compact_size, 2 * snapshot.size());
+
+	const std::string path = m_directory + "/mail.snapshot";
+	const std::string tmp_path = path + ".tmp";
+	int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (fd < 0) {
+		LOG_ERROR("mail", "Unable to write mail snapshot: " << strerror(errno));
+		return;
+	}
+
+	std::string header(MAIL_SNAPSHOT_MAGIC);
+	put<uint64_t>(header, generation);
+	const bool written = write_all(fd, header.data(), header.size()) &&
+			write_all(fd, snapshot.data(), snapshot.size()) && fsync(fd) == 0;
+	close(fd);
+
+	if (!written || rename(tmp_path.c_str(), path.c_str()) != 0) {
+		LOG_ERROR("mail", "Unable to write mail snapshot: " << strerror(errno));
+		unlink(tmp_path.c_str());
+		return;
+	}
+
+	int dir_fd = ::open(m_directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	// The snapshot now holds everything the previous logs did
+	for (uint64_t old = generation - 1; old > 0; --old) {
+		if (unlink(get_log_path(old).c_str()) != 0) {
+			break;
+		}
+	}
+}
@@ -0,0 +1,110 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "Mail.h"
+
+enum MailRecordType : uint8_t
+{
+	MAIL_RECORD_ADD = 1,
+	MAIL_RECORD_DELIVER = 2,
+};
+
+/**
+ * Append-only on-disk journal of the mail store.
+ *
+ * Appends only copy the encoded record into a buffer; the writer thread
+ * flushes everything buffered with a single fdatasync, so concurrent .mail
+ * commands share one disk sync (group commit). Once the log grows over
+ * compact_size, the writer rotates to a new log generation and stores the
+ * live mail in a snapshot. Startup replays the mmap'd snapshot then the
+ * logs written since, which stays bounded by the mail quotas.
+ */
+class MailLog
+{
+public:
+	typedef std::function<void(MailRecordType type, const std::string &to, MailMessage &message)>
+		ReplayCallback;
+	// Must freeze the store, call rotate() and encode every pending mail
+	typedef std::function<void(std::string &snapshot)> SnapshotCallback;
+
+	MailLog(const std::string &directory, uint64_t compact_size);
+	~MailLog();
+
+	bool open(const ReplayCallback &replay);
+	void start(const SnapshotCallback &snapshot);
+	void stop();
+
+	uint64_t append_add(const std::string &to, const MailMessage &message);
+	uint64_t append_deliver(const std::string &to);
+	/**
+	 * Block until the batch holding lsn went through the writer
+	 * @return false when that batch could not be written to disk
+	 */
+	bool wait_durable(uint64_t lsn);
+	void rotate();
+
+	static void encode_add(std::string &buffer, const std::string &to, const MailMessage &message);
+
+private:
+	void run();
+	void compact();
+	bool open_log_file(uint64_t generation);
+	bool write_batch(const std::string &batch);
+	void mark_durable(uint64_t lsn, bool written);
+	std::string get_log_path(uint64_t generation) const;
+
+	std::string m_directory;
+	uint64_t m_compact_size;
+	SnapshotCallback m_snapshot;
+
+	// Only touched by the writer thread once started
+	int m_fd = -1;
+	uint64_t m_log_size = 0;
+	uint64_t m_compact_threshold = 0;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::condition_variable m_durable_cv;
+	std::string m_pending = "";
+	// Records appended before the last rotate(), they belong to the old log
+	std::string m_rotated = "";
+	uint64_t m_rotated_lsn = 0;
+	uint64_t m_generation = 0;
+	uint64_t m_appended_lsn = 0;
+	// Every record up to this one went through the writer, written or not
+	uint64_t m_durable_lsn = 0;
+	// Lsn ranges of the last batches which failed to write, oldest first
+	std::deque<std::pair<uint64_t, uint64_t>> m_failed_batches = {};
+	bool m_running = false;
+	std::thread m_thread;
+};
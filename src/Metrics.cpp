@@ -0,0 +1,264 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include "Metrics.h"
+#include "Log.h"
+
+const uint64_t Metrics::s_bucket_bounds[METRICS_BUCKET_COUNT - 1] = {
+		100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+		1000000, 2500000, 5000000, 10000000
+};
+thread_local Metrics::Shard *Metrics::s_local_shard = nullptr;
+
+Metrics::Shard::Shard()
+{
+	for (auto &counter: counters) {
+		counter = 0;
+	}
+
+	for (size_t i = 0; i < METRICS_MAX_HISTOGRAMS; ++i) {
+		for (auto &bucket: buckets[i]) {
+			bucket = 0;
+		}
+		sums[i] = 0;
+	}
+}
+
+Metrics::Registry &Metrics::get_registry()
+{
+	static Registry registry;
+	return registry;
+}
+
+Metrics::Shard *Metrics::create_local_shard()
+{
+	static thread_local LocalShardOwner owner;
+	(void) owner;
+
+	s_local_shard = new Shard();
+
+	Registry &registry = get_registry();
+	std::unique_lock<std::mutex> lock(registry.mutex);
+	registry.shards.push_back(s_local_shard);
+	return s_local_shard;
+}
+
+void Metrics::release_local_shard()
+{
+	Shard *shard = s_local_shard;
+	if (!shard) {
+		return;
+	}
+
+	// Anything recorded later in the thread exit gets a new shard
+	s_local_shard = nullptr;
+
+	const auto fold = [] (std::atomic<uint64_t> &to, const std::atomic<uint64_t> &from) {
+		to.store(to.load(std::memory_order_relaxed) + from.load(std::memory_order_relaxed),
+				std::memory_order_relaxed);
+	};
+
+	Registry &registry = get_registry();
+	std::unique_lock<std::mutex> lock(registry.mutex);
+	for (size_t i = 0; i < METRICS_MAX_COUNTERS; ++i) {
+		fold(registry.retired.counters[i], shard->counters[i]);
+	}
+
+	for (size_t i = 0; i < METRICS_MAX_HISTOGRAMS; ++i) {
+		for (size_t bucket = 0; bucket < METRICS_BUCKET_COUNT; ++bucket) {
+			fold(registry.retired.buckets[i][bucket], shard->buckets[i][bucket]);
+		}
+		fold(registry.retired.sums[i], shard->sums[i]);
+	}
+
+	registry.shards.erase(std::find(registry.shards.begin(), registry.shards.end(), shard));
+	lock.unlock();
+
+	delete shard;
+}
+
+MetricId Metrics::register_metric(std::vector<MetricInfo> &metrics, const size_t max_metrics,
+		const std::string &name, const std::string &labels, const std::string &help, const std::string &type)
+{
+	std::unique_lock<std::mutex> lock(get_registry().mutex);
+	for (size_t i = 0; i < metrics.size(); ++i) {
+		if (metrics[i].name == name && metrics[i].labels == labels) {
+			return (MetricId) i;
+		}
+	}
+
+	if (metrics.size() >= max_metrics) {
+		LOG_ERROR("metrics", "Too many metrics, " << name << "{" << labels << "} is not recorded");
+		return METRIC_INVALID_ID;
+	}
+
+	MetricInfo info;
+	info.name = name;
+	info.labels = labels;
+	info.help = help;
+	info.type = type;
+	metrics.push_back(info);
+	return (MetricId) (metrics.size() - 1);
+}
+
+MetricId Metrics::register_counter(const std::string &name, const std::string &labels,
+		const std::string &help)
+{
+	return register_metric(get_registry().counters, METRICS_MAX_COUNTERS, name, labels, help, "counter");
+}
+
+MetricId Metrics::register_histogram(const std::string &name, const std::string &labels,
+		const std::string &help)
+{
+	return register_metric(get_registry().histograms, METRICS_MAX_HISTOGRAMS, name, labels, help, "histogram");
+}
+
+void Metrics::register_callback(const std::string &name, const std::string &labels,
+		const std::string &help, const std::string &type, const std::function<double()> &callback)
+{
+	Registry &registry = get_registry();
+	const MetricId id = register_metric(registry.callbacks, SIZE_MAX, name, labels, help, type);
+
+	std::unique_lock<std::mutex> lock(registry.mutex);
+	registry.callbacks[id].callback = callback;
+}
+
+static std::string format_value(const double value)
+{
+	char buf[32];
+	if (std::isnan(value)) {
+		return "NaN";
+	}
+
+	if (value == std::floor(value) && std::fabs(value) < 1e15) {
+		snprintf(buf, sizeof(buf), "%.0f", value);
+	} else {
+		snprintf(buf, sizeof(buf), "%.6f", value);
+	}
+	return buf;
+}
+
+static std::string format_sample(const std::string &name, const std::string &labels,
+		const std::string &value)
+{
+	if (labels.empty()) {
+		return name + " " + value + "\n";
+	}
+	return name + "{" + labels + "} " + value + "\n";
+}
+
+/**
+ * Metrics sharing a name must be rendered together, below a single header
+ */
+static std::vector<size_t> sort_by_name(const std::vector<std::string> &names)
+{
+	std::vector<size_t> order(names.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		order[i] = i;
+	}
+
+	std::stable_sort(order.begin(), order.end(), [&names](size_t a, size_t b) {
+		return names[a] < names[b];
+	});
+	return order;
+}
+
+std::string Metrics::render()
+{
+	Registry &registry = get_registry();
+	std::unique_lock<std::mutex> lock(registry.mutex);
+	std::string out = "";
+	std::string last_name = "";
+
+	auto render_header = [&out, &last_name](const MetricInfo &info) {
+		if (info.name == last_name) {
+			return;
+		}
+
+		out += "# HELP " + info.name + " " + info.help + "\n";
+		out += "# TYPE " + info.name + " " + info.type + "\n";
+		last_name = info.name;
+	};
+
+	auto names = [](const std::vector<MetricInfo> &metrics) {
+		std::vector<std::string> result;
+		for (const auto &info: metrics) {
+			result.push_back(info.name);
+		}
+		return result;
+	};
+
+	for (const size_t i: sort_by_name(names(registry.counters))) {
+		uint64_t value = 0;
+		for (const auto &shard: registry.shards) {
+			value += shard->counters[i].load(std::memory_order_relaxed);
+		}
+
+		render_header(registry.counters[i]);
+		out += format_sample(registry.counters[i].name, registry.counters[i].labels, std::to_string(value));
+	}
+
+	for (const size_t i: sort_by_name(names(registry.histograms))) {
+		const MetricInfo &info = registry.histograms[i];
+		const std::string separator = info.labels.empty() ? "" : ",";
+		render_header(info);
+
+		uint64_t count = 0;
+		uint64_t sum = 0;
+		for (size_t bucket = 0; bucket < METRICS_BUCKET_COUNT; ++bucket) {
+			for (const auto &shard: registry.shards) {
+				count += shard->buckets[i][bucket].load(std::memory_order_relaxed);
+			}
+
+			char le[16] = "+Inf";
+			if (bucket < METRICS_BUCKET_COUNT - 1) {
+				snprintf(le, sizeof(le), "%g", s_bucket_bounds[bucket] / 1e6);
+			}
+			out += format_sample(info.name + "_bucket", info.labels + separator + "le=\"" + std::string(le) + "\"",
+					std::to_string(count));
+		}
+
+		for (const auto &shard: registry.shards) {
+			sum += shard->sums[i].load(std::memory_order_relaxed);
+		}
+
+		out += format_sample(info.name + "_sum", info.labels, format_value(sum / 1e6));
+		out += format_sample(info.name + "_count", info.labels, std::to_string(count));
+	}
+
+	// Callbacks read other components, don't hold the registry lock meanwhile
+	std::vector<MetricInfo> callbacks = registry.callbacks;
+	lock.unlock();
+
+	for (const size_t i: sort_by_name(names(callbacks))) {
+		render_header(callbacks[i]);
+		out += format_sample(callbacks[i].name, callbacks[i].labels, format_value(callbacks[i].callback()));
+	}
+
+	return out;
+}
@@ -0,0 +1,150 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define METRICS_MAX_COUNTERS 256
+#define METRICS_MAX_HISTOGRAMS 128
+// Upper bounds of the latency buckets, the last one is +Inf
+#define METRICS_BUCKET_COUNT 17
+
+typedef uint32_t MetricId;
+static const MetricId METRIC_INVALID_ID = UINT32_MAX;
+
+/**
+ * Process wide Prometheus style metrics.
+ *
+ * Every thread records into its own shard, with plain relaxed loads and
+ * stores as it is the only writer, so instrumented paths never contend
+ * nor take a lock. render() sums the shards when /metrics is scraped.
+ * Values which already live elsewhere (queue depths, cache stats) are
+ * registered as callbacks read at scrape time.
+ */
+class Metrics
+{
+public:
+	static MetricId register_counter(const std::string &name, const std::string &labels,
+			const std::string &help);
+	static MetricId register_histogram(const std::string &name, const std::string &labels,
+			const std::string &help);
+	// type is the Prometheus type of the value: "gauge" or "counter"
+	static void register_callback(const std::string &name, const std::string &labels,
+			const std::string &help, const std::string &type, const std::function<double()> &callback);
+
+	static std::string render();
+
+	static void increment(const MetricId id, const uint64_t value = 1)
+	{
+		if (id >= METRICS_MAX_COUNTERS) {
+			return;
+		}
+
+		std::atomic<uint64_t> &counter = get_local_shard()->counters[id];
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	static void observe(const MetricId id, const std::chrono::microseconds &duration)
+	{
+		if (id >= METRICS_MAX_HISTOGRAMS) {
+			return;
+		}
+
+		const uint64_t us = (uint64_t) std::max<int64_t>(duration.count(), 0);
+		size_t bucket = 0;
+		while (bucket < METRICS_BUCKET_COUNT - 1 && us > s_bucket_bounds[bucket]) {
+			bucket++;
+		}
+
+		Shard *shard = get_local_shard();
+		std::atomic<uint64_t> &count = shard->buckets[id][bucket];
+		count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic<uint64_t> &sum = shard->sums[id];
+		sum.store(sum.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+	}
+
+private:
+	struct Shard
+	{
+		std::atomic<uint64_t> counters[METRICS_MAX_COUNTERS];
+		std::atomic<uint64_t> buckets[METRICS_MAX_HISTOGRAMS][METRICS_BUCKET_COUNT];
+		// microseconds
+		std::atomic<uint64_t> sums[METRICS_MAX_HISTOGRAMS];
+
+		Shard();
+	};
+
+	struct MetricInfo
+	{
+		std::string name;
+		std::string labels;
+		std::string help;
+		std::string type;
+		std::function<double()> callback;
+	};
+
+	// Function local so metrics can be registered during static initialization
+	struct Registry
+	{
+		std::mutex mutex;
+		// Shards of the running threads, and retired
+		std::vector<Shard *> shards;
+		// Counts of the exited threads, only written with mutex held
+		Shard retired;
+		std::vector<MetricInfo> counters;
+		std::vector<MetricInfo> histograms;
+		std::vector<MetricInfo> callbacks;
+
+		Registry() { shards.push_back(&retired); }
+	};
+
+	// Folds the shard of its thread into the retired one when the thread exits
+	struct LocalShardOwner
+	{
+		~LocalShardOwner() { release_local_shard(); }
+	};
+
+	static Shard *get_local_shard()
+	{
+		return s_local_shard ? s_local_shard : create_local_shard();
+	}
+
+	static Shard *create_local_shard();
+	static void release_local_shard();
+	static Registry &get_registry();
+	static MetricId register_metric(std::vector<MetricInfo> &metrics, const size_t max_metrics,
+			const std::string &name, const std::string &labels, const std::string &help, const std::string &type);
+
+	static const uint64_t s_bucket_bounds[METRICS_BUCKET_COUNT - 1];
+	static thread_local Shard *s_local_shard;
+};
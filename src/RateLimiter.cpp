@@ -0,0 +1,191 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include "RateLimiter.h"
+#include "Config.h"
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+// Slots tried before giving up on a key
+#define RATE_LIMIT_MAX_PROBES 8
+#define RATE_LIMIT_MAX_COUNT 0xFFFF
+
+RateLimiter::RateLimiter(size_t capacity) : m_epoch(std::chrono::steady_clock::now()), m_table_full(0)
+{
+	size_t size = RATE_LIMIT_MAX_PROBES;
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	m_mask = size - 1;
+	m_slots.reset(new Slot[size]);
+	for (size_t i = 0; i < size; ++i) {
+		m_slots[i].key.store(0, std::memory_order_relaxed);
+		m_slots[i].state.store(0, std::memory_order_relaxed);
+		m_slots[i].expires.store(0, std::memory_order_relaxed);
+	}
+}
+
+uint64_t RateLimiter::make_key(const char *name, const char stop_char, const int32_t command_id,
+		const RateLimitScope scope)
+{
+	uint64_t h = FNV_OFFSET_BASIS;
+	for (const char *c = name; *c && *c != stop_char; ++c) {
+		h ^= (uint8_t) irc_tolower(*c);
+		h *= FNV_PRIME;
+	}
+
+	h ^= ((uint64_t) (uint32_t) command_id << 8) | scope;
+	h *= FNV_PRIME;
+	// 0 marks free slots
+	return h ? h : 1;
+}
+
+uint64_t RateLimiter::now_ms() const
+{
+	return (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - m_epoch).count();
+}
+
+bool RateLimiter::allow(const uint64_t key, const uint32_t limit, const uint32_t window_s)
+{
+	if (limit == 0 || window_s == 0) {
+		return true;
+	}
+
+	const uint64_t now = now_ms();
+	const uint32_t now_s = (uint32_t) (now / 1000);
+
+	// Reuse the slot of the key, or claim an empty or expired one on the way
+	Slot *free_slot = nullptr;
+	uint64_t free_key = 0;
+	for (size_t i = 0; i < RATE_LIMIT_MAX_PROBES; ++i) {
+		Slot &slot = m_slots[(key + i) & m_mask];
+		const uint64_t slot_key = slot.key.load(std::memory_order_acquire);
+		if (slot_key == key) {
+			return update(slot, limit, window_s, now);
+		}
+
+		if (!free_slot && (slot_key == 0 || slot.expires.load(std::memory_order_relaxed) <= now_s)) {
+			free_slot = &slot;
+			free_key = slot_key;
+		}
+	}
+
+	if (!free_slot) {
+		m_table_full++;
+		return true;
+	}
+
+	if (!free_slot->key.compare_exchange_strong(free_key, key, std::memory_order_acq_rel)) {
+		// Another key took it meanwhile, don't chase it
+		if (free_key != key) {
+			m_table_full++;
+			return true;
+		}
+	} else {
+		free_slot->expires.store(now_s + 2 * window_s, std::memory_order_relaxed);
+		free_slot->state.store(0, std::memory_order_release);
+	}
+
+	return update(*free_slot, limit, window_s, now);
+}
+
+bool RateLimiter::would_allow(const uint64_t key, const uint32_t limit, const uint32_t window_s) const
+{
+	if (limit == 0 || window_s == 0) {
+		return true;
+	}
+
+	const uint64_t now = now_ms();
+	for (size_t i = 0; i < RATE_LIMIT_MAX_PROBES; ++i) {
+		const Slot &slot = m_slots[(key + i) & m_mask];
+		if (slot.key.load(std::memory_order_acquire) == key) {
+			uint32_t previous, current;
+			return estimate(slot.state.load(std::memory_order_acquire), window_s, now,
+					previous, current) < limit;
+		}
+	}
+
+	// Unknown keys have nothing counted yet
+	return true;
+}
+
+uint64_t RateLimiter::estimate(const uint64_t state, const uint32_t window_s, const uint64_t now_ms,
+		uint32_t &previous, uint32_t &current)
+{
+	const uint64_t window_ms = (uint64_t) window_s * 1000;
+	const uint32_t window = (uint32_t) (now_ms / window_ms);
+	const uint64_t elapsed_ms = now_ms % window_ms;
+
+	previous = (uint32_t) ((state >> 16) & RATE_LIMIT_MAX_COUNT);
+	current = (uint32_t) (state & RATE_LIMIT_MAX_COUNT);
+	const uint32_t state_window = (uint32_t) (state >> 32);
+	if (state_window + 1 == window) {
+		previous = current;
+		current = 0;
+	} else if (state_window != window) {
+		previous = 0;
+		current = 0;
+	}
+
+	// Part of the previous window still covered by the sliding one
+	return (uint64_t) previous * (window_ms - elapsed_ms) / window_ms + current;
+}
+
+bool RateLimiter::update(Slot &slot, const uint32_t limit, const uint32_t window_s, const uint64_t now_ms)
+{
+	const uint32_t window = (uint32_t) (now_ms / ((uint64_t) window_s * 1000));
+
+	uint64_t state = slot.state.load(std::memory_order_acquire);
+	while (true) {
+		uint32_t previous, current;
+		if (estimate(state, window_s, now_ms, previous, current) >= limit) {
+			return false;
+		}
+
+		const uint64_t next = ((uint64_t) window << 32) | ((uint64_t) previous << 16) |
+				std::min<uint32_t>(current + 1, RATE_LIMIT_MAX_COUNT);
+		if (slot.state.compare_exchange_weak(state, next, std::memory_order_acq_rel)) {
+			// Counters stop mattering once the next window fully elapsed
+			slot.expires.store((window + 2) * window_s, std::memory_order_relaxed);
+			return true;
+		}
+	}
+}
+
+size_t RateLimiter::get_used_slots() const
+{
+	const uint32_t now_s = (uint32_t) (now_ms() / 1000);
+	size_t used = 0;
+	for (size_t i = 0; i <= m_mask; ++i) {
+		if (m_slots[i].key.load(std::memory_order_relaxed) != 0 &&
+				m_slots[i].expires.load(std::memory_order_relaxed) > now_s) {
+			used++;
+		}
+	}
+	return used;
+}
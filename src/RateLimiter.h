@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+enum RateLimitScope : uint8_t
+{
+	RATE_LIMIT_USER,
+	RATE_LIMIT_CHANNEL,
+};
+
+/**
+ * Fixed-size, lock-free table of sliding window counters.
+ *
+ * Each slot holds the count of the current and the previous window, the
+ * estimate weights the previous one by how much of it still overlaps the
+ * sliding window. Updates are a CAS on a single 64 bits word.
+ *
+ * Slots whose window elapsed are reused by the next key hashing nearby, so
+ * memory stays bounded however many nicks are seen. When no slot is free the
+ * command is allowed: the limiter never blocks legitimate traffic because
+ * the table is full.
+ */
+class RateLimiter
+{
+public:
+	RateLimiter(size_t capacity);
+
+	// @return false when key already reached limit commands during the last window_s seconds
+	bool allow(const uint64_t key, const uint32_t limit, const uint32_t window_s);
+	// Same answer as allow() without counting a command
+	bool would_allow(const uint64_t key, const uint32_t limit, const uint32_t window_s) const;
+
+	size_t get_used_slots() const;
+	uint64_t get_table_full() const { return m_table_full; }
+
+	// Hashes name up to its end or to stop_char, case insensitively and without allocating
+	static uint64_t make_key(const char *name, const char stop_char, const int32_t command_id,
+			const RateLimitScope scope);
+
+private:
+	struct Slot
+	{
+		// 0 when the slot was never used
+		std::atomic<uint64_t> key;
+		// window index (32 bits) | previous count (16 bits) | current count (16 bits)
+		std::atomic<uint64_t> state;
+		// Seconds since m_epoch after which the counters are meaningless
+		std::atomic<uint32_t> expires;
+	};
+
+	bool update(Slot &slot, const uint32_t limit, const uint32_t window_s, const uint64_t now_ms);
+	// Rolls state over to the window of now_ms, @return the sliding window estimate
+	static uint64_t estimate(const uint64_t state, const uint32_t window_s, const uint64_t now_ms,
+			uint32_t &previous, uint32_t &current);
+	uint64_t now_ms() const;
+
+	std::unique_ptr<Slot[]> m_slots;
+	size_t m_mask = 0;
+	const std::chrono::steady_clock::time_point m_epoch;
+	std::atomic<uint64_t> m_table_full;
+};
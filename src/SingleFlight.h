@@ -0,0 +1,168 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Coalesces concurrent calls sharing a key: the first caller runs the
+ * function, the others wait for it and get a copy of its result instead of
+ * issuing the same upstream request.
+ *
+ * Asynchronous callers use join() and complete() instead: the caller which
+ * must issue the request is told so, the others register a waiter called
+ * with the result once the call completes. Both forms share the same calls.
+ *
+ * Nothing is kept once the call returned, caching is left to the caller.
+ */
+template<typename V>
+class SingleFlight
+{
+public:
+	typedef std::function<void(const V &value)> Waiter;
+
+	SingleFlight() : m_calls_total(0), m_shared(0) {}
+
+	/**
+	 * Run fn for key, or wait for the call already in flight for key.
+	 * If that call throws, waiters get a default constructed value.
+	 * @return true when value was produced by another caller
+	 */
+	template<typename F>
+	bool run(const std::string &key, V &value, F &&fn)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_calls_total++;
+		auto it = m_calls.find(key);
+		if (it != m_calls.end()) {
+			std::shared_ptr<Call> call = it->second;
+			m_shared++;
+			call->cv.wait(lock, [&call] { return call->done; });
+			value = call->value;
+			return true;
+		}
+
+		std::shared_ptr<Call> call = std::make_shared<Call>();
+		m_calls.emplace(key, call);
+		lock.unlock();
+
+		try {
+			value = fn();
+		} catch (...) {
+			finish(key, call, V());
+			throw;
+		}
+
+		finish(key, call, value);
+		return false;
+	}
+
+	/**
+	 * Register waiter for key, it is called with the result of the call,
+	 * from the thread completing it.
+	 * @return true when no call was in flight: the caller must issue it, then
+	 * complete() it. The waiter is not called before that
+	 */
+	bool join(const std::string &key, const Waiter &waiter)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_calls_total++;
+		auto it = m_calls.find(key);
+		if (it != m_calls.end()) {
+			m_shared++;
+			it->second->waiters.push_back(waiter);
+			return false;
+		}
+
+		std::shared_ptr<Call> call = std::make_shared<Call>();
+		call->waiters.push_back(waiter);
+		m_calls.emplace(key, call);
+		return true;
+	}
+
+	void complete(const std::string &key, const V &value)
+	{
+		std::shared_ptr<Call> call;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			auto it = m_calls.find(key);
+			if (it == m_calls.end()) {
+				return;
+			}
+			call = it->second;
+		}
+
+		finish(key, call, value);
+	}
+
+	size_t in_flight() const
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_calls.size();
+	}
+
+	uint64_t get_calls() const { return m_calls_total; }
+	uint64_t get_shared() const { return m_shared; }
+
+private:
+	struct Call
+	{
+		V value;
+		bool done = false;
+		std::condition_variable cv;
+		// Asynchronous callers, called once the value is known
+		std::vector<Waiter> waiters = {};
+	};
+
+	void finish(const std::string &key, const std::shared_ptr<Call> &call, const V &value)
+	{
+		std::vector<Waiter> waiters = {};
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			call->value = value;
+			call->done = true;
+			std::swap(waiters, call->waiters);
+			m_calls.erase(key);
+		}
+		call->cv.notify_all();
+
+		for (const Waiter &waiter: waiters) {
+			waiter(value);
+		}
+	}
+
+	std::unordered_map<std::string, std::shared_ptr<Call>> m_calls = {};
+	mutable std::mutex m_mutex;
+	std::atomic<uint64_t> m_calls_total;
+	std::atomic<uint64_t> m_shared;
+};
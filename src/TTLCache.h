@@ -0,0 +1,152 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Thread safe key/value cache with per entry expiration and LRU eviction
+ * once max_size entries are stored.
+ */
+template<typename V>
+class TTLCache
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	TTLCache(size_t max_size = 256) : m_max_size(max_size), m_hits(0), m_misses(0) {}
+
+	void set_max_size(size_t max_size)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_max_size = max_size > 0 ? max_size : 1;
+		while (m_entries.size() > m_max_size) {
+			evict_oldest();
+		}
+	}
+
+	bool get(const std::string &key, V &value)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto it = m_entries.find(key);
+		if (it == m_entries.end()) {
+			m_misses++;
+			return false;
+		}
+
+		if (it->second.expires <= clock::now()) {
+			m_lru.erase(it->second.lru_it);
+			m_entries.erase(it);
+			m_misses++;
+			return false;
+		}
+
+		// Move the entry in front of the LRU list
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru_it);
+		value = it->second.value;
+		m_hits++;
+		return true;
+	}
+
+	void put(const std::string &key, const V &value, const std::chrono::milliseconds &ttl)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto it = m_entries.find(key);
+		if (it != m_entries.end()) {
+			it->second.value = value;
+			it->second.expires = clock::now() + ttl;
+			m_lru.splice(m_lru.begin(), m_lru, it->second.lru_it);
+			return;
+		}
+
+		while (m_entries.size() >= m_max_size) {
+			evict_oldest();
+		}
+
+		m_lru.push_front(key);
+		Entry &entry = m_entries[key];
+		entry.value = value;
+		entry.expires = clock::now() + ttl;
+		entry.lru_it = m_lru.begin();
+	}
+
+	void erase(const std::string &key)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		auto it = m_entries.find(key);
+		if (it != m_entries.end()) {
+			m_lru.erase(it->second.lru_it);
+			m_entries.erase(it);
+		}
+	}
+
+	void clear()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_entries.clear();
+		m_lru.clear();
+	}
+
+	size_t size() const
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return m_entries.size();
+	}
+
+	uint64_t get_hits() const { return m_hits; }
+	uint64_t get_misses() const { return m_misses; }
+
+private:
+	struct Entry
+	{
+		V value;
+		clock::time_point expires;
+		std::list<std::string>::iterator lru_it;
+	};
+
+	void evict_oldest()
+	{
+		if (m_lru.empty()) {
+			return;
+		}
+
+		m_entries.erase(m_lru.back());
+		m_lru.pop_back();
+	}
+
+	size_t m_max_size;
+	std::list<std::string> m_lru = {};
+	std::unordered_map<std::string, Entry> m_entries = {};
+	mutable std::mutex m_mutex;
+
+	std::atomic<uint64_t> m_hits;
+	std::atomic<uint64_t> m_misses;
+};
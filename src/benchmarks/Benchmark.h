@@ -0,0 +1,153 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+enum BenchmarkOutput
+{
+	BENCHMARK_OUTPUT_TEXT,
+	BENCHMARK_OUTPUT_CSV,
+	BENCHMARK_OUTPUT_JSON,
+};
+
+struct BenchmarkResult
+{
+	std::string name = "";
+	uint64_t iterations = 0;
+	double median_ns = 0;
+	double min_ns = 0;
+	double max_ns = 0;
+};
+
+/**
+ * Minimal microbenchmark harness: runs fn(i) for a warmup round then for
+ * several measured repetitions, and reports the median and spread of the
+ * cost per call. Text output is meant for humans, CSV and JSON outputs are
+ * printed once all benchmarks ran so runs can be compared by scripts.
+ */
+class Benchmark
+{
+public:
+	template<typename F>
+	static void run(const std::string &name, const uint64_t iterations, F &&fn)
+	{
+		if (!s_filter.empty() && name.find(s_filter) == std::string::npos) {
+			return;
+		}
+
+		for (uint64_t i = 0; i < iterations / 10; ++i) {
+			fn(i);
+		}
+
+		std::vector<double> samples;
+		for (uint32_t r = 0; r < s_repetitions; ++r) {
+			auto start = std::chrono::steady_clock::now();
+			for (uint64_t i = 0; i < iterations; ++i) {
+				fn(i);
+			}
+			auto end = std::chrono::steady_clock::now();
+			samples.push_back(std::chrono::duration<double, std::nano>(end - start).count() / iterations);
+		}
+
+		std::sort(samples.begin(), samples.end());
+
+		BenchmarkResult result;
+		result.name = name;
+		result.iterations = iterations;
+		result.median_ns = samples[samples.size() / 2];
+		result.min_ns = samples.front();
+		result.max_ns = samples.back();
+		s_results.push_back(result);
+
+		if (s_output == BENCHMARK_OUTPUT_TEXT) {
+			std::cout << std::left << std::setw(48) << name
+					<< std::right << std::setw(12) << iterations << " iterations "
+					<< std::fixed << std::setprecision(1) << std::setw(10)
+					<< result.median_ns << " ns/op (min " << result.min_ns
+					<< ", max " << result.max_ns << ")" << std::endl;
+		}
+	}
+
+	static void print_results()
+	{
+		if (s_output == BENCHMARK_OUTPUT_CSV) {
+			std::cout << "name,iterations,median_ns,min_ns,max_ns" << std::endl;
+			for (const auto &result: s_results) {
+				std::cout << "\"" << escape(result.name, '"') << "\"," << result.iterations << ","
+						<< std::fixed << std::setprecision(2) << result.median_ns << ","
+						<< result.min_ns << "," << result.max_ns << std::endl;
+			}
+		} else if (s_output == BENCHMARK_OUTPUT_JSON) {
+			std::cout << "{\"repetitions\": " << s_repetitions << ", \"benchmarks\": [" << std::endl;
+			for (size_t i = 0; i < s_results.size(); ++i) {
+				const BenchmarkResult &result = s_results[i];
+				std::cout << "  {\"name\": \"" << escape(result.name, '\\') << "\", \"iterations\": "
+						<< result.iterations << std::fixed << std::setprecision(2)
+						<< ", \"median_ns\": " << result.median_ns << ", \"min_ns\": " << result.min_ns
+						<< ", \"max_ns\": " << result.max_ns << "}"
+						<< (i + 1 < s_results.size() ? "," : "") << std::endl;
+			}
+			std::cout << "]}" << std::endl;
+		}
+	}
+
+	static void set_output(const BenchmarkOutput output) { s_output = output; }
+	static void set_filter(const std::string &filter) { s_filter = filter; }
+	static void set_repetitions(const uint32_t repetitions) { s_repetitions = std::max(repetitions, 1u); }
+
+	// Prevent the compiler from optimizing away a computed value
+	template<typename T>
+	static void do_not_optimize(const T &value)
+	{
+		asm volatile("" : : "r,m"(value) : "memory");
+	}
+
+private:
+	// CSV doubles quotes, JSON escapes them with a backslash
+	static std::string escape(const std::string &str, const char escape_char)
+	{
+		std::string result;
+		for (const char c: str) {
+			if (c == '"' || c == escape_char) {
+				result += escape_char;
+			}
+			result += c;
+		}
+		return result;
+	}
+
+	static BenchmarkOutput s_output;
+	static std::string s_filter;
+	static uint32_t s_repetitions;
+	static std::vector<BenchmarkResult> s_results;
+};
@@ -0,0 +1,239 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include "Benchmark.h"
+#include "payloads.h"
+#include "../CommandHandler.h"
+#include "../CommandDispatcher.h"
+#include "../Config.h"
+#include "../ContentPrefetcher.h"
+#include "../IRCSender.h"
+#include "../Mail.h"
+
+BenchmarkOutput Benchmark::s_output = BENCHMARK_OUTPUT_TEXT;
+std::string Benchmark::s_filter = "";
+uint32_t Benchmark::s_repetitions = 5;
+std::vector<BenchmarkResult> Benchmark::s_results = {};
+
+static void bench_find_command()
+{
+	static const char *lines[] = {
+			"weather Paris",
+			"gitlab issue 42",
+			"chuck_norris",
+			"mail nick hello there",
+			"unknown_command with args",
+			"gitlab unknown",
+	};
+	static const size_t line_count = sizeof(lines) / sizeof(lines[0]);
+
+	const CommandDispatchTable &table = CommandHandler::get_dispatch_table();
+
+	for (size_t l = 0; l < line_count; ++l) {
+		const char *line = lines[l];
+		Benchmark::run(std::string("find_command(\"") + line + "\")", 10000000,
+				[&table, line] (uint64_t) {
+					const char *text = line;
+					ChatCommandMatch match;
+					ChatCommandSearchResult res = CommandHandler::find_command(table, text, match);
+					Benchmark::do_not_optimize(res);
+					Benchmark::do_not_optimize(match.command);
+				});
+	}
+}
+
+static void bench_mail()
+{
+	Config cfg;
+	Mail::configure(&cfg);
+
+	Benchmark::run("mail_add_get(same recipient)", 1000000, [] (uint64_t) {
+		std::string msg;
+		Mail::add_mail("nick", "sender", "see you tomorrow at the meeting");
+		Mail::get_mail("nick", msg);
+		Benchmark::do_not_optimize(msg);
+	});
+
+	std::vector<std::string> nicks;
+	for (int i = 0; i < 1000; ++i) {
+		nicks.push_back("nick" + std::to_string(i));
+	}
+
+	// Each mailbox is emptied 500 iterations after being filled
+	Benchmark::run("mail_add_get(1000 recipients)", 1000000, [&nicks] (uint64_t i) {
+		std::string msg;
+		Mail::add_mail(nicks[i % nicks.size()], "sender", "hello");
+		Benchmark::do_not_optimize(Mail::get_mail(nicks[(i + 500) % nicks.size()], msg));
+	});
+
+	const std::string unknown = "somebody_without_mail";
+	Benchmark::run("mail_get(miss)", 10000000, [&unknown] (uint64_t) {
+		std::string msg;
+		Benchmark::do_not_optimize(Mail::get_mail(unknown, msg));
+	});
+}
+
+static void bench_json()
+{
+	const std::string weather = WEATHER_PAYLOAD;
+	const std::string issue = GITLAB_ISSUE_PAYLOAD;
+
+	Benchmark::run("json_decode(weather)", 200000, [&weather] (uint64_t) {
+		Json::Value json_value;
+		Json::Reader reader;
+		Benchmark::do_not_optimize(reader.parse(weather, json_value));
+	});
+
+	Benchmark::run("json_decode(gitlab issue)", 100000, [&issue] (uint64_t) {
+		Json::Value json_value;
+		Json::Reader reader;
+		Benchmark::do_not_optimize(reader.parse(issue, json_value));
+	});
+
+	// Same documents, only extracting the fields the replies use
+	JsonFields fields;
+	Benchmark::run("json_extract(weather)", 1000000, [&weather, &fields] (uint64_t) {
+		Benchmark::do_not_optimize(CommandHandler::s_weather_fields.extract(weather, fields));
+	});
+
+	// The GitLab client hands out a DOM, this measures what extraction would save
+	const JsonFieldSet issue_fields = {"author.name", "state", "title", "web_url"};
+	Benchmark::run("json_extract(gitlab issue)", 1000000, [&issue, &issue_fields, &fields] (uint64_t) {
+		Benchmark::do_not_optimize(issue_fields.extract(issue, fields));
+	});
+
+	const std::pair<const char *, PrefetchSource> sources[] = {
+			{CHUCK_NORRIS_PAYLOAD, PREFETCH_CHUCK_NORRIS},
+			{QUOTE_PAYLOAD, PREFETCH_QUOTE},
+	};
+
+	for (const auto &source: sources) {
+		const std::string payload = source.first;
+		const std::string name = source.second == PREFETCH_QUOTE ? "quote" : "chuck_norris";
+		Benchmark::run("json_decode(" + name + ")", 1000000, [&payload] (uint64_t) {
+			Json::Value json_value;
+			Json::Reader reader;
+			Benchmark::do_not_optimize(reader.parse(payload, json_value));
+		});
+
+		const JsonFieldSet &field_set = ContentPrefetcher::get_fields(source.second);
+		Benchmark::run("json_extract(" + name + ")", 1000000, [&payload, &field_set, &fields] (uint64_t) {
+			Benchmark::do_not_optimize(field_set.extract(payload, fields));
+		});
+	}
+}
+
+static void bench_format()
+{
+	JsonFields weather;
+	CommandHandler::s_weather_fields.extract(std::string(WEATHER_PAYLOAD), weather);
+
+	Json::Value issue;
+	Json::Reader reader;
+	reader.parse(GITLAB_ISSUE_PAYLOAD, issue);
+
+	Benchmark::run("format_weather", 1000000, [&weather] (uint64_t) {
+		std::string msg;
+		CommandHandler::format_weather(weather, msg);
+		Benchmark::do_not_optimize(msg);
+	});
+
+	Benchmark::run("format_gitlab_issue", 1000000, [&issue] (uint64_t) {
+		Benchmark::do_not_optimize(CommandHandler::format_gitlab_issue(42, issue));
+	});
+}
+
+static void bench_outbound_queue()
+{
+	Config cfg;
+	// No pacing, the benchmark only measures the queue and the coalescing
+	cfg.set_irc_flood_interval_ms(0);
+	IRCSender sender(&cfg, [] {});
+
+	const std::string target = "#channel";
+	const std::string reply = "La température  à Paris est de 15 degrès. (min : 14 max : 17)";
+	Benchmark::run("outbound_send_next(1 message)", 1000000, [&] (uint64_t) {
+		OutboundMessage message;
+		sender.send(target, reply);
+		Benchmark::do_not_optimize(sender.next_message(message));
+	});
+
+	const std::string help = "Command list : weather, gitlab, chuck_norris, joke\n"
+			"Usage: .weather <ville>\nUsage: .gitlab <issue|flush>";
+	Benchmark::run("outbound_send_next(3 lines)", 1000000, [&] (uint64_t) {
+		OutboundMessage message;
+		sender.send(target, help);
+		while (sender.next_message(message)) {
+			Benchmark::do_not_optimize(message);
+		}
+	});
+
+	Benchmark::run("outbound_send_next(burst of 10)", 100000, [&] (uint64_t) {
+		OutboundMessage message;
+		for (int i = 0; i < 10; ++i) {
+			sender.send(target, "short reply");
+		}
+		while (sender.next_message(message)) {
+			Benchmark::do_not_optimize(message);
+		}
+	});
+}
+
+static void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [--format=text|csv|json] [--filter=<substring>] "
+			<< "[--repetitions=<count>]" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		if (strcmp(arg, "--format=text") == 0) {
+			Benchmark::set_output(BENCHMARK_OUTPUT_TEXT);
+		} else if (strcmp(arg, "--format=csv") == 0) {
+			Benchmark::set_output(BENCHMARK_OUTPUT_CSV);
+		} else if (strcmp(arg, "--format=json") == 0) {
+			Benchmark::set_output(BENCHMARK_OUTPUT_JSON);
+		} else if (strncmp(arg, "--filter=", 9) == 0) {
+			Benchmark::set_filter(arg + 9);
+		} else if (strncmp(arg, "--repetitions=", 14) == 0) {
+			Benchmark::set_repetitions((uint32_t) strtoul(arg + 14, nullptr, 10));
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	bench_find_command();
+	bench_mail();
+	bench_json();
+	bench_format();
+	bench_outbound_queue();
+
+	Benchmark::print_results();
+	return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+/**
+ * Upstream API answers recorded for the decoding benchmarks
+ */
+
+static const char *WEATHER_PAYLOAD = R"({"coord":{"lon":2.35,"lat":48.85},"weather":[{"id":803,"main":"Clouds",)"
+		R"("description":"broken clouds","icon":"04d"}],"base":"stations","main":{"temp":288.55,)"
+		R"("pressure":1017,"humidity":67,"temp_min":287.15,"temp_max":290.15},"visibility":10000,)"
+		R"("wind":{"speed":4.6,"deg":240},"clouds":{"all":75},"dt":1497261600,"sys":{"type":1,"id":5615,)"
+		R"("message":0.0049,"country":"FR","sunrise":1497239193,"sunset":1497297319},"id":2988507,)"
+		R"("name":"Paris","cod":200})";
+
+static const char *GITLAB_ISSUE_PAYLOAD = R"({"id":1254,"iid":42,"project_id":17,)"
+		R"("title":"Bot crashes when the weather service answers an empty body",)"
+		R"("description":"Steps to reproduce:\n1. Run .weather with an unknown city\n2. The bot stops answering",)"
+		R"("state":"opened","created_at":"2017-06-10T14:02:31.123Z","updated_at":"2017-06-11T08:45:12.456Z",)"
+		R"("closed_at":null,"labels":["bug","weather"],"milestone":{"id":3,"iid":1,"project_id":17,)"
+		R"("title":"v1.0","description":"","state":"active","created_at":"2017-05-01T10:00:00.000Z",)"
+		R"("updated_at":"2017-05-01T10:00:00.000Z","due_date":"2017-07-01","start_date":null},)"
+		R"("assignees":[{"id":2,"name":"Vincent Glize","username":"vglize","state":"active",)"
+		R"("avatar_url":"https://gitlab.example.com/uploads/user/avatar/2/avatar.png",)"
+		R"("web_url":"https://gitlab.example.com/vglize"}],"author":{"id":5,"name":"Dumbeldor",)"
+		R"("username":"dumbeldor","state":"active","avatar_url":null,"web_url":"https://gitlab.example.com/dumbeldor"},)"
+		R"("assignee":{"id":2,"name":"Vincent Glize","username":"vglize","state":"active",)"
+		R"("avatar_url":"https://gitlab.example.com/uploads/user/avatar/2/avatar.png",)"
+		R"("web_url":"https://gitlab.example.com/vglize"},"user_notes_count":3,"upvotes":1,"downvotes":0,)"
+		R"("due_date":null,"confidential":false,"discussion_locked":null,)"
+		R"("web_url":"https://gitlab.example.com/dumbeldor/bot/issues/42",)"
+		R"("time_stats":{"time_estimate":0,"total_time_spent":0,"human_time_estimate":null,)"
+		R"("human_total_time_spent":null}})";
+
+static const char *CHUCK_NORRIS_PAYLOAD = R"({ "type": "success", "value": { "id": 470, )"
+		R"("joke": "Chuck Norris doesn't read books. He stares them down until he gets the information he wants.", )"
+		R"("categories": [] } })";
+
+static const char *QUOTE_PAYLOAD = R"({"status":"ok","count":1,"data":[{"id":"1893",)"
+		R"("text":"La simplicité est la sophistication suprême.","author":"Léonard de Vinci",)"
+		R"("tags":["simplicity","design"],"lang":"fr"}]})";
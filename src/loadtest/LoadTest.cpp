@@ -0,0 +1,340 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "LoadTest.h"
+
+#define LOADTEST_SERVER_NAME "loadtest.local"
+#define LOADTEST_REGISTER_TIMEOUT std::chrono::seconds(60)
+// Lets the bot join its channels before the load starts
+#define LOADTEST_SETTLE_TIME std::chrono::seconds(1)
+
+LoadTest::LoadTest(const LoadTestOptions &options) : m_options(options), m_random(42)
+{
+}
+
+LoadTest::~LoadTest()
+{
+	if (m_client.fd >= 0) {
+		close(m_client.fd);
+	}
+
+	if (m_listen_fd >= 0) {
+		close(m_listen_fd);
+	}
+}
+
+bool LoadTest::listen_socket()
+{
+	m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m_listen_fd < 0) {
+		std::cerr << "Unable to create socket: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	int reuse = 1;
+	setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(m_options.port);
+
+	if (bind(m_listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(m_listen_fd, 1) != 0) {
+		std::cerr << "Unable to listen on port " << m_options.port << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool LoadTest::accept_client()
+{
+	int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	// A single bot connection is measured, a new one replaces it
+	if (m_client.fd >= 0) {
+		close(m_client.fd);
+	}
+
+	int nodelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	m_client = Client();
+	m_client.fd = fd;
+	std::cerr << "Bot connected" << std::endl;
+	return true;
+}
+
+bool LoadTest::read_client()
+{
+	char buf[16384];
+	ssize_t received;
+	while ((received = read(m_client.fd, buf, sizeof(buf))) > 0) {
+		m_client.in.append(buf, (size_t) received);
+	}
+
+	if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		std::cerr << "Bot disconnected" << std::endl;
+		close(m_client.fd);
+		m_client = Client();
+		return false;
+	}
+	return true;
+}
+
+bool LoadTest::flush_client()
+{
+	if (m_client.fd < 0 || m_client.out.empty()) {
+		return true;
+	}
+
+	ssize_t sent = write(m_client.fd, m_client.out.data(), m_client.out.size());
+	if (sent > 0) {
+		m_client.out.erase(0, (size_t) sent);
+	}
+	return sent >= 0 || errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+void LoadTest::send_line(const std::string &line)
+{
+	m_client.out += line + "\r\n";
+}
+
+void LoadTest::handle_line(const std::string &line, LoadTestReport &report, bool measuring)
+{
+	// [:prefix] command params [:trailing]
+	size_t pos = 0;
+	if (!line.empty() && line[0] == ':') {
+		pos = line.find(' ');
+		if (pos == std::string::npos) {
+			return;
+		}
+		pos++;
+	}
+
+	const size_t trailing_start = line.find(" :", pos);
+	std::string trailing = "";
+	std::string head = line.substr(pos, trailing_start == std::string::npos ? std::string::npos :
+			trailing_start - pos);
+	if (trailing_start != std::string::npos) {
+		trailing = line.substr(trailing_start + 2);
+	}
+
+	std::vector<std::string> params;
+	size_t start = 0;
+	while (start < head.size()) {
+		size_t end = head.find(' ', start);
+		if (end == std::string::npos) {
+			end = head.size();
+		}
+		if (end > start) {
+			params.push_back(head.substr(start, end - start));
+		}
+		start = end + 1;
+	}
+
+	if (params.empty()) {
+		return;
+	}
+
+	const std::string &command = params[0];
+	if (command == "NICK" && params.size() > 1) {
+		m_client.nick = params[1];
+	} else if (command == "NICK" && !trailing.empty()) {
+		m_client.nick = trailing;
+	} else if (command == "USER" && !m_client.registered) {
+		m_client.registered = true;
+		const std::string &nick = m_client.nick;
+		send_line(":" LOADTEST_SERVER_NAME " 001 " + nick + " :Welcome to the load test network " + nick);
+		send_line(":" LOADTEST_SERVER_NAME " 376 " + nick + " :End of /MOTD command.");
+	} else if (command == "PING") {
+		send_line(":" LOADTEST_SERVER_NAME " PONG " LOADTEST_SERVER_NAME " :" +
+				(trailing.empty() && params.size() > 1 ? params[1] : trailing));
+	} else if (command == "JOIN" && params.size() + !trailing.empty() > 1) {
+		const std::string channel = params.size() > 1 ? params[1] : trailing;
+		send_line(":" + m_client.nick + "!bot@" LOADTEST_SERVER_NAME " JOIN :" + channel);
+	} else if (command == "PRIVMSG" && params.size() > 1 && measuring) {
+		record_reply(params[1], trailing, report);
+	}
+}
+
+void LoadTest::record_reply(const std::string &channel, const std::string &text, LoadTestReport &report)
+{
+	const auto now = std::chrono::steady_clock::now();
+
+	// The outbound stage merges consecutive replies to the same target
+	size_t parts = 1;
+	for (size_t pos = text.find(" | "); pos != std::string::npos; pos = text.find(" | ", pos + 3)) {
+		parts++;
+	}
+
+	auto it = m_pending.find(channel);
+	for (size_t i = 0; i < parts; ++i) {
+		if (it == m_pending.end() || it->second.empty()) {
+			report.unmatched_replies++;
+			continue;
+		}
+
+		report.latencies.push_back((uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(
+				now - it->second.front()).count());
+		it->second.pop_front();
+		report.replies++;
+	}
+}
+
+void LoadTest::send_traffic(LoadTestReport &report)
+{
+	const auto now = std::chrono::steady_clock::now();
+	const double elapsed = std::chrono::duration<double>(now - m_load_start).count();
+	const uint64_t target = (uint64_t) (elapsed * m_options.rate);
+
+	std::uniform_int_distribution<uint32_t> channel_dist(0, m_options.channels - 1);
+	std::uniform_int_distribution<uint32_t> user_dist(0, m_options.users - 1);
+	std::uniform_int_distribution<size_t> command_dist(0, m_options.commands.size() - 1);
+	std::uniform_real_distribution<double> ratio_dist(0, 1);
+
+	for (; m_sent < target; ++m_sent) {
+		const std::string channel = "#load" + std::to_string(channel_dist(m_random));
+		const std::string user = "user" + std::to_string(user_dist(m_random));
+
+		std::string text;
+		if (!m_options.commands.empty() && ratio_dist(m_random) < m_options.command_ratio) {
+			text = m_options.commands[command_dist(m_random)];
+			m_pending[channel].push_back(now);
+			report.commands_sent++;
+		} else {
+			text = "just chatting, message " + std::to_string(m_sent);
+			report.chat_sent++;
+		}
+
+		send_line(":" + user + "!" + user + "@" LOADTEST_SERVER_NAME " PRIVMSG " + channel + " :" + text);
+	}
+}
+
+bool LoadTest::run(LoadTestReport &report)
+{
+	if (m_options.channels == 0 || m_options.users == 0) {
+		std::cerr << "At least one channel and one user are required" << std::endl;
+		return false;
+	}
+
+	if (!listen_socket()) {
+		return false;
+	}
+
+	std::cerr << "Waiting for the bot on 127.0.0.1:" << m_options.port << std::endl;
+
+	enum { WAIT_BOT, SETTLE, LOAD, DRAIN } phase = WAIT_BOT;
+	auto phase_end = std::chrono::steady_clock::now() + LOADTEST_REGISTER_TIMEOUT;
+
+	while (true) {
+		struct pollfd fds[2] = {
+				{m_listen_fd, POLLIN, 0},
+				{m_client.fd, (short) (POLLIN | (m_client.out.empty() ? 0 : POLLOUT)), 0},
+		};
+
+		if (poll(fds, m_client.fd >= 0 ? 2 : 1, 1) < 0 && errno != EINTR) {
+			std::cerr << "poll error: " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			accept_client();
+		} else if (m_client.fd >= 0 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) && !read_client()) {
+			if (phase != WAIT_BOT) {
+				return false;
+			}
+		}
+
+		size_t line_end;
+		while ((line_end = m_client.in.find('\n')) != std::string::npos) {
+			std::string line = m_client.in.substr(0, line_end);
+			m_client.in.erase(0, line_end + 1);
+			if (!line.empty() && line.back() == '\r') {
+				line.pop_back();
+			}
+			handle_line(line, report, phase == LOAD || phase == DRAIN);
+		}
+
+		const auto now = std::chrono::steady_clock::now();
+		switch (phase) {
+			case WAIT_BOT:
+				if (m_client.registered) {
+					std::cerr << "Bot registered as " << m_client.nick << ", starting load" << std::endl;
+					phase = SETTLE;
+					phase_end = now + LOADTEST_SETTLE_TIME;
+				} else if (now >= phase_end) {
+					std::cerr << "The bot didn't connect" << std::endl;
+					return false;
+				}
+				break;
+			case SETTLE:
+				if (now >= phase_end) {
+					phase = LOAD;
+					m_load_start = now;
+					phase_end = now + std::chrono::seconds(m_options.duration);
+				}
+				break;
+			case LOAD:
+				send_traffic(report);
+				if (now >= phase_end) {
+					report.elapsed = std::chrono::duration<double>(now - m_load_start).count();
+					phase = DRAIN;
+					phase_end = now + std::chrono::seconds(m_options.drain);
+				}
+				break;
+			case DRAIN: {
+				bool waiting = false;
+				for (const auto &pending: m_pending) {
+					waiting |= !pending.second.empty();
+				}
+
+				if (!waiting || now >= phase_end) {
+					std::sort(report.latencies.begin(), report.latencies.end());
+					return true;
+				}
+				break;
+			}
+		}
+
+		if (!flush_client()) {
+			std::cerr << "Unable to write to the bot: " << strerror(errno) << std::endl;
+			return false;
+		}
+	}
+}
@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct LoadTestOptions
+{
+	uint16_t port = 6667;
+	uint32_t channels = 10;
+	uint32_t users = 100;
+	// Messages per second, over all channels
+	double rate = 50;
+	// Share of the traffic which is .command, the rest is plain chat
+	double command_ratio = 0.5;
+	std::vector<std::string> commands = {".list", ".mail loadtest hello"};
+	uint32_t duration = 30;
+	// seconds to wait for late replies once the load stops
+	uint32_t drain = 5;
+	bool json_output = false;
+};
+
+struct LoadTestReport
+{
+	uint64_t commands_sent = 0;
+	uint64_t chat_sent = 0;
+	uint64_t replies = 0;
+	uint64_t unmatched_replies = 0;
+	double elapsed = 0;
+	// microseconds, sorted
+	std::vector<uint64_t> latencies = {};
+};
+
+/**
+ * Stand-in IRC server driving a swarm of virtual users against the bot.
+ *
+ * The bot connects to it as to any network (irc.server/irc.port). Once it
+ * is registered, the virtual users talk in the load channels at the target
+ * rate. Replies are matched in order with the commands sent to the same
+ * channel, which gives the end-to-end latency of IRCThread, the command
+ * executor and the outbound stage. Coalesced replies (" | ") count once
+ * per merged part.
+ */
+class LoadTest
+{
+public:
+	LoadTest(const LoadTestOptions &options);
+	~LoadTest();
+
+	bool run(LoadTestReport &report);
+
+private:
+	struct Client
+	{
+		int fd = -1;
+		std::string in = "";
+		std::string out = "";
+		std::string nick = "";
+		bool registered = false;
+	};
+
+	bool listen_socket();
+	bool accept_client();
+	bool read_client();
+	bool flush_client();
+	void handle_line(const std::string &line, LoadTestReport &report, bool measuring);
+	void send_line(const std::string &line);
+	void send_traffic(LoadTestReport &report);
+	void record_reply(const std::string &channel, const std::string &text, LoadTestReport &report);
+
+	LoadTestOptions m_options;
+	int m_listen_fd = -1;
+	Client m_client;
+	std::mt19937 m_random;
+
+	std::chrono::steady_clock::time_point m_load_start = {};
+	uint64_t m_sent = 0;
+	// Send time of the commands waiting for a reply, per channel
+	std::unordered_map<std::string, std::deque<std::chrono::steady_clock::time_point>> m_pending = {};
+};
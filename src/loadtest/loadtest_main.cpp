@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) 2017, Vincent Glize <vincent.glize@live.fr>
+ * All rights reserved.
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *   this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation and/or
+ *   other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include "LoadTest.h"
+
+static double percentile(const std::vector<uint64_t> &sorted, const double p)
+{
+	if (sorted.empty()) {
+		return 0;
+	}
+
+	const size_t index = std::min(sorted.size() - 1, (size_t) (p / 100 * sorted.size()));
+	return sorted[index] / 1000.0;
+}
+
+static std::vector<std::string> split_commands(const std::string &list)
+{
+	std::vector<std::string> commands;
+	size_t start = 0;
+	while (start <= list.size()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos) {
+			end = list.size();
+		}
+		if (end > start) {
+			commands.push_back(list.substr(start, end - start));
+		}
+		start = end + 1;
+	}
+	return commands;
+}
+
+static void print_report(const LoadTestOptions &options, const LoadTestReport &report)
+{
+	const uint64_t lost = report.commands_sent - std::min(report.commands_sent, report.replies);
+	const double throughput = report.elapsed > 0 ? report.replies / report.elapsed : 0;
+
+	if (options.json_output) {
+		std::cout << std::fixed << std::setprecision(3)
+				<< "{\"commands_sent\": " << report.commands_sent
+				<< ", \"chat_sent\": " << report.chat_sent
+				<< ", \"replies\": " << report.replies
+				<< ", \"lost\": " << lost
+				<< ", \"unmatched_replies\": " << report.unmatched_replies
+				<< ", \"duration_s\": " << report.elapsed
+				<< ", \"replies_per_s\": " << throughput
+				<< ", \"latency_ms\": {\"p50\": " << percentile(report.latencies, 50)
+				<< ", \"p90\": " << percentile(report.latencies, 90)
+				<< ", \"p99\": " << percentile(report.latencies, 99)
+				<< ", \"max\": " << percentile(report.latencies, 100) << "}}" << std::endl;
+		return;
+	}
+
+	std::cout << std::fixed << std::setprecision(2)
+			<< "Commands sent:     " << report.commands_sent << std::endl
+			<< "Chat lines sent:   " << report.chat_sent << std::endl
+			<< "Replies:           " << report.replies << " (" << lost << " lost, "
+			<< report.unmatched_replies << " unmatched)" << std::endl
+			<< "Throughput:        " << throughput << " replies/s over " << report.elapsed << " s" << std::endl
+			<< "Latency p50:       " << percentile(report.latencies, 50) << " ms" << std::endl
+			<< "Latency p90:       " << percentile(report.latencies, 90) << " ms" << std::endl
+			<< "Latency p99:       " << percentile(report.latencies, 99) << " ms" << std::endl
+			<< "Latency max:       " << percentile(report.latencies, 100) << " ms" << std::endl;
+}
+
+static void print_bot_config()
+{
+	std::cerr << "The bot must accept commands in the #load0..#load<channels - 1> channels, which"
+			<< " a usual bot.yml does not list. Unlisted channels are passive unless:" << std::endl
+			<< "  irc:" << std::endl
+			<< "    default_channel:" << std::endl
+			<< "      passive: false" << std::endl
+			<< "    flood:" << std::endl
+			<< "      interval_ms: 0" << std::endl
+			<< "default_channel goes in each irc.servers entry when several networks are set."
+			<< " Leave commands.rate_limits unset, limited commands get no reply." << std::endl;
+}
+
+static void usage(const char *name)
+{
+	std::cerr << "Usage: " << name << " [options]" << std::endl
+			<< "  --port=<port>             port the bot connects to (irc.port), default 6667" << std::endl
+			<< "  --channels=<count>        channels the traffic is spread over, default 10" << std::endl
+			<< "  --users=<count>           virtual users, default 100" << std::endl
+			<< "  --rate=<lines/s>          total traffic, default 50" << std::endl
+			<< "  --command-ratio=<0..1>    share of .commands in the traffic, default 0.5" << std::endl
+			<< "  --commands=<a,b,...>      commands picked at random, default .list,.mail loadtest hello" << std::endl
+			<< "  --duration=<seconds>      load duration, default 30" << std::endl
+			<< "  --drain=<seconds>         wait for late replies, default 5" << std::endl
+			<< "  --format=json             machine readable report" << std::endl
+			<< "Point the bot to 127.0.0.1, flood pacing disabled to measure raw throughput." << std::endl;
+	print_bot_config();
+}
+
+int main(int argc, char **argv)
+{
+	LoadTestOptions options;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		const size_t eq = arg.find('=');
+		const std::string key = arg.substr(0, eq);
+		const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+		if (key == "--port") {
+			options.port = (uint16_t) std::stoul(value);
+		} else if (key == "--channels") {
+			options.channels = (uint32_t) std::stoul(value);
+		} else if (key == "--users") {
+			options.users = (uint32_t) std::stoul(value);
+		} else if (key == "--rate") {
+			options.rate = std::stod(value);
+		} else if (key == "--command-ratio") {
+			options.command_ratio = std::stod(value);
+		} else if (key == "--commands") {
+			options.commands = split_commands(value);
+		} else if (key == "--duration") {
+			options.duration = (uint32_t) std::stoul(value);
+		} else if (key == "--drain") {
+			options.drain = (uint32_t) std::stoul(value);
+		} else if (arg == "--format=json") {
+			options.json_output = true;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	LoadTest load_test(options);
+	LoadTestReport report;
+	if (!load_test.run(report)) {
+		return 1;
+	}
+
+	print_report(options, report);
+	if (report.commands_sent > 0 && report.replies == 0) {
+		std::cerr << "No command was answered." << std::endl;
+		print_bot_config();
+	}
+	return 0;
+}
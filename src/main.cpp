@@ -28,46 +28,161 @@
 #include "Console.h"
 #include "HttpClient.h"
 #include "Config.h"
+#include "ConfigStore.h"
+#include "ConfigWatcher.h"
+#include "CommandExecutor.h"
+#include "ContentPrefetcher.h"
+#include "Mail.h"
+#include "HttpServer.h"
+#include "GitlabWebhook.h"
+#include "Metrics.h"
+#include "Log.h"
 #include <cstring>
+#include <fstream>
 #include <thread>
-#include <log4cplus/logger.h>
 
-int main (int argc, char **argv)
+static double get_thread_count()
+{
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line)) {
+		if (line.compare(0, 8, "Threads:") == 0) {
+			return std::stod(line.substr(8));
+		}
+	}
+	return 0;
+}
+
+static void register_metrics(IRCThread *irc_thread, CommandExecutor *executor, ContentPrefetcher *prefetcher)
 {
-	log4cplus::Logger logger = log4cplus::Logger::getRoot();
-	log4cplus::Logger irc_log = logger.getInstance(LOG4CPLUS_TEXT("irc"));
+	Metrics::register_callback("bot_threads", "", "Live threads in the process", "gauge", get_thread_count);
+	Metrics::register_callback("bot_command_workers", "", "Command worker threads", "gauge",
+			[executor] { return (double) executor->get_pool_size(); });
+	Metrics::register_callback("bot_command_queue_depth", "", "Commands waiting for a worker", "gauge",
+			[executor] { return (double) executor->get_queue_depth(); });
+	Metrics::register_callback("bot_mail_pending_bytes", "", "Size of mail waiting for delivery", "gauge",
+			[] { return (double) Mail::get_total_size(); });
 
+	if (irc_thread) {
+		Metrics::register_callback("bot_irc_outbound_queue_depth", "", "IRC messages waiting to be sent",
+				"gauge", [irc_thread] { return (double) irc_thread->get_outbound_queue_depth(); });
+	}
+
+	static const char *prefetch_sources[PREFETCH_SOURCE_COUNT] = {"chuck_norris", "joke", "quote"};
+	for (int source = 0; source < PREFETCH_SOURCE_COUNT; ++source) {
+		Metrics::register_callback("bot_prefetch_buffered", std::string("source=\"") + prefetch_sources[source] + "\"",
+				"Prefetched items ready to be served", "gauge", [prefetcher, source] {
+					return (double) prefetcher->get_buffered((PrefetchSource) source);
+				});
+	}
 
+	CommandHandler::register_metrics();
+}
+
+int main (int argc, char **argv)
+{
 	Config *cfg = new Config();
 	if (!cfg->load_configuration()) {
 		return 1;
 	}
 
+	Log::start(cfg);
+
+	// Reloaded snapshots are published here, cfg keeps the startup-only settings
+	ConfigStore *config_store = new ConfigStore(cfg);
+	ConfigWatcher *config_watcher = new ConfigWatcher(config_store, cfg->get_config_path());
+	config_watcher->start();
+
+	Mail::configure(cfg);
+	if (!Mail::open_log(cfg)) {
+		Log::stop();
+		return 1;
+	}
+
+	HttpClient *http_client = new HttpClient(cfg);
+	http_client->start();
+
+	ContentPrefetcher *prefetcher = new ContentPrefetcher(cfg, http_client);
+	prefetcher->start();
+
+	CommandExecutor *executor = new CommandExecutor(cfg, config_store, http_client, prefetcher);
 	IRCThread *irc_thread = nullptr;
 	std::thread irc;
 
 	if (cfg->is_irc_enabled()) {
-		irc_thread = new IRCThread(cfg);
-		irc = std::thread([irc_thread, cfg] {
-			irc_thread->run(cfg);
+		irc_thread = new IRCThread(cfg, config_store, executor);
+	}
+
+	executor->start(irc_thread);
+
+	if (irc_thread) {
+		irc = std::thread([irc_thread] {
+			irc_thread->run();
 		});
 	}
 
-	Console *console = new Console(irc_thread);
+	register_metrics(irc_thread, executor, prefetcher);
+
+	HttpServer *httpd = nullptr;
+	GitlabWebhook *gitlab_webhook = nullptr;
+	if (cfg->is_httpd_enabled()) {
+		httpd = new HttpServer(cfg->get_httpd_port(), cfg->get_httpd_max_body_size());
+		httpd->register_handler("GET", "/metrics", [](const HttpRequest &request, HttpResponse &response) {
+			response.content_type = "text/plain; version=0.0.4; charset=utf-8";
+			response.body = Metrics::render();
+		});
+
+		if (cfg->get_gitlab_webhook_token().empty()) {
+			LOG_INFO("bot", "GitLab webhooks disabled, gitlab.webhook_token is not set");
+		} else {
+			gitlab_webhook = new GitlabWebhook(cfg, config_store, irc_thread);
+			gitlab_webhook->start();
+			httpd->register_handler("POST", cfg->get_gitlab_webhook_path(),
+					[gitlab_webhook](const HttpRequest &request, HttpResponse &response) {
+						gitlab_webhook->handle_request(request, response);
+					});
+		}
+
+		if (!httpd->start()) {
+			delete httpd;
+			httpd = nullptr;
+		}
+	}
+
+	Console *console = new Console(irc_thread, executor);
 	std::thread co([console, cfg] { console->run(cfg); });
 
 	while(console->is_running()) {
 		std::this_thread::sleep_for(std::chrono::milliseconds(50));
 	}
 
+	// Metrics callbacks read the other components, stop serving them first
+	delete httpd;
+	delete gitlab_webhook;
+
 	if (irc_thread) {
 		irc_thread->stop();
 		co.join();
 	}
 
-	irc.join();
+	if (irc.joinable()) {
+		irc.join();
+	}
+
+	executor->stop();
+	delete executor;
+	Mail::close_log();
+
+	// Stop HTTP first, pending prefetch callbacks still reference the prefetcher
+	http_client->stop();
+	prefetcher->stop();
+	delete prefetcher;
+	delete http_client;
 
+	delete config_watcher;
+	delete config_store;
 	delete cfg;
 
+	Log::stop();
 	return 1;
 }